@@ -1,12 +1,16 @@
+#ifndef _XOPEN_SOURCE
 #define _XOPEN_SOURCE 600
+#endif
 #define _FILE_OFFSET_BITS 64
 
 #ifndef TINY_ISO_H
 #define TINY_ISO_H
 
 #include <stdint.h>
+#include <stdbool.h>
 #include <sys/types.h>
 #include <stdio.h>
+#include <pthread.h>
 
 #define BP(a,b) [(b) - (a) + 1]
 #define MIN(a,b) (((a)<(b))?(a):(b))
@@ -17,6 +21,23 @@
 #define RESV_SECTORS 16
 #define SECTOR_TAIL 255
 #define EXTENT_FLAG 0x80
+#define NODE_NONE 0xFFFFFFFF
+#define SESSION_ALIGN 16
+#define SESSION_GAP 11400
+#define TREE_MAGIC 0x544E4954
+#define TREE_VERSION 1
+#define HEADER_SIZE 4096
+#define HEADER_GAP 65536
+#define HEADER_BATCH 1048576
+#define EXTENT_MAX 0xFFFFF800
+#define COPY_CHUNK 1048576
+#define TRACE_BUCKETS 40
+#define TRACE_RING 65536
+#define SEARCH_THREADS 4
+#define SEARCH_CHUNK 1048576
+#define SEARCH_FILTERS 8
+#define DIR_WINDOW 64
+#define DU_THREADS 4
 
 /**** Internal Responses ****/
 
@@ -32,6 +53,9 @@ typedef enum {
     TNI_ERR_ISO,
     TNI_ERR_DIR,
     TNI_ERR_CB,
+    TNI_ERR_ORDER,
+
+    TNI_PENDING,
 
 } tni_response_t;
 
@@ -161,6 +185,9 @@ typedef struct tni_record_s {
     uint32_t id_length;
     char *record_id;
 
+    void *header;
+    size_t header_size;
+
 } tni_record_t;
 
 typedef enum {
@@ -168,6 +195,7 @@ typedef enum {
     TNI_SIGNAL_OK,
     TNI_SIGNAL_STOP,
     TNI_SIGNAL_ERR,
+    TNI_SIGNAL_SKIP,
 
 } tni_signal_t;
 
@@ -180,12 +208,39 @@ typedef struct {
 
 typedef struct {
 
+    tni_response_t (*read_at)(void *ctx, void *buf, size_t size, off_t pos);
+    tni_response_t (*size)(void *ctx, off_t *size);
+    void *(*map)(void *ctx, off_t pos, size_t size);
+    tni_response_t (*close)(void *ctx);
+    tni_response_t (*prefetch)(void *ctx, off_t pos, size_t size);
+
+} tni_backend_ops_t;
+
+typedef struct {
+
+    const tni_backend_ops_t *ops;
+    void *ctx;
+
+} tni_backend_t;
+
+typedef struct {
+
+    uint32_t start;
+    uint32_t lba_count;
+
+} tni_session_t;
+
+typedef struct {
+
+    uint32_t session_start;
     uint32_t lba_count;
     uint16_t block_size;
     tni_parse_t parse_type;
 
     bool is_header;
-	FILE *file_ptr;
+    size_t header_size;
+
+    tni_backend_t backend;
     tni_record_t *root_dir;
 
 } tni_iso_t;
@@ -204,12 +259,10 @@ typedef struct {
 
     tni_iso_t *iso;
 
-    off_t block_pos, block_end;
-    off_t rel_pos, rel_end;
-
-    void *block;
+    uint8_t *data;
+    off_t pos, end;
 
-} record_state_t;
+} buffer_state_t;
 
 typedef struct {
 
@@ -219,12 +272,704 @@ typedef struct {
 } generator_t;
 
 
+/**** Scan Structs ****/
+
+typedef struct {
+
+    tni_iso_t *iso;
+
+    tni_extent_t *extent;
+    uint32_t sector, sector_count;
+    off_t rel_pos;
+
+    uint32_t need_lba, need_count;
+    uint8_t *block;
+
+    tni_record_t record;
+    bool in_record;
+
+} tni_dir_scan_t;
+
+typedef struct {
+
+    uint8_t *data;
+    size_t capacity;
+    uint32_t lba, count;
+    bool prefetch;
+
+} dir_window_t;
+
+typedef struct {
+
+    type_func_t is_type;
+
+    uint32_t need_lba;
+    uint8_t *block;
+
+} tni_desc_scan_t;
+
+
+/**** Header Structs ****/
+
+typedef struct {
+
+    off_t pos;
+    size_t size;
+    size_t offset;
+    uint32_t index;
+
+} header_ref_t;
+
+
+/**** Batch Structs ****/
+
+typedef struct {
+
+    uint32_t count, capacity;
+
+    uint32_t *lba;
+    uint32_t *length;
+    uint8_t *flags;
+    uint32_t *name_off;
+    uint8_t *name_len;
+
+    uint8_t *names;
+    size_t names_size;
+
+} tni_dir_batch_t;
+
+typedef tni_response_t (*batch_func_t)(tni_dir_batch_t *, uint32_t, uint32_t, uint16_t);
+
+
+/**** Tree Structs ****/
+
+typedef struct {
+
+    uint32_t lba;
+    uint32_t length;
+
+} tni_span_t;
+
+typedef struct {
+
+    uint32_t parent;
+    uint32_t first_child;
+    uint32_t next_sibling;
+
+    uint32_t name_off;
+    uint16_t name_len;
+    uint8_t flags;
+    uint8_t reserved;
+
+    uint32_t lba;
+    uint32_t length;
+
+} tni_node_t;
+
+typedef struct {
+
+    uint16_t block_size;
+    tni_parse_t parse_type;
+
+    tni_node_t *nodes;
+    uint32_t node_num, node_cap;
+
+    tni_span_t *extents;
+    uint32_t extent_num, extent_cap;
+
+    char *names;
+    uint32_t names_len, names_cap;
+
+} tni_tree_t;
+
+typedef struct {
+
+    uint32_t magic, version;
+    uint16_t block_size, parse_type;
+
+    uint32_t node_num;
+    uint32_t extent_num;
+    uint32_t names_len;
+
+} tree_file_t;
+
+typedef struct {
+
+    uint32_t lba;
+    uint32_t length;
+    uint32_t node;
+
+} tree_dir_t;
+
+typedef struct {
+
+    uint32_t *slots;
+    uint32_t count, capacity;
+
+} hash_set_t;
+
+
+/**** Checksum Structs ****/
+
+typedef struct {
+
+    tni_signal_t (*fn)(off_t, off_t, void *);
+    void *args;
+
+} tni_progress_t;
+
+typedef struct {
+
+    uint32_t state[4];
+    uint64_t length;
+    uint8_t tail[64];
+
+} md5_ctx_t;
+
+typedef struct {
+
+    char hash_sum[33];
+    char fragment_sums[61];
+    uint64_t skip_sectors;
+    uint32_t fragment_count;
+
+} md5_info_t;
+
+typedef struct {
+
+    tni_iso_t *iso;
+    off_t total;
+
+    uint8_t *buffer[2];
+    size_t length[2];
+    bool full[2];
+
+    bool stop;
+    tni_response_t status;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+
+} md5_reader_t;
+
+
+/**** Stream Structs ****/
+
+typedef struct {
+
+    char *path;
+    tni_record_t *record;
+
+    off_t offset;
+    void *data;
+    size_t size;
+
+} tni_chunk_t;
+
+typedef struct {
+
+    tni_signal_t (*fn)(tni_chunk_t *, void *);
+    void *args;
+
+} tni_stream_callback_t;
+
+typedef struct {
+
+    size_t window_size;
+    size_t max_pending;
+
+} tni_stream_opts_t;
+
+typedef struct {
+
+    uint32_t refs;
+    char *path;
+    tni_record_t record;
+
+} stream_entry_t;
+
+typedef struct {
+
+    uint32_t lba;
+    uint32_t remaining;
+    off_t offset;
+
+    stream_entry_t *entry;
+    uint8_t *dir_data;
+
+} stream_item_t;
+
+typedef struct {
+
+    int fd;
+    tni_iso_t iso;
+
+    uint8_t *ring;
+    uint32_t ring_sectors;
+    uint32_t win_end, win_fill;
+
+    off_t base;
+    bool seekable;
+    uint8_t *spill;
+    hash_set_t dirs;
+
+    stream_item_t *heap;
+    size_t heap_len, heap_cap, max_pending;
+
+} stream_state_t;
+
+
+/**** Diff Structs ****/
+
+typedef enum {
+
+    TNI_DIFF_ADDED,
+    TNI_DIFF_REMOVED,
+    TNI_DIFF_CHANGED,
+
+} tni_diff_kind_t;
+
+typedef struct {
+
+    tni_diff_kind_t kind;
+    char *path;
+
+    tni_record_t *rec_a;
+    tni_record_t *rec_b;
+
+    uint32_t range_num;
+    range_t *range_list;
+
+} tni_diff_entry_t;
+
+typedef struct {
+
+    tni_signal_t (*fn)(tni_diff_entry_t *, void *);
+    void *args;
+
+} tni_diff_callback_t;
+
+typedef struct {
+
+    tni_record_t *list;
+    size_t length, capacity;
+
+} record_list_t;
+
+typedef struct {
+
+    tni_iso_t *iso_a, *iso_b;
+    tni_diff_callback_t *cb;
+
+    char *path;
+    size_t path_len, path_cap;
+
+    uint8_t *buf_a, *buf_b;
+
+    range_t *range_list;
+    size_t range_num, range_cap;
+
+} diff_state_t;
+
+
+/**** Walk Structs ****/
+
+typedef struct {
+
+    tni_signal_t (*fn)(char *, tni_record_t *, void *);
+    void *args;
+
+} tni_walk_callback_t;
+
+typedef struct {
+
+    uint32_t lba;
+    char *path;
+    tni_record_t record;
+
+} walk_item_t;
+
+typedef struct {
+
+    walk_item_t *heap;
+    size_t heap_len, heap_cap;
+
+    char *path;
+    size_t path_cap;
+
+} walk_state_t;
+
+
+/**** Remaster Structs ****/
+
+typedef enum {
+
+    TNI_CHANGE_PUT,
+    TNI_CHANGE_DELETE,
+
+} tni_change_kind_t;
+
+typedef struct {
+
+    tni_change_kind_t kind;
+    char *path;
+    char *source;
+
+} tni_change_t;
+
+typedef struct remaster_node_s {
+
+    char *name;
+    long change;
+
+    struct remaster_node_s *child;
+    struct remaster_node_s *next;
+
+} remaster_node_t;
+
+typedef struct {
+
+    bool is_dir;
+    size_t unit;
+
+    uint8_t *raw;
+    size_t raw_len, id_len;
+
+    bool has_record;
+    tni_record_t record;
+    remaster_node_t *node;
+
+} remaster_entry_t;
+
+typedef struct {
+
+    uint32_t lba;
+    off_t size;
+
+} remaster_put_t;
+
+typedef struct {
+
+    int out_fd;
+    tni_iso_t *iso;
+    bool primary;
+
+    tni_change_t *changes;
+    remaster_put_t *puts;
+
+    uint32_t next_lba;
+    uint8_t rec_time[7];
+    hash_set_t dirs;
+
+} remaster_state_t;
+
+
+/**** Search Structs ****/
+
+typedef struct {
+
+    char **list;
+    size_t *lengths;
+    size_t num;
+
+} tni_patterns_t;
+
+typedef struct {
+
+    tni_signal_t (*fn)(char *, size_t, off_t, void *);
+    void *args;
+
+} tni_search_callback_t;
+
+typedef struct {
+
+    unsigned threads;
+    size_t chunk_size;
+
+} tni_search_opts_t;
+
+typedef struct {
+
+    char *path;
+    uint32_t lba;
+    tni_record_t record;
+
+} search_item_t;
+
+typedef struct {
+
+    uint8_t **patterns;
+    size_t *lengths;
+    size_t num, max_len;
+
+    size_t *order;
+    size_t bucket[257];
+    bool first[256];
+
+    uint8_t filters[SEARCH_FILTERS][2];
+    size_t filter_num;
+    bool use_filters, pair_filter;
+
+} search_matcher_t;
+
+typedef struct {
+
+    tni_iso_t *iso;
+    tni_search_callback_t *cb;
+    search_matcher_t matcher;
+    size_t chunk_size;
+
+    search_item_t *items;
+    size_t item_num, item_cap;
+    size_t next_item;
+
+    pthread_mutex_t lock;
+    bool stop;
+    tni_response_t ret_val;
+
+} search_state_t;
+
+
+/**** File Stream Structs ****/
+
+typedef struct {
+
+    tni_iso_t *iso;
+    tni_record_t *rec;
+
+    tni_extent_t *extent;
+    off_t extent_pos;
+
+    off_t pos, fill_pos;
+    size_t window;
+
+    uint8_t *buffer[2];
+    size_t capacity[2];
+    off_t start[2];
+    size_t length[2];
+    bool full[2];
+    int cur, fill_idx;
+
+    uint64_t generation;
+    bool stop;
+    tni_response_t status;
+
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+
+} tni_file_stream_t;
+
+
+/**** Usage Structs ****/
+
+typedef struct {
+
+    char *path;
+    uint64_t bytes;
+    uint64_t files, dirs, extents;
+
+} tni_du_entry_t;
+
+typedef struct {
+
+    tni_du_entry_t *entries;
+    size_t entry_num;
+
+} tni_du_table_t;
+
+typedef struct {
+
+    uint32_t lba;
+    char *name;
+
+} du_child_t;
+
+typedef struct {
+
+    tni_record_t record;
+    uint64_t bytes, files, extents;
+
+    du_child_t *children;
+    size_t child_num;
+
+    uint32_t parent;
+    tni_du_entry_t total;
+
+} du_node_t;
+
+typedef struct {
+
+    uint32_t lba;
+    uint32_t node;
+
+} du_index_t;
+
+typedef struct {
+
+    tni_iso_t *iso;
+
+    du_node_t *nodes;
+    uint32_t node_num, node_cap;
+    uint32_t next_node, busy;
+    hash_set_t seen;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    bool stop;
+    tni_response_t ret_val;
+
+} du_state_t;
+
+
+/**** Trace Structs ****/
+
+typedef enum {
+
+    TNI_OP_OPEN_ISO,
+    TNI_OP_SEARCH_DESC,
+    TNI_OP_DIR_SECTOR,
+    TNI_OP_PARSE_RECORD,
+    TNI_OP_READ_FILE,
+    TNI_OP_COUNT,
+
+} tni_trace_op_t;
+
+typedef struct {
+
+    uint64_t count;
+    uint64_t total_ns, max_ns;
+    uint64_t buckets[TRACE_BUCKETS];
+
+} tni_trace_hist_t;
+
+typedef struct {
+
+    tni_trace_op_t op;
+    uint64_t start_ns, dur_ns;
+    unsigned long thread;
+
+} tni_trace_event_t;
+
+typedef struct trace_local_s {
+
+    pthread_mutex_t lock;
+    bool in_use;
+
+    tni_trace_hist_t hists[TNI_OP_COUNT];
+    tni_trace_event_t *events;
+    uint64_t event_num;
+
+    struct trace_local_s *next;
+
+} trace_local_t;
+
+
 /**** API Functions ****/
 
+tni_response_t tni_backend_file(tni_backend_t *backend, char *path);
+tni_response_t tni_backend_memory(tni_backend_t *backend, const void *data, size_t size);
+
 tni_response_t tni_open_iso(tni_iso_t *iso, char *path, tni_parse_t parse_type, bool is_header);
+tni_response_t tni_open_iso_backend(tni_iso_t *iso, tni_backend_t *backend, tni_parse_t parse_type, bool is_header);
+
+/*
+ * A session borrows its backend, so several may share one: release each with
+ * tni_close_session and close the backend once afterwards. tni_open_iso and
+ * tni_open_iso_backend hand the backend to the image; tni_close_iso closes it.
+ */
+tni_response_t tni_open_session(tni_iso_t *iso, tni_backend_t *backend, tni_parse_t parse_type, bool is_header, uint32_t start);
+void tni_close_session(tni_iso_t *iso);
+tni_response_t tni_list_sessions(tni_backend_t *backend, tni_session_t **sessions, uint32_t *session_num);
+tni_response_t tni_init_iso(tni_iso_t *iso, iso_vol_desc_t *desc, tni_parse_t parse_type, bool is_header);
 tni_response_t tni_close_iso(tni_iso_t *iso);
 tni_response_t tni_read_file(void *buf, tni_iso_t *iso, tni_record_t *rec, off_t rel_pos, size_t size);
 tni_response_t tni_read_block(void *block, tni_iso_t *iso, uint32_t lba);
 tni_response_t tni_traverse_dir(tni_iso_t *iso, tni_record_t *dir, tni_callback_t *cb);
+tni_response_t tni_find_in_dir(tni_iso_t *iso, tni_record_t *dir, char *name, tni_record_t *rec);
+
+/*
+ * Returning TNI_SIGNAL_SKIP for a directory keeps the walk out of it.
+ */
+tni_response_t tni_walk(tni_iso_t *iso, tni_walk_callback_t *cb);
+
+/*
+ * Resumable parsing without I/O: a step returning TNI_PENDING wants sector
+ * need_lba handed back through the matching feed call. A fed sector is
+ * borrowed until the next TNI_PENDING, so it must stay valid until then.
+ */
+tni_response_t tni_desc_scan_init(tni_desc_scan_t *scan, tni_parse_t parse_type, uint32_t start);
+tni_response_t tni_desc_scan_step(tni_desc_scan_t *scan, iso_vol_desc_t *desc);
+tni_response_t tni_desc_scan_feed(tni_desc_scan_t *scan, uint32_t lba, void *sector);
+tni_response_t tni_scan_init(tni_dir_scan_t *scan, tni_iso_t *iso, tni_record_t *dir);
+tni_response_t tni_scan_step(tni_dir_scan_t *scan, tni_record_t *rec);
+tni_response_t tni_scan_feed(tni_dir_scan_t *scan, uint32_t lba, void *sector);
+void tni_scan_free(tni_dir_scan_t *scan);
+
+tni_response_t tni_read_dir_batch(tni_iso_t *iso, tni_record_t *dir, tni_dir_batch_t *batch);
+void tni_free_dir_batch(tni_dir_batch_t *batch);
+tni_response_t tni_load_tree(tni_iso_t *iso, tni_tree_t *tree);
+
+/*
+ * Directories whose extent matches one in prev are copied from it instead of
+ * being read, so only those rewritten by a newer session touch the image.
+ */
+tni_response_t tni_update_tree(tni_iso_t *iso, tni_tree_t *tree, tni_tree_t *prev);
+tni_response_t tni_save_tree(tni_tree_t *tree, char *path);
+tni_response_t tni_restore_tree(tni_tree_t *tree, char *path);
+void tni_free_tree(tni_tree_t *tree);
+char *tni_tree_name(tni_tree_t *tree, uint32_t node);
+off_t tni_tree_size(tni_tree_t *tree, uint32_t node);
+tni_response_t tni_tree_lookup(tni_tree_t *tree, char *path, uint32_t *node);
+tni_response_t tni_tree_record(tni_tree_t *tree, uint32_t node, tni_record_t *rec);
+void tni_free_record(tni_record_t *rec);
+tni_response_t tni_verify_implanted_md5(tni_iso_t *iso, tni_progress_t *progress);
+
+/*
+ * Extents behind the retained window are read back with pread when fd is
+ * seekable; on a pipe they fail with TNI_ERR_ORDER.
+ */
+tni_response_t tni_stream_iso(int fd, tni_parse_t parse_type, tni_stream_opts_t *opts, tni_stream_callback_t *cb);
+
+/*
+ * Extents found at the same LBA and length in both images are taken as
+ * identical without reading them, which holds for images derived from one
+ * another (appended sessions, remastered copies).
+ */
+tni_response_t tni_diff(tni_iso_t *iso_a, tni_iso_t *iso_b, tni_diff_callback_t *cb);
+
+/*
+ * The source image is cloned whole and new files, rewritten directories
+ * and path tables are appended after it; descriptors are patched in place.
+ */
+tni_response_t tni_remaster(tni_iso_t *iso, tni_change_t *changes, size_t change_num, char *out_path);
+
+/*
+ * Files are scanned in LBA order by a pool of threads; callbacks are
+ * serialized, and report the pattern index and its offset in the file.
+ */
+tni_response_t tni_search(tni_iso_t *iso, tni_patterns_t *patterns, tni_search_opts_t *opts, tni_search_callback_t *cb);
+
+/* The record must stay valid until the stream is closed. */
+tni_response_t tni_file_stream_open(tni_file_stream_t *stream, tni_iso_t *iso, tni_record_t *rec);
+tni_response_t tni_file_stream_read(tni_file_stream_t *stream, void *buf, size_t size, size_t *got);
+tni_response_t tni_file_stream_seek(tni_file_stream_t *stream, off_t pos);
+tni_response_t tni_file_stream_close(tni_file_stream_t *stream);
+
+/*
+ * Each directory extent is scanned once; a directory reachable through
+ * several parents is listed and counted under the first path found.
+ */
+tni_response_t tni_du(tni_iso_t *iso, unsigned threads, tni_du_table_t *table);
+tni_response_t tni_du_lookup(tni_du_table_t *table, char *path, tni_du_entry_t **entry);
+void tni_du_free(tni_du_table_t *table);
+
+#ifdef TNI_TRACE
+/* Bucket i of a histogram counts operations that took [2^i, 2^(i+1)) ns. */
+tni_response_t tni_trace_hist(tni_trace_op_t op, tni_trace_hist_t *hist);
+void tni_trace_ring(bool enabled);
+tni_response_t tni_trace_dump(char *path);
+void tni_trace_reset(void);
+#endif
 
 #endif
@@ -1,4 +1,8 @@
+#ifdef __linux__
+#define _GNU_SOURCE
+#else
 #define _XOPEN_SOURCE 600
+#endif
 #define _FILE_OFFSET_BITS 64
 
 #include <stddef.h>
@@ -9,8 +13,25 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <errno.h>
 #include <iconv.h>
 
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <strings.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#endif
+
 #include "tni.h"
 
 /**** Little-Endian Parsers ****/
@@ -46,14 +67,15 @@ tni_response_t handle_iconv(char *from_code, char *to_code,
     size_t iconv_ret, real_space;
 
     id_transform = iconv_open(to_code, from_code);
-    if (iconv_ret == -1) {
+    if (id_transform == (iconv_t) -1) {
         ret_val = TNI_ERROR;
         goto exit_normal;
     }
 
     iconv_ret = iconv(id_transform, &from_buff, &from_space,
                         &to_buff, to_space);
-    if (iconv_ret < 0) {
+    if (iconv_ret == (size_t) -1) {
+        iconv_close(id_transform);
         ret_val = TNI_ERROR;
         goto exit_normal;
     }
@@ -93,13 +115,12 @@ tni_response_t handle_alloc(void **mem, size_t count, size_t size, bool clear) {
 }
 
 static
-tni_response_t handle_fopen(FILE **file, char *filename, char *mode) {
+tni_response_t handle_open(int *fd, char *filename, int flags) {
 
     tni_response_t ret_val;
 
-    *file = fopen(filename, mode);
-
-    if (file == NULL) {
+    *fd = open(filename, flags, 0644);
+    if (*fd == -1) {
         ret_val = TNI_ERR_FILE;
         goto exit_normal;
     }
@@ -110,12 +131,12 @@ tni_response_t handle_fopen(FILE **file, char *filename, char *mode) {
 }
 
 static
-tni_response_t handle_fclose(FILE *file) {
+tni_response_t handle_close(int fd) {
 
     tni_response_t ret_val;
     int close_ret;
 
-    close_ret = fclose(file);
+    close_ret = close(fd);
     if (close_ret != 0) {
         ret_val = TNI_ERR_FILE;
         goto exit_normal;
@@ -127,15 +148,25 @@ tni_response_t handle_fclose(FILE *file) {
 }
 
 static
-tni_response_t handle_fseek(FILE *file, off_t loc, int whence) {
+tni_response_t handle_pread(int fd, void *buf, size_t size, off_t pos) {
 
     tni_response_t ret_val;
-    int seek_ret;
+    ssize_t read_ret;
 
-    seek_ret = fseeko(file, loc, whence);
-    if (seek_ret != 0) {
-        ret_val = TNI_ERR_FILE;
-        goto exit_normal;
+    while (size != 0) {
+        read_ret = pread(fd, buf, size, pos);
+        if (read_ret == -1 && errno == EINTR) {
+            continue;
+        }
+
+        if (read_ret <= 0) {
+            ret_val = TNI_ERR_FILE;
+            goto exit_normal;
+        }
+
+        buf += read_ret;
+        pos += read_ret;
+        size -= read_ret;
     }
 
     ret_val = TNI_OK;
@@ -144,15 +175,25 @@ tni_response_t handle_fseek(FILE *file, off_t loc, int whence) {
 }
 
 static
-tni_response_t handle_fread(void *buf, size_t size, size_t count, FILE *file) {
+tni_response_t handle_pwrite(int fd, void *buf, size_t size, off_t pos) {
 
     tni_response_t ret_val;
-    size_t read_ret;
+    ssize_t write_ret;
 
-    read_ret = fread(buf, size, count, file);
-    if (read_ret < 1) {
-        ret_val = TNI_ERR_FILE;
-        goto exit_normal;
+    while (size != 0) {
+        write_ret = pwrite(fd, buf, size, pos);
+        if (write_ret == -1 && errno == EINTR) {
+            continue;
+        }
+
+        if (write_ret <= 0) {
+            ret_val = TNI_ERR_FILE;
+            goto exit_normal;
+        }
+
+        buf += write_ret;
+        pos += write_ret;
+        size -= write_ret;
     }
 
     ret_val = TNI_OK;
@@ -161,45 +202,31 @@ tni_response_t handle_fread(void *buf, size_t size, size_t count, FILE *file) {
 }
 
 
-/**** Descriptor Parsing ****/
-
 static
-bool detect_pvd(iso_vol_desc_t *desc) {
-    return desc->vol_desc_type[0] == 1;
-}
+tni_response_t handle_read(int fd, void *buf, size_t size, size_t *got) {
 
-static
-bool detect_joliet(iso_vol_desc_t *desc) {
-    if (desc->vol_desc_type[0] == 2) {
-        if (desc->esc_sequences[0] == 0x25) {
-            if (desc->esc_sequences[1] == 0x2f) {
-                switch (desc->esc_sequences[2]) {
-                    case 0x40:
-                    case 0x43:
-                    case 0x45:
-                        return true;
-                }
-            }
+    tni_response_t ret_val;
+    ssize_t read_ret;
+
+    *got = 0;
+    while (size != 0) {
+        read_ret = read(fd, buf, size);
+        if (read_ret == -1 && errno == EINTR) {
+            continue;
         }
-    }
-    return false;
-}
 
-static
-tni_response_t read_desc(iso_vol_desc_t *desc, FILE *file_ptr, off_t pos) {
-    
-    tni_response_t ret_val;
+        if (read_ret < 0) {
+            ret_val = TNI_ERR_FILE;
+            goto exit_normal;
+        }
 
-    ret_val = handle_fseek(file_ptr, pos, SEEK_SET);
-    if (ret_val != TNI_OK) {
-        ret_val = TNI_ERROR;
-        goto exit_normal;
-    }
+        if (read_ret == 0) {
+            break;
+        }
 
-    ret_val = handle_fread((void *) desc, DESC_SIZE, 1, file_ptr);
-    if (ret_val != TNI_OK) {
-        ret_val = TNI_ERROR;
-        goto exit_normal;
+        buf += read_ret;
+        size -= read_ret;
+        *got += read_ret;
     }
 
     ret_val = TNI_OK;
@@ -208,551 +235,7484 @@ tni_response_t read_desc(iso_vol_desc_t *desc, FILE *file_ptr, off_t pos) {
 }
 
 static
-tni_response_t search_desc(iso_vol_desc_t *desc, FILE *file_ptr,
-                            type_func_t is_type) {
+tni_response_t handle_write(int fd, void *buf, size_t size) {
 
     tni_response_t ret_val;
-    off_t cur_pos;
-
-    cur_pos = SECTOR_SIZE * RESV_SECTORS;
-
-    while (true) {
-
-        ret_val = read_desc(desc, file_ptr, cur_pos);
-        if (ret_val != TNI_OK) {
-            ret_val = TNI_ERROR;
-            goto exit_normal;
-        }
+    ssize_t write_ret;
 
-        if (is_type(desc)) {
-            ret_val = TNI_OK;
-            goto exit_normal;
+    while (size != 0) {
+        write_ret = write(fd, buf, size);
+        if (write_ret == -1 && errno == EINTR) {
+            continue;
         }
 
-        if (desc->vol_desc_type[0] == SECTOR_TAIL) {
-            ret_val = TNI_FAIL;
+        if (write_ret <= 0) {
+            ret_val = TNI_ERR_FILE;
             goto exit_normal;
         }
 
-        cur_pos += DESC_SIZE;
+        buf += write_ret;
+        size -= write_ret;
     }
 
+    ret_val = TNI_OK;
     exit_normal:
         return ret_val;
 }
 
-
-/**** Record Parsing ****/
-
-static
-tni_response_t run_generator(void **output, generator_t *d_gen) {
-    return d_gen->generate(output, d_gen->state);
-}
-
 static
-tni_response_t single_generator(void **output, void *raw_state) {
+tni_response_t handle_realloc(void **mem, size_t count, size_t size) {
 
     tni_response_t ret_val;
-    single_state_t *state;
+    void *in_mem;
 
-    state = (single_state_t *) raw_state;
-    if (!(state->parsed)) {
-        *output = (void *) state->root_dir;
-        state->parsed = true;
-        ret_val = TNI_OK;
-    } else {
-        ret_val = TNI_FAIL;
+    in_mem = realloc(*mem, count * size);
+    if (in_mem == NULL) {
+        ret_val = TNI_ERR_MEM;
+        goto exit_normal;
     }
 
-    return ret_val;
+    *mem = in_mem;
+    ret_val = TNI_OK;
+
+    exit_normal:
+        return ret_val;
 }
 
-static
-tni_response_t record_generator(void **output, void *raw_state) {
+/**** Tracing ****/
 
-    tni_response_t ret_val;
-    bool is_rec, iso_valid, final_block;
+#ifdef TNI_TRACE
 
-    record_state_t *state;
-    iso_dir_record_t *raw_rec;
-    tni_iso_t *iso;
-    off_t t_end;
+#define TRACE_BEGIN(name) uint64_t name = trace_now()
+#define TRACE_END(op, name) trace_record(op, name)
 
-    if (output == NULL || raw_state == NULL) {
-        ret_val = TNI_ERROR;
-        goto exit_normal;
-    }
+static const char *trace_names[TNI_OP_COUNT] = {
+    "open_iso", "search_desc", "dir_sector", "parse_record", "read_file",
+};
 
-    state = (record_state_t *) raw_state;
-    iso = state->iso;
+/*
+ * Each thread records into its own trace_local_t, so tracing never makes
+ * parallel scanners wait on one another. trace_lock only guards the list,
+ * which the readers walk to merge the per-thread data. A thread's slot is
+ * handed to the next new thread once it exits, keeping what it recorded.
+ */
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t trace_once = PTHREAD_ONCE_INIT;
+static pthread_key_t trace_key;
+static trace_local_t *trace_locals;
+static bool trace_ring_on;
 
-    if (state->block_pos >= state->block_end) {
-        ret_val = TNI_FAIL;
-        goto exit_normal;
-    }
+static
+uint64_t trace_now(void) {
 
-    final_block = state->block_pos == state->block_end - 1;
-    t_end = (final_block)? state->rel_end : iso->block_size;
+    struct timespec now;
 
-    if (state->rel_pos < t_end - sizeof(iso_dir_record_t)) {
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return ((uint64_t) now.tv_sec * 1000000000) + (uint64_t) now.tv_nsec;
+}
 
-        raw_rec = (iso_dir_record_t *) (state->block + state->rel_pos);
-        is_rec = raw_rec->len_dr[0] != 0;
-        iso_valid = state->rel_pos + raw_rec->len_dr[0] <= iso->block_size;
+static
+void trace_release(void *raw_local) {
 
-        if (is_rec) {
-            if (iso_valid) {
-                *output = (void *) raw_rec;
-                state->rel_pos += raw_rec->len_dr[0];
-                ret_val = TNI_OK;
-                goto exit_normal;
+    pthread_mutex_lock(&trace_lock);
+    ((trace_local_t *) raw_local)->in_use = false;
+    pthread_mutex_unlock(&trace_lock);
+}
 
-            } else {
-                ret_val = TNI_ERR_ISO;
-                goto exit_normal;
-            }
-            goto exit_normal;
-        }
-    }
-    state->block_pos += 1;
+static
+void trace_key_init(void) {
+    pthread_key_create(&trace_key, trace_release);
+}
 
-    if (final_block) {
-        state->rel_pos = state->rel_end;
-        ret_val = TNI_FAIL;
-        goto exit_normal;
-    }
+static
+trace_local_t *trace_local(void) {
 
-    ret_val = handle_fseek(iso->file_ptr,
-                            state->block_pos * iso->block_size, SEEK_SET);
-    if (ret_val != TNI_OK) {
-        goto exit_normal;
-    }
+    trace_local_t *local;
 
-    ret_val = handle_fread(state->block, iso->block_size, 1, iso->file_ptr);
-    if (ret_val != TNI_OK) {
-        goto exit_normal;
+    pthread_once(&trace_once, trace_key_init);
+    local = (trace_local_t *) pthread_getspecific(trace_key);
+    if (local != NULL) {
+        return local;
     }
 
-    raw_rec = (iso_dir_record_t *) state->block;
-    if (raw_rec->len_dr[0] == 0) {
-        ret_val = TNI_FAIL;
-    }
+    pthread_mutex_lock(&trace_lock);
 
-    if (raw_rec->len_dr[0] > iso->block_size) {
-        ret_val = TNI_ERR_ISO;
+    for (local = trace_locals; local != NULL && local->in_use; local = local->next);
+    if (local == NULL
+        && handle_alloc((void **) &local, 1, sizeof(trace_local_t), true) == TNI_OK) {
+        pthread_mutex_init(&(local->lock), NULL);
+        local->next = trace_locals;
+        trace_locals = local;
     }
 
-    state->rel_pos = raw_rec->len_dr[0];
-    *output = raw_rec;
+    if (local != NULL) {
+        local->in_use = true;
+        pthread_setspecific(trace_key, local);
+    }
 
-    ret_val = TNI_OK;
-    exit_normal:
-        return ret_val;
+    pthread_mutex_unlock(&trace_lock);
+    return local;
 }
 
 static
-tni_response_t parse_record(tni_record_t *rec, tni_iso_t *iso, generator_t *d_gen) {
+void trace_record(tni_trace_op_t op, uint64_t start) {
 
-    tni_response_t ret_val;
-    iso_dir_record_t *raw_rec;
-    bool multi_extent;
-    tni_extent_t *cur_extent, *t_ext;
-    int ext_len;
+    trace_local_t *local;
+    tni_trace_hist_t *hist;
+    tni_trace_event_t *event;
+    uint64_t duration;
+    size_t bucket;
 
-    off_t local_start, local_end;
-    char *ucs_name, *utf8_name, *encoding;
-    size_t buff_len, ucs_len, utf8_len;
+    duration = trace_now() - start;
+    for (bucket = 0; bucket + 1 < TRACE_BUCKETS && (duration >> (bucket + 1)) != 0; bucket++);
 
-    if (rec == NULL || d_gen == NULL) {
-        ret_val = TNI_ERROR;
-        goto exit_normal;
+    local = trace_local();
+    if (local == NULL) {
+        return;
     }
 
-    ret_val = run_generator((void **) &raw_rec, d_gen);
-    if (ret_val != 0) {
-        goto exit_normal;
+    /* Only contended while a reader is merging this thread's data. */
+    pthread_mutex_lock(&(local->lock));
+
+    hist = &(local->hists[op]);
+    hist->count += 1;
+    hist->total_ns += duration;
+    hist->max_ns = MAX(hist->max_ns, duration);
+    hist->buckets[bucket] += 1;
+
+    if (__atomic_load_n(&trace_ring_on, __ATOMIC_RELAXED)
+        && (local->events != NULL
+            || handle_alloc((void **) &(local->events), TRACE_RING,
+                            sizeof(tni_trace_event_t), false) == TNI_OK)) {
+        event = &(local->events[local->event_num % TRACE_RING]);
+        event->op = op;
+        event->start_ns = start;
+        event->dur_ns = duration;
+        event->thread = (unsigned long) pthread_self();
+        local->event_num += 1;
     }
 
-    rec->total_size = LE_int32(raw_rec->length);
+    pthread_mutex_unlock(&(local->lock));
+}
 
-    rec->is_hidden = (raw_rec->flags[0] & 0x1);
-    rec->is_dir = (raw_rec->flags[0] & 0x2);
+static
+int compare_trace_event(const void *a, const void *b) {
 
-    ucs_len = (size_t) raw_rec->len_fi[0];
-    ucs_name = (char *) (((void *) raw_rec) + sizeof(iso_dir_record_t));
+    uint64_t start_a, start_b;
 
-    if (iso->parse_type == TNI_PARSE_PVD) {
-        ext_len = 2;
-        encoding = "ASCII";
-    } else if (iso->parse_type == TNI_PARSE_JOLIET) {
-        ext_len = 4;
-        encoding = "UCS-2BE";
-    }
+    start_a = ((tni_trace_event_t *) a)->start_ns;
+    start_b = ((tni_trace_event_t *) b)->start_ns;
+    return (start_a > start_b) - (start_a < start_b);
+}
 
-    if (!rec->is_dir) {
-        if (ucs_len < ext_len || ucs_name[ucs_len - (ext_len / 2) - 1] != ';') {
-            ret_val = TNI_ERR_ISO;
-            goto exit_normal;
-        }
-        ucs_len -= ext_len;
-    }
+#else
 
-    buff_len = (ucs_len * 3) / 2;
-    ret_val = handle_alloc((void **) &utf8_name, buff_len + 1, 1, false);
-    if (ret_val != TNI_OK) {
-        goto exit_normal;
-    }
+#define TRACE_BEGIN(name)
+#define TRACE_END(op, name)
 
-    if (ucs_len == 1 && ucs_name[0] <= 1) {
+#endif
 
-        utf8_name[0] = '\0';
-        utf8_len = 1;
 
-        switch(ucs_name[0]) {
-            case '\0':
-                rec->type = REC_CUR_DIR;
-                break;
-            case '\1':
-                rec->type = REC_PARENT_DIR;
-                break;
-        }
+/**** I/O Backends ****/
 
-    } else {
+typedef struct {
 
-        ret_val = handle_iconv(encoding, "UTF-8",
-                                ucs_name, ucs_len,
-                                utf8_name, &buff_len);
-        if (ret_val != TNI_OK) {
-            goto exit_id;
-        }
+    int fd;
 
-        rec->type = REC_NORMAL;
-        utf8_len = ((ucs_len * 3) / 2) - buff_len;
-    }
+} file_backend_t;
 
-    utf8_name[utf8_len] = '\0';
-    rec->id_length = utf8_len;
-    rec->record_id = utf8_name;
+typedef struct {
 
-    ret_val = handle_alloc((void **) &(rec->extent_list), 1,
-                                sizeof(tni_extent_t), false);
-    if (ret_val != TNI_OK) {
-        goto exit_id;
+    const uint8_t *data;
+    size_t size;
+
+} memory_backend_t;
+
+static
+tni_response_t file_read_at(void *ctx, void *buf, size_t size, off_t pos) {
+    return handle_pread(((file_backend_t *) ctx)->fd, buf, size, pos);
+}
+
+static
+tni_response_t file_prefetch(void *ctx, off_t pos, size_t size) {
+#ifdef POSIX_FADV_WILLNEED
+    if (posix_fadvise(((file_backend_t *) ctx)->fd, pos, size, POSIX_FADV_WILLNEED) != 0) {
+        return TNI_ERR_FILE;
     }
-    cur_extent = rec->extent_list;
+#endif
+    return TNI_OK;
+}
 
-    cur_extent->lba = LE_int32(raw_rec->block);
-    cur_extent->length = LE_int32(raw_rec->length);
-    cur_extent->link = NULL;
+static
+tni_response_t file_size(void *ctx, off_t *size) {
 
-    rec->extent_span.start = cur_extent->lba * iso->block_size;
-    rec->extent_span.end = rec->extent_span.start + cur_extent->length;
-    rec->extent_num = 1;
+    tni_response_t ret_val;
+    struct stat file_stat;
 
-    multi_extent = raw_rec->flags[0] & EXTENT_FLAG;
-    while (multi_extent) {
+    if (fstat(((file_backend_t *) ctx)->fd, &file_stat) != 0) {
+        ret_val = TNI_ERR_FILE;
+        goto exit_normal;
+    }
 
-        ret_val = run_generator((void **) &raw_rec, d_gen);
-        if (ret_val == TNI_FAIL) {
-            ret_val = TNI_ERR_ISO;
-            goto exit_extent;
+    *size = file_stat.st_size;
+    ret_val = TNI_OK;
 
-        } else if (ret_val != TNI_OK) {
-            goto exit_extent;
-        }
+    exit_normal:
+        return ret_val;
+}
 
-        ret_val = handle_alloc((void **) &(cur_extent->link), 1,
-                                sizeof(tni_extent_t), false);
-        if (ret_val != TNI_OK) {
-            goto exit_extent;
-        }
+static
+tni_response_t file_close(void *ctx) {
 
-        cur_extent = cur_extent->link;
-        cur_extent->lba = LE_int32(raw_rec->block);
-        cur_extent->length = LE_int32(raw_rec->length);
-        cur_extent->link = NULL;
+    tni_response_t ret_val;
 
-        local_start = cur_extent->lba * iso->block_size;
-        local_end = local_start + cur_extent->length;
+    ret_val = handle_close(((file_backend_t *) ctx)->fd);
+    free(ctx);
+
+    return ret_val;
+}
 
-        rec->extent_span.start = MIN(rec->extent_span.start, local_start);
-        rec->extent_span.end = MAX(rec->extent_span.end, local_end);
+static
+tni_response_t memory_read_at(void *ctx, void *buf, size_t size, off_t pos) {
 
-        rec->extent_num += 1;
-        rec->total_size += cur_extent->length;
+    memory_backend_t *mem;
 
-        multi_extent = raw_rec->flags[0] & EXTENT_FLAG;
+    mem = (memory_backend_t *) ctx;
+    if (pos < 0 || (size_t) pos > mem->size || size > mem->size - pos) {
+        return TNI_ERR_FILE;
     }
 
-    ret_val = TNI_OK;
-    goto exit_normal;
+    memcpy(buf, mem->data + pos, size);
+    return TNI_OK;
+}
 
-    exit_extent:
-        cur_extent = rec->extent_list;
-        while(cur_extent != NULL) {
-            t_ext = cur_extent->link;
-            free(cur_extent);
-            cur_extent = t_ext;
-        }
-    exit_id:
-        free(utf8_name);
-    exit_normal:
-        return ret_val;
+static
+tni_response_t memory_size(void *ctx, off_t *size) {
+    *size = (off_t) ((memory_backend_t *) ctx)->size;
+    return TNI_OK;
 }
 
 static
-void free_record(tni_record_t *rec) {
+void *memory_map(void *ctx, off_t pos, size_t size) {
 
-    tni_extent_t *t_ext;
-    while (rec->extent_list != NULL) {
-        t_ext = rec->extent_list->link;
-        free(rec->extent_list);
-        rec->extent_list = t_ext;
+    memory_backend_t *mem;
+
+    mem = (memory_backend_t *) ctx;
+    if (pos < 0 || (size_t) pos > mem->size || size > mem->size - pos) {
+        return NULL;
     }
-    free(rec->record_id);
+
+    return (void *) (mem->data + pos);
 }
 
+static
+tni_response_t memory_close(void *ctx) {
+    free(ctx);
+    return TNI_OK;
+}
 
-/**** API Functions ****/
+static const tni_backend_ops_t file_ops = {
+    .read_at = file_read_at,
+    .size = file_size,
+    .map = NULL,
+    .close = file_close,
+    .prefetch = file_prefetch,
+};
+
+static const tni_backend_ops_t memory_ops = {
+    .read_at = memory_read_at,
+    .size = memory_size,
+    .map = memory_map,
+    .close = memory_close,
+    .prefetch = NULL,
+};
 
-tni_response_t tni_open_iso(tni_iso_t *iso, char *path, tni_parse_t parse_type,
-                            bool is_header) {
+static
+tni_response_t backend_read(tni_backend_t *backend, void *buf, size_t size, off_t pos) {
+    return backend->ops->read_at(backend->ctx, buf, size, pos);
+}
+
+static
+tni_response_t iso_read(tni_iso_t *iso, void *buf, size_t size, off_t pos) {
+    return backend_read(&(iso->backend), buf, size, pos);
+}
+
+static
+void *iso_map(tni_iso_t *iso, off_t pos, size_t size) {
+
+    if (iso->backend.ops->map == NULL) {
+        return NULL;
+    }
+    return iso->backend.ops->map(iso->backend.ctx, pos, size);
+}
+
+static
+tni_response_t load_block(void **block, void *buffer, tni_iso_t *iso, uint32_t lba) {
+
+    tni_response_t ret_val;
+    off_t pos;
+    void *mapped;
+
+    pos = (off_t) lba * iso->block_size;
+
+    mapped = iso_map(iso, pos, iso->block_size);
+    if (mapped != NULL) {
+        *block = mapped;
+        ret_val = TNI_OK;
+        goto exit_normal;
+    }
+
+    ret_val = iso_read(iso, buffer, iso->block_size, pos);
+    if (ret_val != TNI_OK) {
+        goto exit_normal;
+    }
+    *block = buffer;
+
+    exit_normal:
+        return ret_val;
+}
+
+static
+void iso_prefetch(tni_iso_t *iso, off_t pos, size_t size) {
+    if (iso->backend.ops->prefetch != NULL) {
+        iso->backend.ops->prefetch(iso->backend.ctx, pos, size);
+    }
+}
+
+static
+void window_init(dir_window_t *window, bool prefetch) {
+    window->data = NULL;
+    window->capacity = 0;
+    window->lba = 0;
+    window->count = 0;
+    window->prefetch = prefetch;
+}
+
+static
+void window_free(dir_window_t *window) {
+    free(window->data);
+}
+
+/*
+ * Returns the sector at lba. When the window does not hold it, up to
+ * count contiguous sectors starting there are fetched in one read.
+ */
+static
+tni_response_t window_load(void **block, dir_window_t *window, tni_iso_t *iso,
+                            uint32_t lba, uint32_t count) {
+
+    tni_response_t ret_val;
+    off_t pos;
+    size_t size;
+    void *mapped;
+
+    if (window->count != 0 && lba >= window->lba && lba - window->lba < window->count) {
+        *block = window->data + ((size_t) (lba - window->lba) * iso->block_size);
+        ret_val = TNI_OK;
+        goto exit_normal;
+    }
+
+    pos = (off_t) lba * iso->block_size;
+    size = (size_t) MAX(MIN(count, DIR_WINDOW), 1) * iso->block_size;
+
+    mapped = iso_map(iso, pos, size);
+    if (mapped != NULL) {
+        *block = mapped;
+        ret_val = TNI_OK;
+        goto exit_normal;
+    }
+
+    if (size > window->capacity) {
+        ret_val = handle_realloc((void **) &(window->data), size, 1);
+        if (ret_val != TNI_OK) {
+            goto exit_normal;
+        }
+        window->capacity = size;
+    }
+
+    window->count = 0;
+    ret_val = iso_read(iso, window->data, size, pos);
+    if (ret_val != TNI_OK) {
+        goto exit_normal;
+    }
+
+    window->lba = lba;
+    window->count = size / iso->block_size;
+    *block = window->data;
+
+    exit_normal:
+        return ret_val;
+}
+
+
+/**** Descriptor Parsing ****/
+
+static
+bool detect_pvd(iso_vol_desc_t *desc) {
+    return desc->vol_desc_type[0] == 1;
+}
+
+static
+bool detect_joliet(iso_vol_desc_t *desc) {
+    if (desc->vol_desc_type[0] == 2) {
+        if (desc->esc_sequences[0] == 0x25) {
+            if (desc->esc_sequences[1] == 0x2f) {
+                switch (desc->esc_sequences[2]) {
+                    case 0x40:
+                    case 0x43:
+                    case 0x45:
+                        return true;
+                }
+            }
+        }
+    }
+    return false;
+}
+
+static
+tni_response_t select_detector(type_func_t *t_func, tni_parse_t parse_type) {
+
+    switch(parse_type) {
+
+        case TNI_PARSE_PVD:
+            *t_func = *detect_pvd;
+            return TNI_OK;
+        case TNI_PARSE_JOLIET:
+            *t_func = *detect_joliet;
+            return TNI_OK;
+        default:
+            return TNI_ERR_ARGS;
+    }
+}
+
+static
+tni_response_t search_desc(iso_vol_desc_t *desc, off_t *desc_pos, tni_backend_t *backend,
+                            tni_parse_t parse_type, uint32_t start) {
+
+    tni_response_t ret_val;
+    tni_desc_scan_t scan;
+    uint8_t sector[DESC_SIZE];
+    TRACE_BEGIN(trace_start);
+
+    ret_val = tni_desc_scan_init(&scan, parse_type, start);
+    if (ret_val != TNI_OK) {
+        goto exit_normal;
+    }
+
+    while (true) {
+
+        ret_val = tni_desc_scan_step(&scan, desc);
+        if (ret_val != TNI_PENDING) {
+            break;
+        }
+
+        ret_val = backend_read(backend, sector, DESC_SIZE,
+                                (off_t) scan.need_lba * SECTOR_SIZE);
+        if (ret_val != TNI_OK) {
+            ret_val = TNI_ERROR;
+            goto exit_normal;
+        }
+
+        ret_val = tni_desc_scan_feed(&scan, scan.need_lba, sector);
+        if (ret_val != TNI_OK) {
+            goto exit_normal;
+        }
+    }
+
+    if (ret_val == TNI_OK && desc_pos != NULL) {
+        *desc_pos = (off_t) scan.need_lba * SECTOR_SIZE;
+    }
+
+    exit_normal:
+        TRACE_END(TNI_OP_SEARCH_DESC, trace_start);
+        return ret_val;
+}
+
+static
+tni_response_t next_session(uint32_t *start, iso_vol_desc_t *desc,
+                                tni_backend_t *backend) {
+
+    tni_response_t ret_val;
+    uint32_t end;
+    uint32_t candidates[2];
+    off_t image_size;
+    int idx;
+
+    image_size = -1;
+    if (backend->ops->size != NULL) {
+        ret_val = backend->ops->size(backend->ctx, &image_size);
+        if (ret_val != TNI_OK) {
+            goto exit_normal;
+        }
+    }
+
+    end = LE_int32(desc->vol_space_size);
+    candidates[0] = (end + SESSION_ALIGN - 1) & ~(SESSION_ALIGN - 1);
+    candidates[1] = candidates[0] + SESSION_GAP;
+
+    for (idx = 0; idx < 2; idx++) {
+
+        if (candidates[idx] <= *start) {
+            continue;
+        }
+
+        if (image_size >= 0 && (off_t) (candidates[idx] + RESV_SECTORS + 1)
+                                    * SECTOR_SIZE > image_size) {
+            continue;
+        }
+
+        ret_val = search_desc(desc, NULL, backend, TNI_PARSE_PVD, candidates[idx]);
+        if (ret_val == TNI_OK) {
+            *start = candidates[idx];
+            goto exit_normal;
+        }
+    }
+
+    ret_val = TNI_FAIL;
+    exit_normal:
+        return ret_val;
+}
+
+static
+tni_response_t find_sessions(tni_session_t **sessions, uint32_t *session_num,
+                                tni_backend_t *backend) {
+
+    tni_response_t ret_val;
+    iso_vol_desc_t desc;
+    uint32_t start, capacity;
+
+    *sessions = NULL;
+    *session_num = 0;
+    capacity = 0;
+    start = 0;
+
+    ret_val = search_desc(&desc, NULL, backend, TNI_PARSE_PVD, start);
+    while (ret_val == TNI_OK) {
+
+        if (*session_num == capacity) {
+            capacity = MAX(capacity * 2, 4);
+            ret_val = handle_realloc((void **) sessions, capacity, sizeof(tni_session_t));
+            if (ret_val != TNI_OK) {
+                goto exit_sessions;
+            }
+        }
+
+        (*sessions)[*session_num].start = start;
+        (*sessions)[*session_num].lba_count = LE_int32(desc.vol_space_size);
+        *session_num += 1;
+
+        ret_val = next_session(&start, &desc, backend);
+    }
+
+    if (ret_val == TNI_FAIL && *session_num != 0) {
+        ret_val = TNI_OK;
+        goto exit_normal;
+    }
+
+    exit_sessions:
+        free(*sessions);
+        *sessions = NULL;
+        *session_num = 0;
+    exit_normal:
+        return ret_val;
+}
+
+
+/**** Record Parsing ****/
+
+static
+char *parse_encoding(tni_parse_t parse_type) {
+    return (parse_type == TNI_PARSE_JOLIET)? "UCS-2BE" : "ASCII";
+}
+
+static
+size_t parse_unit(tni_parse_t parse_type) {
+    return (parse_type == TNI_PARSE_JOLIET)? 2 : 1;
+}
+
+static
+tni_response_t raw_record_id(char **id, size_t *id_len,
+                                iso_dir_record_t *raw_rec, tni_parse_t parse_type) {
+
+    tni_response_t ret_val;
+    size_t ext_len, raw_len;
+    char *raw_id;
+
+    raw_len = (size_t) raw_rec->len_fi[0];
+    raw_id = (char *) (((void *) raw_rec) + sizeof(iso_dir_record_t));
+    ext_len = parse_unit(parse_type) * 2;
+
+    if (!(raw_rec->flags[0] & 0x2)) {
+        if (raw_len < ext_len || raw_id[raw_len - (ext_len / 2) - 1] != ';') {
+            ret_val = TNI_ERR_ISO;
+            goto exit_normal;
+        }
+        raw_len -= ext_len;
+    }
+
+    *id = raw_id;
+    *id_len = raw_len;
+
+    ret_val = TNI_OK;
+    exit_normal:
+        return ret_val;
+}
+
+static
+bool is_dot_record(iso_dir_record_t *raw_rec) {
+    return raw_rec->len_fi[0] == 1
+        && ((uint8_t *) raw_rec)[sizeof(iso_dir_record_t)] <= 1;
+}
+
+static
+uint16_t id_unit(char *id, size_t idx, size_t unit) {
+    if (unit == 1) {
+        return (uint8_t) id[idx];
+    }
+    return (((uint16_t) (uint8_t) id[idx * 2]) << 8) | ((uint8_t) id[idx * 2 + 1]);
+}
+
+static
+int compare_id_part(char *a, size_t a_count, char *b, size_t b_count, size_t unit) {
+
+    size_t idx;
+    uint16_t a_unit, b_unit;
+
+    for (idx = 0; idx < MAX(a_count, b_count); idx++) {
+        a_unit = (idx < a_count)? id_unit(a, idx, unit) : ' ';
+        b_unit = (idx < b_count)? id_unit(b, idx, unit) : ' ';
+        if (a_unit != b_unit) {
+            return (a_unit < b_unit)? -1 : 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Orders two raw identifiers (version already stripped) the way
+ * ECMA-119 9.3 sorts directory records: name part first, then the
+ * extension, both padded with spaces.
+ */
+static
+int compare_id(char *a, size_t a_len, char *b, size_t b_len, size_t unit) {
+
+    size_t a_count, b_count, a_dot, b_dot;
+    int cmp;
+
+    a_count = a_len / unit;
+    b_count = b_len / unit;
+
+    for (a_dot = 0; a_dot < a_count && id_unit(a, a_dot, unit) != '.'; a_dot++);
+    for (b_dot = 0; b_dot < b_count && id_unit(b, b_dot, unit) != '.'; b_dot++);
+
+    cmp = compare_id_part(a, a_dot, b, b_dot, unit);
+    if (cmp != 0) {
+        return cmp;
+    }
+
+    a_dot = MIN(a_dot + 1, a_count);
+    b_dot = MIN(b_dot + 1, b_count);
+
+    return compare_id_part(a + a_dot * unit, a_count - a_dot,
+                            b + b_dot * unit, b_count - b_dot, unit);
+}
+
+static
+tni_response_t run_generator(void **output, generator_t *d_gen) {
+    return d_gen->generate(output, d_gen->state);
+}
+
+static
+tni_response_t single_generator(void **output, void *raw_state) {
+
+    tni_response_t ret_val;
+    single_state_t *state;
+
+    state = (single_state_t *) raw_state;
+    if (!(state->parsed)) {
+        *output = (void *) state->root_dir;
+        state->parsed = true;
+        ret_val = TNI_OK;
+    } else {
+        ret_val = TNI_FAIL;
+    }
+
+    return ret_val;
+}
+
+static
+void scan_seek(tni_dir_scan_t *scan, tni_extent_t *extent, uint32_t sector,
+                off_t rel_pos) {
+
+    uint16_t block_size;
+
+    block_size = scan->iso->block_size;
+
+    scan->extent = extent;
+    scan->sector = sector;
+    scan->rel_pos = rel_pos;
+    scan->block = NULL;
+
+    if (extent != NULL) {
+        scan->sector_count = (extent->length + block_size - 1) / block_size;
+        scan->need_lba = extent->lba + sector;
+        scan->need_count = scan->sector_count - MIN(sector, scan->sector_count);
+    } else {
+        scan->sector_count = 0;
+    }
+}
+
+static
+tni_response_t scan_next(tni_dir_scan_t *scan, tni_record_t *rec, dir_window_t *window) {
+
+    tni_response_t ret_val;
+    tni_extent_t *cur_extent;
+    void *block;
+
+    while (true) {
+
+        ret_val = tni_scan_step(scan, rec);
+        if (ret_val != TNI_PENDING) {
+            break;
+        }
+
+        TRACE_BEGIN(trace_start);
+        ret_val = window_load(&block, window, scan->iso, scan->need_lba, scan->need_count);
+        TRACE_END(TNI_OP_DIR_SECTOR, trace_start);
+        if (ret_val != TNI_OK) {
+            break;
+        }
+
+        ret_val = tni_scan_feed(scan, scan->need_lba, block);
+        if (ret_val != TNI_OK) {
+            break;
+        }
+    }
+
+    if (ret_val == TNI_OK && window->prefetch && rec->type == REC_NORMAL && rec->is_dir) {
+        for (cur_extent = rec->extent_list; cur_extent != NULL; cur_extent = cur_extent->link) {
+            iso_prefetch(scan->iso, (off_t) cur_extent->lba * scan->iso->block_size,
+                            cur_extent->length);
+        }
+    }
+
+    return ret_val;
+}
+
+static
+tni_response_t buffer_generator(void **output, void *raw_state) {
+
+    tni_response_t ret_val;
+    buffer_state_t *state;
+    iso_dir_record_t *raw_rec;
+    off_t sector_left;
+
+    if (output == NULL || raw_state == NULL) {
+        ret_val = TNI_ERROR;
+        goto exit_normal;
+    }
+
+    state = (buffer_state_t *) raw_state;
+    while (state->pos + (off_t) sizeof(iso_dir_record_t) <= state->end) {
+
+        sector_left = state->iso->block_size - (state->pos % state->iso->block_size);
+        raw_rec = (iso_dir_record_t *) (state->data + state->pos);
+
+        if (sector_left < (off_t) sizeof(iso_dir_record_t) || raw_rec->len_dr[0] == 0) {
+            state->pos += sector_left;
+            continue;
+        }
+
+        if (raw_rec->len_dr[0] > sector_left
+            || raw_rec->len_dr[0] < sizeof(iso_dir_record_t) + raw_rec->len_fi[0]) {
+            ret_val = TNI_ERR_ISO;
+            goto exit_normal;
+        }
+
+        *output = (void *) raw_rec;
+        state->pos += raw_rec->len_dr[0];
+
+        ret_val = TNI_OK;
+        goto exit_normal;
+    }
+
+    ret_val = TNI_FAIL;
+    exit_normal:
+        return ret_val;
+}
+
+static
+void free_record(tni_record_t *rec) {
+
+    tni_extent_t *t_ext;
+    while (rec->extent_list != NULL) {
+        t_ext = rec->extent_list->link;
+        free(rec->extent_list);
+        rec->extent_list = t_ext;
+    }
+    free(rec->record_id);
+}
+
+static
+tni_response_t record_begin(bool *multi_extent, tni_record_t *rec, tni_iso_t *iso,
+                            iso_dir_record_t *raw_rec) {
+
+    tni_response_t ret_val;
+    tni_extent_t *cur_extent;
+
+    char *ucs_name, *utf8_name, *encoding;
+    size_t buff_len, ucs_len, utf8_len;
+    TRACE_BEGIN(trace_start);
+
+    rec->total_size = LE_int32(raw_rec->length);
+
+    rec->is_hidden = (raw_rec->flags[0] & 0x1);
+    rec->is_dir = (raw_rec->flags[0] & 0x2);
+
+    ret_val = raw_record_id(&ucs_name, &ucs_len, raw_rec, iso->parse_type);
+    if (ret_val != TNI_OK) {
+        goto exit_normal;
+    }
+    encoding = parse_encoding(iso->parse_type);
+
+    buff_len = (ucs_len * 3) / 2;
+    ret_val = handle_alloc((void **) &utf8_name, buff_len + 1, 1, false);
+    if (ret_val != TNI_OK) {
+        goto exit_normal;
+    }
+
+    if (ucs_len == 1 && ucs_name[0] <= 1) {
+
+        utf8_name[0] = '\0';
+        utf8_len = 1;
+
+        switch(ucs_name[0]) {
+            case '\0':
+                rec->type = REC_CUR_DIR;
+                break;
+            case '\1':
+                rec->type = REC_PARENT_DIR;
+                break;
+        }
+
+    } else {
+
+        ret_val = handle_iconv(encoding, "UTF-8",
+                                ucs_name, ucs_len,
+                                utf8_name, &buff_len);
+        if (ret_val != TNI_OK) {
+            goto exit_id;
+        }
+
+        rec->type = REC_NORMAL;
+        utf8_len = ((ucs_len * 3) / 2) - buff_len;
+    }
+
+    utf8_name[utf8_len] = '\0';
+    rec->id_length = utf8_len;
+    rec->record_id = utf8_name;
+    rec->header = NULL;
+    rec->header_size = 0;
+
+    ret_val = handle_alloc((void **) &(rec->extent_list), 1,
+                                sizeof(tni_extent_t), false);
+    if (ret_val != TNI_OK) {
+        goto exit_id;
+    }
+    cur_extent = rec->extent_list;
+
+    cur_extent->lba = LE_int32(raw_rec->block);
+    cur_extent->length = LE_int32(raw_rec->length);
+    cur_extent->link = NULL;
+
+    rec->extent_span.start = (off_t) cur_extent->lba * iso->block_size;
+    rec->extent_span.end = rec->extent_span.start + cur_extent->length;
+    rec->extent_num = 1;
+
+    *multi_extent = raw_rec->flags[0] & EXTENT_FLAG;
+
+    ret_val = TNI_OK;
+    goto exit_normal;
+
+    exit_id:
+        free(utf8_name);
+    exit_normal:
+        TRACE_END(TNI_OP_PARSE_RECORD, trace_start);
+        return ret_val;
+}
+
+static
+tni_response_t record_append(bool *multi_extent, tni_record_t *rec, tni_iso_t *iso,
+                                iso_dir_record_t *raw_rec) {
+
+    tni_response_t ret_val;
+    tni_extent_t *cur_extent;
+    off_t local_start, local_end;
+
+    cur_extent = rec->extent_list;
+    while (cur_extent->link != NULL) {
+        cur_extent = cur_extent->link;
+    }
+
+    ret_val = handle_alloc((void **) &(cur_extent->link), 1,
+                            sizeof(tni_extent_t), false);
+    if (ret_val != TNI_OK) {
+        goto exit_normal;
+    }
+
+    cur_extent = cur_extent->link;
+    cur_extent->lba = LE_int32(raw_rec->block);
+    cur_extent->length = LE_int32(raw_rec->length);
+    cur_extent->link = NULL;
+
+    local_start = (off_t) cur_extent->lba * iso->block_size;
+    local_end = local_start + cur_extent->length;
+
+    rec->extent_span.start = MIN(rec->extent_span.start, local_start);
+    rec->extent_span.end = MAX(rec->extent_span.end, local_end);
+
+    rec->extent_num += 1;
+    rec->total_size += cur_extent->length;
+
+    *multi_extent = raw_rec->flags[0] & EXTENT_FLAG;
+
+    ret_val = TNI_OK;
+    exit_normal:
+        return ret_val;
+}
+
+static
+tni_response_t parse_record(tni_record_t *rec, tni_iso_t *iso, generator_t *d_gen) {
+
+    tni_response_t ret_val;
+    iso_dir_record_t *raw_rec;
+    bool multi_extent;
+
+    if (rec == NULL || d_gen == NULL) {
+        ret_val = TNI_ERROR;
+        goto exit_normal;
+    }
+
+    ret_val = run_generator((void **) &raw_rec, d_gen);
+    if (ret_val != TNI_OK) {
+        goto exit_normal;
+    }
+
+    ret_val = record_begin(&multi_extent, rec, iso, raw_rec);
+    if (ret_val != TNI_OK) {
+        goto exit_normal;
+    }
+
+    while (multi_extent) {
+
+        ret_val = run_generator((void **) &raw_rec, d_gen);
+        if (ret_val == TNI_FAIL) {
+            ret_val = TNI_ERR_ISO;
+            goto exit_record;
+
+        } else if (ret_val != TNI_OK) {
+            goto exit_record;
+        }
+
+        ret_val = record_append(&multi_extent, rec, iso, raw_rec);
+        if (ret_val != TNI_OK) {
+            goto exit_record;
+        }
+    }
+
+    ret_val = TNI_OK;
+    goto exit_normal;
+
+    exit_record:
+        free_record(rec);
+    exit_normal:
+        return ret_val;
+}
+
+static
+tni_response_t copy_record(tni_record_t *dst, tni_record_t *src) {
+
+    tni_response_t ret_val;
+    tni_extent_t *cur_extent, **dst_link;
+
+    *dst = *src;
+    dst->extent_list = NULL;
+    dst->header = NULL;
+    dst->header_size = 0;
+
+    ret_val = handle_alloc((void **) &(dst->record_id), src->id_length + 1, 1, false);
+    if (ret_val != TNI_OK) {
+        goto exit_normal;
+    }
+    memcpy(dst->record_id, src->record_id, src->id_length + 1);
+
+    dst_link = &(dst->extent_list);
+    for (cur_extent = src->extent_list; cur_extent != NULL;
+            cur_extent = cur_extent->link) {
+
+        ret_val = handle_alloc((void **) dst_link, 1, sizeof(tni_extent_t), false);
+        if (ret_val != TNI_OK) {
+            free_record(dst);
+            goto exit_normal;
+        }
+
+        **dst_link = *cur_extent;
+        (*dst_link)->link = NULL;
+        dst_link = &((*dst_link)->link);
+    }
+
+    ret_val = TNI_OK;
+    exit_normal:
+        return ret_val;
+}
+
+static
+tni_signal_t collect_record(tni_record_t *rec, void *args) {
+
+    record_list_t *records;
+
+    if (rec->type != REC_NORMAL) {
+        return TNI_SIGNAL_OK;
+    }
+
+    records = (record_list_t *) args;
+    if (records->length == records->capacity) {
+        if (handle_realloc((void **) &(records->list), MAX(records->capacity * 2, 16),
+                            sizeof(tni_record_t)) != TNI_OK) {
+            return TNI_SIGNAL_ERR;
+        }
+        records->capacity = MAX(records->capacity * 2, 16);
+    }
+
+    if (copy_record(&(records->list[records->length]), rec) != TNI_OK) {
+        return TNI_SIGNAL_ERR;
+    }
+
+    records->length += 1;
+    return TNI_SIGNAL_OK;
+}
+
+static
+void free_record_list(record_list_t *records) {
+
+    size_t idx;
+
+    for (idx = 0; idx < records->length; idx++) {
+        free_record(&(records->list[idx]));
+    }
+    free(records->list);
+
+    records->list = NULL;
+    records->length = 0;
+    records->capacity = 0;
+}
+
+static
+int compare_record_name(const void *a, const void *b) {
+    return strcmp(((tni_record_t *) a)->record_id, ((tni_record_t *) b)->record_id);
+}
+
+static
+tni_response_t compare_record(int *cmp, iso_dir_record_t *raw_rec, tni_iso_t *iso,
+                                char *query, size_t query_len) {
+
+    tni_response_t ret_val;
+    char *raw_id;
+    size_t raw_len;
+
+    if (is_dot_record(raw_rec)) {
+        *cmp = -1;
+        ret_val = TNI_OK;
+        goto exit_normal;
+    }
+
+    ret_val = raw_record_id(&raw_id, &raw_len, raw_rec, iso->parse_type);
+    if (ret_val != TNI_OK) {
+        goto exit_normal;
+    }
+
+    *cmp = compare_id(raw_id, raw_len, query, query_len,
+                        parse_unit(iso->parse_type));
+
+    ret_val = TNI_OK;
+    exit_normal:
+        return ret_val;
+}
+
+
+/**** Header Sniffing ****/
+
+static
+int compare_header_ref(const void *a, const void *b) {
+
+    const header_ref_t *ref_a, *ref_b;
+
+    ref_a = (const header_ref_t *) a;
+    ref_b = (const header_ref_t *) b;
+
+    if (ref_a->pos != ref_b->pos) {
+        return (ref_a->pos < ref_b->pos)? -1 : 1;
+    }
+    return 0;
+}
+
+static
+tni_response_t header_collect(record_list_t *records, tni_iso_t *iso, tni_record_t *dir) {
+
+    tni_response_t ret_val;
+    tni_dir_scan_t scan;
+    tni_record_t cur_rec;
+    dir_window_t window;
+
+    records->list = NULL;
+    records->length = 0;
+    records->capacity = 0;
+
+    ret_val = tni_scan_init(&scan, iso, dir);
+    if (ret_val != TNI_OK) {
+        goto exit_normal;
+    }
+
+    window_init(&window, true);
+
+    while (true) {
+
+        ret_val = scan_next(&scan, &cur_rec, &window);
+        if (ret_val == TNI_FAIL) {
+            break;
+        }
+        if (ret_val != TNI_OK) {
+            goto exit_records;
+        }
+
+        if (records->length == records->capacity) {
+            ret_val = handle_realloc((void **) &(records->list),
+                                    MAX(records->capacity * 2, 64), sizeof(tni_record_t));
+            if (ret_val != TNI_OK) {
+                free_record(&cur_rec);
+                goto exit_records;
+            }
+            records->capacity = MAX(records->capacity * 2, 64);
+        }
+
+        records->list[records->length++] = cur_rec;
+    }
+
+    ret_val = TNI_OK;
+    goto exit_buffer;
+
+    exit_records:
+        free_record_list(records);
+    exit_buffer:
+        window_free(&window);
+    exit_normal:
+        return ret_val;
+}
+
+static
+tni_response_t header_load(uint8_t *arena, header_ref_t *refs, uint32_t ref_num,
+                            tni_iso_t *iso) {
+
+    tni_response_t ret_val;
+    uint8_t *run_buf, *run_data;
+    size_t run_cap, run_len;
+    off_t run_start, run_end;
+    uint32_t first, last, idx;
+
+    qsort(refs, ref_num, sizeof(header_ref_t), compare_header_ref);
+
+    run_buf = NULL;
+    run_cap = 0;
+
+    first = 0;
+    while (first < ref_num) {
+
+        run_start = refs[first].pos;
+        run_end = run_start + refs[first].size;
+
+        last = first + 1;
+        while (last < ref_num && refs[last].pos <= run_end + HEADER_GAP
+                && MAX(run_end, refs[last].pos + (off_t) refs[last].size)
+                    - run_start <= HEADER_BATCH) {
+            run_end = MAX(run_end, refs[last].pos + (off_t) refs[last].size);
+            last += 1;
+        }
+        run_len = run_end - run_start;
+
+        run_data = iso_map(iso, run_start, run_len);
+        if (run_data == NULL) {
+            if (run_len > run_cap) {
+                ret_val = handle_realloc((void **) &run_buf, run_len, 1);
+                if (ret_val != TNI_OK) {
+                    goto exit_buffer;
+                }
+                run_cap = run_len;
+            }
+
+            ret_val = iso_read(iso, run_buf, run_len, run_start);
+            if (ret_val != TNI_OK) {
+                goto exit_buffer;
+            }
+            run_data = run_buf;
+        }
+
+        for (idx = first; idx < last; idx++) {
+            memcpy(arena + refs[idx].offset, run_data + (refs[idx].pos - run_start),
+                    refs[idx].size);
+        }
+        first = last;
+    }
+
+    ret_val = TNI_OK;
+    exit_buffer:
+        free(run_buf);
+        return ret_val;
+}
+
+static
+tni_response_t traverse_header(tni_iso_t *iso, tni_record_t *dir, tni_callback_t *cb) {
+
+    tni_response_t ret_val;
+    tni_signal_t signal;
+
+    record_list_t records;
+    tni_record_t *cur_rec;
+    header_ref_t *refs;
+    uint8_t *arena;
+
+    size_t total_size;
+    uint32_t ref_num, idx;
+
+    ret_val = header_collect(&records, iso, dir);
+    if (ret_val != TNI_OK) {
+        goto exit_normal;
+    }
+
+    ret_val = handle_alloc((void **) &refs, MAX(records.length, 1),
+                            sizeof(header_ref_t), false);
+    if (ret_val != TNI_OK) {
+        goto exit_records;
+    }
+
+    total_size = 0;
+    ref_num = 0;
+    for (idx = 0; idx < records.length; idx++) {
+
+        cur_rec = &(records.list[idx]);
+        if (cur_rec->type != REC_NORMAL || cur_rec->is_dir
+            || cur_rec->extent_list->length == 0) {
+            continue;
+        }
+
+        refs[ref_num].pos = (off_t) cur_rec->extent_list->lba * iso->block_size;
+        refs[ref_num].size = MIN(iso->header_size, (size_t) cur_rec->extent_list->length);
+        refs[ref_num].offset = total_size;
+        refs[ref_num].index = idx;
+
+        total_size += refs[ref_num].size;
+        ref_num += 1;
+    }
+
+    ret_val = handle_alloc((void **) &arena, MAX(total_size, 1), 1, false);
+    if (ret_val != TNI_OK) {
+        goto exit_refs;
+    }
+
+    ret_val = header_load(arena, refs, ref_num, iso);
+    if (ret_val != TNI_OK) {
+        goto exit_arena;
+    }
+
+    for (idx = 0; idx < ref_num; idx++) {
+        cur_rec = &(records.list[refs[idx].index]);
+        cur_rec->header = arena + refs[idx].offset;
+        cur_rec->header_size = refs[idx].size;
+    }
+
+    for (idx = 0; idx < records.length; idx++) {
+
+        signal = cb->fn(&(records.list[idx]), cb->args);
+        if (signal == TNI_SIGNAL_STOP) {
+            break;
+        }
+        if (signal == TNI_SIGNAL_ERR) {
+            ret_val = TNI_ERR_CB;
+            goto exit_arena;
+        }
+    }
+
+    ret_val = TNI_OK;
+
+    exit_arena:
+        free(arena);
+    exit_refs:
+        free(refs);
+    exit_records:
+        free_record_list(&records);
+    exit_normal:
+        return ret_val;
+}
+
+
+/**** Batch Decoding ****/
+
+static inline
+tni_response_t decode_sector(tni_dir_batch_t *batch, uint32_t base, uint32_t end,
+                                uint16_t block_size, const size_t unit) {
+
+    uint8_t *sector, *raw_rec;
+    uint32_t pos, idx;
+    uint8_t len_dr, len_fi, flags;
+
+    sector = batch->names + base;
+    idx = batch->count;
+    end = MIN(end, block_size);
+
+    for (pos = 0; pos + sizeof(iso_dir_record_t) <= end; pos += len_dr) {
+
+        raw_rec = sector + pos;
+        len_dr = raw_rec[0];
+        len_fi = raw_rec[32];
+        flags = raw_rec[25];
+
+        if (len_dr == 0) {
+            break;
+        }
+
+        if (pos + len_dr > end || len_dr < sizeof(iso_dir_record_t) + len_fi) {
+            return TNI_ERR_ISO;
+        }
+
+        if (len_fi == 1 && raw_rec[33] <= 1) {
+            continue;
+        }
+
+        if (!(flags & 0x2) && len_fi >= 2 * unit
+            && raw_rec[33 + len_fi - unit - 1] == ';') {
+            len_fi -= 2 * unit;
+        }
+
+        if (idx >= batch->capacity) {
+            return TNI_ERR_ISO;
+        }
+
+        batch->lba[idx] = LE_int32(raw_rec + 2);
+        batch->length[idx] = LE_int32(raw_rec + 10);
+        batch->flags[idx] = flags;
+        batch->name_off[idx] = base + pos + sizeof(iso_dir_record_t);
+        batch->name_len[idx] = len_fi;
+        idx += 1;
+    }
+
+    batch->count = idx;
+    return TNI_OK;
+}
+
+static
+tni_response_t decode_sector_pvd(tni_dir_batch_t *batch, uint32_t base,
+                                    uint32_t end, uint16_t block_size) {
+    return decode_sector(batch, base, end, block_size, 1);
+}
+
+static
+tni_response_t decode_sector_joliet(tni_dir_batch_t *batch, uint32_t base,
+                                    uint32_t end, uint16_t block_size) {
+    return decode_sector(batch, base, end, block_size, 2);
+}
+
+static
+tni_response_t batch_reserve(tni_dir_batch_t *batch, uint32_t capacity) {
+
+    tni_response_t ret_val;
+    size_t stride;
+    uint8_t *mem;
+
+    stride = (3 * sizeof(uint32_t)) + (2 * sizeof(uint8_t));
+    ret_val = handle_alloc((void **) &mem, MAX(capacity, 1), stride, false);
+    if (ret_val != TNI_OK) {
+        goto exit_normal;
+    }
+
+    batch->lba = (uint32_t *) mem;
+    batch->length = batch->lba + capacity;
+    batch->name_off = batch->length + capacity;
+    batch->flags = (uint8_t *) (batch->name_off + capacity);
+    batch->name_len = batch->flags + capacity;
+
+    batch->capacity = capacity;
+    batch->count = 0;
+
+    exit_normal:
+        return ret_val;
+}
+
+/**** Tree Model ****/
+
+#define TREE_NAME_MAX 512
+
+static
+uint32_t hash_bytes(const char *data, size_t len) {
+
+    uint32_t hash;
+
+    hash = 2166136261u;
+    while (len-- != 0) {
+        hash ^= (uint8_t) *data++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static
+uint32_t hash_word(uint32_t word) {
+    word ^= word >> 16;
+    word *= 0x7feb352du;
+    word ^= word >> 15;
+    word *= 0x846ca68bu;
+    word ^= word >> 16;
+    return word;
+}
+
+static
+tni_response_t set_init(hash_set_t *set, uint32_t capacity) {
+
+    set->count = 0;
+    set->capacity = capacity;
+    return handle_alloc((void **) &(set->slots), capacity, sizeof(uint32_t), true);
+}
+
+static
+tni_response_t set_grow(hash_set_t *set, char *names) {
+
+    tni_response_t ret_val;
+    uint32_t *old_slots, old_cap, idx, pos, hash;
+
+    old_slots = set->slots;
+    old_cap = set->capacity;
+
+    ret_val = set_init(set, old_cap * 2);
+    if (ret_val != TNI_OK) {
+        set->slots = old_slots;
+        set->capacity = old_cap;
+        goto exit_normal;
+    }
+
+    for (idx = 0; idx < old_cap; idx++) {
+        if (old_slots[idx] == 0) {
+            continue;
+        }
+
+        if (names != NULL) {
+            hash = hash_bytes(names + old_slots[idx] - 1,
+                                strlen(names + old_slots[idx] - 1));
+        } else {
+            hash = hash_word(old_slots[idx] - 1);
+        }
+
+        pos = hash & (set->capacity - 1);
+        while (set->slots[pos] != 0) {
+            pos = (pos + 1) & (set->capacity - 1);
+        }
+
+        set->slots[pos] = old_slots[idx];
+        set->count += 1;
+    }
+    free(old_slots);
+
+    exit_normal:
+        return ret_val;
+}
+
+static
+tni_response_t set_insert_lba(bool *inserted, hash_set_t *set, uint32_t lba) {
+
+    tni_response_t ret_val;
+    uint32_t pos;
+
+    if ((set->count + 1) * 2 > set->capacity) {
+        ret_val = set_grow(set, NULL);
+        if (ret_val != TNI_OK) {
+            goto exit_normal;
+        }
+    }
+
+    *inserted = false;
+    pos = hash_word(lba) & (set->capacity - 1);
+    while (set->slots[pos] != 0) {
+        if (set->slots[pos] == lba + 1) {
+            ret_val = TNI_OK;
+            goto exit_normal;
+        }
+        pos = (pos + 1) & (set->capacity - 1);
+    }
+
+    set->slots[pos] = lba + 1;
+    set->count += 1;
+    *inserted = true;
+
+    ret_val = TNI_OK;
+    exit_normal:
+        return ret_val;
+}
+
+static
+tni_response_t tree_intern(uint32_t *name_off, tni_tree_t *tree, hash_set_t *set,
+                            char *name, size_t name_len) {
+
+    tni_response_t ret_val;
+    uint32_t pos, new_cap;
+    char *entry;
+
+    if ((set->count + 1) * 2 > set->capacity) {
+        ret_val = set_grow(set, tree->names);
+        if (ret_val != TNI_OK) {
+            goto exit_normal;
+        }
+    }
+
+    pos = hash_bytes(name, name_len) & (set->capacity - 1);
+    while (set->slots[pos] != 0) {
+        entry = tree->names + set->slots[pos] - 1;
+        if (strncmp(entry, name, name_len) == 0 && entry[name_len] == '\0') {
+            *name_off = set->slots[pos] - 1;
+            ret_val = TNI_OK;
+            goto exit_normal;
+        }
+        pos = (pos + 1) & (set->capacity - 1);
+    }
+
+    if (tree->names_len + name_len + 1 > tree->names_cap) {
+        new_cap = MAX(tree->names_cap * 2, tree->names_len + name_len + 1);
+        ret_val = handle_realloc((void **) &(tree->names), new_cap, 1);
+        if (ret_val != TNI_OK) {
+            goto exit_normal;
+        }
+        tree->names_cap = new_cap;
+    }
+
+    memcpy(tree->names + tree->names_len, name, name_len);
+    tree->names[tree->names_len + name_len] = '\0';
+
+    *name_off = tree->names_len;
+    tree->names_len += name_len + 1;
+
+    set->slots[pos] = *name_off + 1;
+    set->count += 1;
+
+    ret_val = TNI_OK;
+    exit_normal:
+        return ret_val;
+}
+
+static
+tni_response_t tree_add_node(uint32_t *node, tni_tree_t *tree, uint32_t parent) {
+
+    tni_response_t ret_val;
+    tni_node_t *cur_node;
+
+    if (tree->node_num == tree->node_cap) {
+        ret_val = handle_realloc((void **) &(tree->nodes),
+                                MAX(tree->node_cap * 2, 64), sizeof(tni_node_t));
+        if (ret_val != TNI_OK) {
+            goto exit_normal;
+        }
+        tree->node_cap = MAX(tree->node_cap * 2, 64);
+    }
+
+    *node = tree->node_num++;
+    cur_node = &(tree->nodes[*node]);
+    memset(cur_node, 0, sizeof(tni_node_t));
+
+    cur_node->parent = parent;
+    cur_node->first_child = NODE_NONE;
+    cur_node->next_sibling = NODE_NONE;
+
+    ret_val = TNI_OK;
+    exit_normal:
+        return ret_val;
+}
+
+static
+tni_response_t tree_add_extent(tni_tree_t *tree, uint32_t lba, uint32_t length) {
+
+    tni_response_t ret_val;
+
+    if (tree->extent_num == tree->extent_cap) {
+        ret_val = handle_realloc((void **) &(tree->extents),
+                                MAX(tree->extent_cap * 2, 16), sizeof(tni_span_t));
+        if (ret_val != TNI_OK) {
+            goto exit_normal;
+        }
+        tree->extent_cap = MAX(tree->extent_cap * 2, 16);
+    }
+
+    tree->extents[tree->extent_num].lba = lba;
+    tree->extents[tree->extent_num].length = length;
+    tree->extent_num += 1;
+
+    ret_val = TNI_OK;
+    exit_normal:
+        return ret_val;
+}
+
+static
+tni_response_t convert_name(char *out, size_t *out_len, iconv_t id_transform,
+                            char *raw, size_t raw_len) {
+
+    size_t out_space;
+
+    out_space = TREE_NAME_MAX - 1;
+    if (iconv(id_transform, &raw, &raw_len, &out, &out_space) == (size_t) -1) {
+        return TNI_ERR_ISO;
+    }
+
+    *out_len = (TREE_NAME_MAX - 1) - out_space;
+    return TNI_OK;
+}
+
+static
+tni_response_t tree_add_batch(tni_tree_t *tree, hash_set_t *names, iconv_t id_transform,
+                                uint32_t parent, tni_dir_batch_t *batch) {
+
+    tni_response_t ret_val;
+    tni_node_t *cur_node;
+    uint32_t idx, start, node, prev, name_off;
+
+    char name[TREE_NAME_MAX];
+    size_t name_len;
+
+    prev = NODE_NONE;
+    idx = 0;
+    while (idx < batch->count) {
+
+        start = idx;
+        while ((batch->flags[idx] & EXTENT_FLAG) && idx + 1 < batch->count) {
+            idx += 1;
+        }
+
+        ret_val = convert_name(name, &name_len, id_transform,
+                                (char *) batch->names + batch->name_off[start],
+                                batch->name_len[start]);
+        if (ret_val != TNI_OK) {
+            goto exit_normal;
+        }
+
+        ret_val = tree_intern(&name_off, tree, names, name, name_len);
+        if (ret_val != TNI_OK) {
+            goto exit_normal;
+        }
+
+        ret_val = tree_add_node(&node, tree, parent);
+        if (ret_val != TNI_OK) {
+            goto exit_normal;
+        }
+
+        cur_node = &(tree->nodes[node]);
+        cur_node->name_off = name_off;
+        cur_node->name_len = name_len;
+        cur_node->flags = batch->flags[start] & ~EXTENT_FLAG;
+
+        if (idx == start) {
+            cur_node->lba = batch->lba[start];
+            cur_node->length = batch->length[start];
+
+        } else {
+            cur_node->flags |= EXTENT_FLAG;
+            cur_node->lba = tree->extent_num;
+            cur_node->length = idx - start + 1;
+
+            for (; start <= idx; start++) {
+                ret_val = tree_add_extent(tree, batch->lba[start], batch->length[start]);
+                if (ret_val != TNI_OK) {
+                    goto exit_normal;
+                }
+            }
+        }
+
+        if (prev == NODE_NONE) {
+            tree->nodes[parent].first_child = node;
+        } else {
+            tree->nodes[prev].next_sibling = node;
+        }
+
+        prev = node;
+        idx += 1;
+    }
+
+    ret_val = TNI_OK;
+    exit_normal:
+        return ret_val;
+}
+
+static
+int compare_tree_dir(const void *a, const void *b) {
+
+    const tree_dir_t *dir_a, *dir_b;
+
+    dir_a = (const tree_dir_t *) a;
+    dir_b = (const tree_dir_t *) b;
+
+    if (dir_a->lba != dir_b->lba) {
+        return (dir_a->lba < dir_b->lba)? -1 : 1;
+    }
+    if (dir_a->node != dir_b->node) {
+        return (dir_a->node < dir_b->node)? -1 : 1;
+    }
+    return 0;
+}
+
+static
+tni_response_t tree_index_dirs(tree_dir_t **dirs, uint32_t *dir_num, tni_tree_t *tree) {
+
+    tni_response_t ret_val;
+    uint32_t node;
+
+    *dir_num = 0;
+    ret_val = handle_alloc((void **) dirs, MAX(tree->node_num, 1),
+                            sizeof(tree_dir_t), false);
+    if (ret_val != TNI_OK) {
+        goto exit_normal;
+    }
+
+    for (node = 0; node < tree->node_num; node++) {
+        if (!(tree->nodes[node].flags & 0x2) || (tree->nodes[node].flags & EXTENT_FLAG)) {
+            continue;
+        }
+
+        (*dirs)[*dir_num].lba = tree->nodes[node].lba;
+        (*dirs)[*dir_num].length = tree->nodes[node].length;
+        (*dirs)[*dir_num].node = node;
+        *dir_num += 1;
+    }
+
+    qsort(*dirs, *dir_num, sizeof(tree_dir_t), compare_tree_dir);
+
+    ret_val = TNI_OK;
+    exit_normal:
+        return ret_val;
+}
+
+static
+uint32_t tree_find_dir(tree_dir_t *dirs, uint32_t dir_num, tni_node_t *dir) {
+
+    uint32_t lo, hi, mid;
+
+    if (dir->flags & EXTENT_FLAG) {
+        return NODE_NONE;
+    }
+
+    lo = 0;
+    hi = dir_num;
+    while (lo < hi) {
+        mid = lo + ((hi - lo) / 2);
+        if (dirs[mid].lba < dir->lba) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    if (lo == dir_num || dirs[lo].lba != dir->lba || dirs[lo].length != dir->length) {
+        return NODE_NONE;
+    }
+    return dirs[lo].node;
+}
+
+static
+tni_response_t tree_copy_children(tni_tree_t *tree, hash_set_t *names, uint32_t parent,
+                                    tni_tree_t *prev, uint32_t prev_parent) {
+
+    tni_response_t ret_val;
+    tni_node_t *src_node, *cur_node;
+    uint32_t child, node, prev_node, name_off, idx;
+
+    prev_node = NODE_NONE;
+    for (child = prev->nodes[prev_parent].first_child; child != NODE_NONE;
+            child = prev->nodes[child].next_sibling) {
+
+        src_node = &(prev->nodes[child]);
+        ret_val = tree_intern(&name_off, tree, names, tni_tree_name(prev, child),
+                                src_node->name_len);
+        if (ret_val != TNI_OK) {
+            goto exit_normal;
+        }
+
+        ret_val = tree_add_node(&node, tree, parent);
+        if (ret_val != TNI_OK) {
+            goto exit_normal;
+        }
+
+        cur_node = &(tree->nodes[node]);
+        cur_node->name_off = name_off;
+        cur_node->name_len = src_node->name_len;
+        cur_node->flags = src_node->flags;
+        cur_node->lba = src_node->lba;
+        cur_node->length = src_node->length;
+
+        if (src_node->flags & EXTENT_FLAG) {
+            cur_node->lba = tree->extent_num;
+            for (idx = 0; idx < src_node->length; idx++) {
+                ret_val = tree_add_extent(tree, prev->extents[src_node->lba + idx].lba,
+                                            prev->extents[src_node->lba + idx].length);
+                if (ret_val != TNI_OK) {
+                    goto exit_normal;
+                }
+            }
+        }
+
+        if (prev_node == NODE_NONE) {
+            tree->nodes[parent].first_child = node;
+        } else {
+            tree->nodes[prev_node].next_sibling = node;
+        }
+        prev_node = node;
+    }
+
+    ret_val = TNI_OK;
+    exit_normal:
+        return ret_val;
+}
+
+static
+tni_response_t tree_build(tni_iso_t *iso, tni_tree_t *tree, tni_tree_t *prev) {
+
+    tni_response_t ret_val;
+    iconv_t id_transform;
+    hash_set_t names, dirs;
+    tni_dir_batch_t batch;
+
+    tni_record_t dir_rec;
+    tni_extent_t *cur_extent;
+    uint32_t node, name_off, prev_node, prev_num;
+    tree_dir_t *prev_dirs;
+    bool inserted;
+
+    if (iso == NULL || tree == NULL) {
+        ret_val = TNI_ERR_ARGS;
+        goto exit_normal;
+    }
+
+    prev_dirs = NULL;
+    prev_num = 0;
+    if (prev != NULL) {
+        if (prev->block_size != iso->block_size || prev->parse_type != iso->parse_type) {
+            ret_val = TNI_ERR_ARGS;
+            goto exit_normal;
+        }
+
+        ret_val = tree_index_dirs(&prev_dirs, &prev_num, prev);
+        if (ret_val != TNI_OK) {
+            goto exit_normal;
+        }
+    }
+
+    memset(tree, 0, sizeof(tni_tree_t));
+    tree->block_size = iso->block_size;
+    tree->parse_type = iso->parse_type;
+
+    id_transform = iconv_open("UTF-8", parse_encoding(iso->parse_type));
+    if (id_transform == (iconv_t) -1) {
+        ret_val = TNI_ERROR;
+        goto exit_prev;
+    }
+
+    ret_val = set_init(&names, 1024);
+    if (ret_val != TNI_OK) {
+        goto exit_iconv;
+    }
+
+    ret_val = set_init(&dirs, 256);
+    if (ret_val != TNI_OK) {
+        goto exit_names;
+    }
+
+    ret_val = tree_intern(&name_off, tree, &names, "", 0);
+    if (ret_val != TNI_OK) {
+        goto exit_tree;
+    }
+
+    ret_val = tree_add_node(&node, tree, NODE_NONE);
+    if (ret_val != TNI_OK) {
+        goto exit_tree;
+    }
+
+    tree->nodes[node].name_off = name_off;
+    tree->nodes[node].flags = 0x2;
+
+    if (iso->root_dir->extent_num == 1) {
+        tree->nodes[node].lba = iso->root_dir->extent_list->lba;
+        tree->nodes[node].length = iso->root_dir->extent_list->length;
+
+    } else {
+        tree->nodes[node].flags |= EXTENT_FLAG;
+        tree->nodes[node].lba = 0;
+        tree->nodes[node].length = iso->root_dir->extent_num;
+
+        for (cur_extent = iso->root_dir->extent_list; cur_extent != NULL;
+                cur_extent = cur_extent->link) {
+            ret_val = tree_add_extent(tree, cur_extent->lba, cur_extent->length);
+            if (ret_val != TNI_OK) {
+                goto exit_tree;
+            }
+        }
+    }
+
+    for (node = 0; node < tree->node_num; node++) {
+
+        if (!(tree->nodes[node].flags & 0x2)) {
+            continue;
+        }
+
+        ret_val = tni_tree_record(tree, node, &dir_rec);
+        if (ret_val != TNI_OK) {
+            goto exit_tree;
+        }
+
+        ret_val = set_insert_lba(&inserted, &dirs, dir_rec.extent_list->lba);
+        if (ret_val != TNI_OK || !inserted) {
+            free_record(&dir_rec);
+            if (ret_val != TNI_OK) {
+                goto exit_tree;
+            }
+            continue;
+        }
+
+        prev_node = tree_find_dir(prev_dirs, prev_num, &(tree->nodes[node]));
+        if (prev_node != NODE_NONE) {
+            free_record(&dir_rec);
+            ret_val = tree_copy_children(tree, &names, node, prev, prev_node);
+            if (ret_val != TNI_OK) {
+                goto exit_tree;
+            }
+            continue;
+        }
+
+        ret_val = tni_read_dir_batch(iso, &dir_rec, &batch);
+        free_record(&dir_rec);
+        if (ret_val != TNI_OK) {
+            goto exit_tree;
+        }
+
+        ret_val = tree_add_batch(tree, &names, id_transform, node, &batch);
+        tni_free_dir_batch(&batch);
+        if (ret_val != TNI_OK) {
+            goto exit_tree;
+        }
+    }
+
+    ret_val = TNI_OK;
+    goto exit_dirs;
+
+    exit_tree:
+        tni_free_tree(tree);
+    exit_dirs:
+        free(dirs.slots);
+    exit_names:
+        free(names.slots);
+    exit_iconv:
+        iconv_close(id_transform);
+    exit_prev:
+        free(prev_dirs);
+    exit_normal:
+        return ret_val;
+}
+
+static
+tni_response_t tree_read(int fd, void *buf, size_t size) {
+
+    tni_response_t ret_val;
+    size_t got;
+
+    ret_val = handle_read(fd, buf, size, &got);
+    if (ret_val == TNI_OK && got != size) {
+        ret_val = TNI_ERR_FILE;
+    }
+    return ret_val;
+}
+
+static
+tni_response_t tree_check(tni_tree_t *tree) {
+
+    tni_node_t *cur_node;
+    uint32_t node;
+
+    if (tree->node_num == 0 || tree->names_len == 0
+        || tree->names[tree->names_len - 1] != '\0'
+        || tree->nodes[0].parent != NODE_NONE) {
+        return TNI_ERR_FILE;
+    }
+
+    for (node = 0; node < tree->node_num; node++) {
+
+        cur_node = &(tree->nodes[node]);
+        if (node != 0 && cur_node->parent >= node) {
+            return TNI_ERR_FILE;
+        }
+
+        if ((cur_node->first_child != NODE_NONE
+                && (cur_node->first_child <= node || cur_node->first_child >= tree->node_num))
+            || (cur_node->next_sibling != NODE_NONE
+                && (cur_node->next_sibling <= node || cur_node->next_sibling >= tree->node_num))) {
+            return TNI_ERR_FILE;
+        }
+
+        if ((uint64_t) cur_node->name_off + cur_node->name_len >= tree->names_len) {
+            return TNI_ERR_FILE;
+        }
+
+        if ((cur_node->flags & EXTENT_FLAG)
+            && (uint64_t) cur_node->lba + cur_node->length > tree->extent_num) {
+            return TNI_ERR_FILE;
+        }
+    }
+
+    return TNI_OK;
+}
+
+
+/**** Implanted MD5 ****/
+
+#define MD5_CHUNK 32768
+#define MD5_IO_SIZE (4 << 20)
+#define MD5_IO_ALIGN 4096
+#define MD5_FRAGMENT_CHARS 60
+#define MD5_APPDATA_OFFSET 883
+#define MD5_APPDATA_SIZE 512
+
+static const uint32_t md5_table[64] = {
+    0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee,
+    0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+    0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be,
+    0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+    0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa,
+    0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+    0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed,
+    0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+    0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c,
+    0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+    0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05,
+    0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+    0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039,
+    0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+    0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1,
+    0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391,
+};
+
+static const uint8_t md5_shift[16] = {
+    7, 12, 17, 22, 5, 9, 14, 20, 4, 11, 16, 23, 6, 10, 15, 21,
+};
+
+static
+void md5_block(md5_ctx_t *ctx, const uint8_t *block) {
+
+    uint32_t words[16], a, b, c, d, f, t_val;
+    int idx, word;
+
+    for (idx = 0; idx < 16; idx++) {
+        words[idx] = LE_int32((uint8_t *) block + (idx * 4));
+    }
+
+    a = ctx->state[0];
+    b = ctx->state[1];
+    c = ctx->state[2];
+    d = ctx->state[3];
+
+    for (idx = 0; idx < 64; idx++) {
+        if (idx < 16) {
+            f = (b & c) | (~b & d);
+            word = idx;
+        } else if (idx < 32) {
+            f = (d & b) | (~d & c);
+            word = ((5 * idx) + 1) % 16;
+        } else if (idx < 48) {
+            f = b ^ c ^ d;
+            word = ((3 * idx) + 5) % 16;
+        } else {
+            f = c ^ (b | ~d);
+            word = (7 * idx) % 16;
+        }
+
+        t_val = d;
+        d = c;
+        c = b;
+        f += a + md5_table[idx] + words[word];
+        b += (f << md5_shift[((idx / 16) * 4) + (idx % 4)])
+            | (f >> (32 - md5_shift[((idx / 16) * 4) + (idx % 4)]));
+        a = t_val;
+    }
+
+    ctx->state[0] += a;
+    ctx->state[1] += b;
+    ctx->state[2] += c;
+    ctx->state[3] += d;
+}
+
+static
+void md5_init(md5_ctx_t *ctx) {
+    ctx->state[0] = 0x67452301;
+    ctx->state[1] = 0xefcdab89;
+    ctx->state[2] = 0x98badcfe;
+    ctx->state[3] = 0x10325476;
+    ctx->length = 0;
+}
+
+static
+void md5_update(md5_ctx_t *ctx, const uint8_t *data, size_t size) {
+
+    size_t used, fill;
+
+    used = ctx->length % 64;
+    ctx->length += size;
+
+    if (used != 0) {
+        fill = MIN(64 - used, size);
+        memcpy(ctx->tail + used, data, fill);
+        data += fill;
+        size -= fill;
+
+        if (used + fill < 64) {
+            return;
+        }
+        md5_block(ctx, ctx->tail);
+    }
+
+    while (size >= 64) {
+        md5_block(ctx, data);
+        data += 64;
+        size -= 64;
+    }
+    memcpy(ctx->tail, data, size);
+}
+
+static
+void md5_final(md5_ctx_t *ctx, uint8_t *digest) {
+
+    uint8_t pad[72];
+    uint64_t bits;
+    size_t pad_len;
+    int idx;
+
+    bits = ctx->length * 8;
+    pad_len = (ctx->length % 64 < 56)? 56 - (ctx->length % 64) : 120 - (ctx->length % 64);
+
+    memset(pad, 0, sizeof(pad));
+    pad[0] = 0x80;
+    for (idx = 0; idx < 8; idx++) {
+        pad[pad_len + idx] = (uint8_t) (bits >> (idx * 8));
+    }
+    md5_update(ctx, pad, pad_len + 8);
+
+    for (idx = 0; idx < 16; idx++) {
+        digest[idx] = (uint8_t) (ctx->state[idx / 4] >> ((idx % 4) * 8));
+    }
+}
+
+static
+tni_response_t parse_md5_field(char **field, char *app_data, char *key) {
+
+    char *found;
+
+    found = strstr(app_data, key);
+    if (found == NULL) {
+        return TNI_FAIL;
+    }
+
+    *field = found + strlen(key);
+    return TNI_OK;
+}
+
+static
+tni_response_t parse_md5_info(md5_info_t *info, iso_vol_desc_t *desc) {
+
+    tni_response_t ret_val;
+    char app_data[MD5_APPDATA_SIZE + 1];
+    char *field;
+    size_t idx;
+
+    memcpy(app_data, desc->app_use, MD5_APPDATA_SIZE);
+    app_data[MD5_APPDATA_SIZE] = '\0';
+
+    ret_val = parse_md5_field(&field, app_data, "ISO MD5SUM = ");
+    if (ret_val != TNI_OK) {
+        goto exit_normal;
+    }
+
+    for (idx = 0; idx < 32; idx++) {
+        if (strchr("0123456789abcdefABCDEF", field[idx]) == NULL || field[idx] == '\0') {
+            ret_val = TNI_FAIL;
+            goto exit_normal;
+        }
+        info->hash_sum[idx] = field[idx] | 0x20;
+    }
+    info->hash_sum[32] = '\0';
+
+    info->skip_sectors = 0;
+    if (parse_md5_field(&field, app_data, "SKIPSECTORS = ") == TNI_OK) {
+        info->skip_sectors = strtoull(field, NULL, 10);
+    }
+
+    info->fragment_count = 0;
+    info->fragment_sums[0] = '\0';
+    if (parse_md5_field(&field, app_data, "FRAGMENT SUMS = ") == TNI_OK) {
+        for (idx = 0; idx < MD5_FRAGMENT_CHARS && field[idx] != ';'
+                && field[idx] != '\0'; idx++) {
+            info->fragment_sums[idx] = field[idx] | 0x20;
+        }
+        info->fragment_sums[idx] = '\0';
+
+        if (parse_md5_field(&field, app_data, "FRAGMENT COUNT = ") == TNI_OK) {
+            info->fragment_count = strtoul(field, NULL, 10);
+        }
+    }
+
+    if (info->fragment_count > MD5_FRAGMENT_CHARS) {
+        info->fragment_count = 0;
+    }
+
+    ret_val = TNI_OK;
+    exit_normal:
+        return ret_val;
+}
+
+static
+bool check_md5_fragment(md5_ctx_t *ctx, md5_info_t *info, uint64_t fragment) {
+
+    static const char hex_digits[] = "0123456789abcdef";
+    md5_ctx_t t_ctx;
+    uint8_t digest[16];
+    size_t idx, chars, start;
+    char expect;
+
+    t_ctx = *ctx;
+    md5_final(&t_ctx, digest);
+
+    chars = MD5_FRAGMENT_CHARS / info->fragment_count;
+    start = (fragment - 1) * chars;
+
+    for (idx = 0; idx < MIN(chars, (size_t) 16); idx++) {
+        if (start + idx >= strlen(info->fragment_sums)) {
+            break;
+        }
+
+        expect = (digest[idx] >= 0x10)? hex_digits[digest[idx] >> 4]
+                                        : hex_digits[digest[idx]];
+        if (info->fragment_sums[start + idx] != expect) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static
+void *md5_reader(void *raw_state) {
+
+    md5_reader_t *state;
+    tni_response_t ret_val;
+    size_t read_size;
+    off_t read_pos;
+    bool stop;
+    int idx;
+
+    state = (md5_reader_t *) raw_state;
+    read_pos = 0;
+    idx = 0;
+
+    while (read_pos < state->total) {
+
+        pthread_mutex_lock(&(state->lock));
+        while (state->full[idx] && !(state->stop)) {
+            pthread_cond_wait(&(state->cond), &(state->lock));
+        }
+        stop = state->stop;
+        pthread_mutex_unlock(&(state->lock));
+
+        if (stop) {
+            break;
+        }
+
+        read_size = MIN((off_t) MD5_IO_SIZE, state->total - read_pos);
+        ret_val = iso_read(state->iso, state->buffer[idx], read_size, read_pos);
+
+        pthread_mutex_lock(&(state->lock));
+        state->length[idx] = (ret_val == TNI_OK)? read_size : 0;
+        state->status = ret_val;
+        state->full[idx] = true;
+        pthread_cond_broadcast(&(state->cond));
+        pthread_mutex_unlock(&(state->lock));
+
+        if (ret_val != TNI_OK) {
+            break;
+        }
+
+        read_pos += read_size;
+        idx ^= 1;
+    }
+
+    return NULL;
+}
+
+static
+void clear_app_data(uint8_t *data, size_t size, off_t data_pos, off_t app_pos) {
+
+    off_t start, end;
+
+    start = MAX(data_pos, app_pos);
+    end = MIN(data_pos + (off_t) size, app_pos + MD5_APPDATA_SIZE);
+
+    if (start < end) {
+        memset(data + (start - data_pos), ' ', end - start);
+    }
+}
+
+/**** Streaming ****/
+
+#define STREAM_CHUNK 32
+#define STREAM_WINDOW (1 << 20)
+#define STREAM_PENDING (1 << 20)
+
+static
+void stream_release(stream_entry_t *entry) {
+
+    entry->refs -= 1;
+    if (entry->refs == 0) {
+        free_record(&(entry->record));
+        free(entry->path);
+        free(entry);
+    }
+}
+
+static
+void stream_drop(stream_item_t *item) {
+    free(item->dir_data);
+    stream_release(item->entry);
+}
+
+static
+tni_response_t stream_push(stream_state_t *state, stream_item_t *item) {
+
+    tni_response_t ret_val;
+    stream_item_t t_item;
+    size_t idx, parent;
+
+    if (state->heap_len == state->heap_cap) {
+        if (state->heap_cap >= state->max_pending) {
+            ret_val = TNI_ERR_MEM;
+            goto exit_normal;
+        }
+
+        ret_val = handle_realloc((void **) &(state->heap),
+                                MAX(state->heap_cap * 2, 64), sizeof(stream_item_t));
+        if (ret_val != TNI_OK) {
+            goto exit_normal;
+        }
+        state->heap_cap = MAX(state->heap_cap * 2, 64);
+    }
+
+    idx = state->heap_len++;
+    state->heap[idx] = *item;
+    item->entry->refs += 1;
+
+    while (idx != 0) {
+        parent = (idx - 1) / 2;
+        if (state->heap[parent].lba <= state->heap[idx].lba) {
+            break;
+        }
+
+        t_item = state->heap[parent];
+        state->heap[parent] = state->heap[idx];
+        state->heap[idx] = t_item;
+        idx = parent;
+    }
+
+    ret_val = TNI_OK;
+    exit_normal:
+        return ret_val;
+}
+
+static
+void stream_pop(stream_state_t *state, stream_item_t *item) {
+
+    stream_item_t t_item;
+    size_t idx, child;
+
+    *item = state->heap[0];
+    state->heap[0] = state->heap[--state->heap_len];
+
+    idx = 0;
+    while ((child = (idx * 2) + 1) < state->heap_len) {
+        if (child + 1 < state->heap_len
+            && state->heap[child + 1].lba < state->heap[child].lba) {
+            child += 1;
+        }
+
+        if (state->heap[idx].lba <= state->heap[child].lba) {
+            break;
+        }
+
+        t_item = state->heap[child];
+        state->heap[child] = state->heap[idx];
+        state->heap[idx] = t_item;
+        idx = child;
+    }
+}
+
+static
+tni_response_t stream_fill(stream_state_t *state, uint32_t lba) {
+
+    tni_response_t ret_val;
+    uint32_t slot, count;
+    size_t got;
+
+    while (lba >= state->win_end) {
+
+        slot = state->win_end % state->ring_sectors;
+        count = MIN(state->ring_sectors - slot, STREAM_CHUNK);
+
+        ret_val = handle_read(state->fd, state->ring + ((size_t) slot * SECTOR_SIZE),
+                                (size_t) count * SECTOR_SIZE, &got);
+        if (ret_val != TNI_OK) {
+            goto exit_normal;
+        }
+
+        count = got / SECTOR_SIZE;
+        if (count == 0) {
+            ret_val = TNI_ERR_FILE;
+            goto exit_normal;
+        }
+
+        state->win_end += count;
+        state->win_fill = MIN(state->win_fill + count, state->ring_sectors);
+    }
+
+    ret_val = TNI_OK;
+    exit_normal:
+        return ret_val;
+}
+
+static
+tni_response_t stream_deliver(stream_state_t *state, stream_item_t *item,
+                                uint32_t limit, tni_stream_callback_t *cb) {
+
+    tni_response_t ret_val;
+    tni_signal_t signal;
+    tni_chunk_t chunk;
+
+    uint32_t slot, run;
+    size_t size;
+    void *data;
+
+    do {
+        if (item->lba < state->win_end - state->win_fill) {
+
+            /* Behind the window: only a seekable input can go back for it. */
+            if (!(state->seekable)) {
+                ret_val = TNI_ERR_ORDER;
+                goto exit_normal;
+            }
+
+            if (state->spill == NULL) {
+                ret_val = handle_alloc((void **) &(state->spill), STREAM_CHUNK,
+                                        SECTOR_SIZE, false);
+                if (ret_val != TNI_OK) {
+                    goto exit_normal;
+                }
+            }
+
+            run = MIN(state->win_end - state->win_fill - item->lba, STREAM_CHUNK);
+            size = MIN((size_t) run * SECTOR_SIZE, (size_t) item->remaining);
+            data = state->spill;
+
+            ret_val = handle_pread(state->fd, data, size,
+                                    state->base + (off_t) item->lba * SECTOR_SIZE);
+            if (ret_val != TNI_OK) {
+                goto exit_normal;
+            }
+
+        } else {
+            ret_val = stream_fill(state, item->lba);
+            if (ret_val != TNI_OK) {
+                goto exit_normal;
+            }
+
+            slot = item->lba % state->ring_sectors;
+            run = MIN(state->win_end - item->lba, state->ring_sectors - slot);
+            size = MIN((size_t) run * SECTOR_SIZE, (size_t) item->remaining);
+            data = state->ring + ((size_t) slot * SECTOR_SIZE);
+        }
+
+        if (item->dir_data != NULL) {
+            memcpy(item->dir_data + item->offset, data, size);
+
+        } else {
+            chunk.path = item->entry->path;
+            chunk.record = &(item->entry->record);
+            chunk.offset = item->offset;
+            chunk.data = data;
+            chunk.size = size;
+
+            signal = cb->fn(&chunk, cb->args);
+            if (signal == TNI_SIGNAL_STOP) {
+                ret_val = TNI_FAIL;
+                goto exit_normal;
+            }
+            if (signal == TNI_SIGNAL_ERR) {
+                ret_val = TNI_ERR_CB;
+                goto exit_normal;
+            }
+        }
+
+        item->lba += (size + SECTOR_SIZE - 1) / SECTOR_SIZE;
+        item->remaining -= size;
+        item->offset += size;
+
+    } while (item->remaining != 0 && item->lba < limit);
+
+    ret_val = TNI_OK;
+    exit_normal:
+        return ret_val;
+}
+
+static
+tni_response_t stream_queue(stream_state_t *state, stream_entry_t *entry) {
+
+    tni_response_t ret_val;
+    stream_item_t item;
+    tni_extent_t *cur_extent;
+    off_t offset;
+
+    offset = 0;
+    cur_extent = entry->record.extent_list;
+    while (cur_extent != NULL) {
+
+        if (cur_extent->length != 0) {
+            item.lba = cur_extent->lba;
+            item.remaining = cur_extent->length;
+            item.offset = (entry->record.is_dir)? 0 : offset;
+            item.entry = entry;
+            item.dir_data = NULL;
+
+            if (entry->record.is_dir) {
+                ret_val = handle_alloc((void **) &(item.dir_data), 1,
+                                        cur_extent->length, false);
+                if (ret_val != TNI_OK) {
+                    goto exit_normal;
+                }
+            }
+
+            ret_val = stream_push(state, &item);
+            if (ret_val != TNI_OK) {
+                free(item.dir_data);
+                goto exit_normal;
+            }
+        }
+
+        offset += cur_extent->length;
+        cur_extent = cur_extent->link;
+    }
+
+    ret_val = TNI_OK;
+    exit_normal:
+        return ret_val;
+}
+
+static
+tni_response_t stream_parse_dir(stream_state_t *state, stream_item_t *item,
+                                tni_stream_callback_t *cb) {
+
+    tni_response_t ret_val;
+    tni_signal_t signal;
+    tni_chunk_t chunk;
+
+    buffer_state_t buf_state;
+    generator_t gen;
+
+    tni_record_t cur_rec;
+    stream_entry_t *entry;
+    size_t path_len;
+    bool inserted;
+
+    buf_state.iso = &(state->iso);
+    buf_state.data = item->dir_data;
+    buf_state.pos = 0;
+    buf_state.end = item->offset;
+
+    gen.generate = buffer_generator;
+    gen.state = (void *) &buf_state;
+
+    while (true) {
+
+        ret_val = parse_record(&cur_rec, &(state->iso), &gen);
+        if (ret_val == TNI_FAIL) {
+            break;
+        }
+        if (ret_val != TNI_OK) {
+            goto exit_normal;
+        }
+
+        if (cur_rec.type != REC_NORMAL) {
+            free_record(&cur_rec);
+            continue;
+        }
+
+        /* Extents may point backwards; only a directory seen twice is dropped. */
+        if (cur_rec.is_dir) {
+            ret_val = set_insert_lba(&inserted, &(state->dirs),
+                                        cur_rec.extent_list->lba);
+            if (ret_val != TNI_OK || !inserted) {
+                free_record(&cur_rec);
+                if (ret_val != TNI_OK) {
+                    goto exit_normal;
+                }
+                continue;
+            }
+        }
+
+        ret_val = handle_alloc((void **) &entry, 1, sizeof(stream_entry_t), false);
+        if (ret_val != TNI_OK) {
+            free_record(&cur_rec);
+            goto exit_normal;
+        }
+
+        path_len = strlen(item->entry->path);
+        ret_val = handle_alloc((void **) &(entry->path),
+                                path_len + cur_rec.id_length + 2, 1, false);
+        if (ret_val != TNI_OK) {
+            free_record(&cur_rec);
+            free(entry);
+            goto exit_normal;
+        }
+
+        memcpy(entry->path, item->entry->path, path_len);
+        if (path_len != 0) {
+            entry->path[path_len++] = '/';
+        }
+        memcpy(entry->path + path_len, cur_rec.record_id, cur_rec.id_length + 1);
+
+        entry->record = cur_rec;
+        entry->refs = 1;
+
+        ret_val = stream_queue(state, entry);
+        if (ret_val != TNI_OK) {
+            stream_release(entry);
+            goto exit_normal;
+        }
+
+        if (entry->record.is_dir || entry->refs == 1) {
+            chunk.path = entry->path;
+            chunk.record = &(entry->record);
+            chunk.offset = 0;
+            chunk.data = NULL;
+            chunk.size = 0;
+
+            signal = cb->fn(&chunk, cb->args);
+            if (signal != TNI_SIGNAL_OK) {
+                stream_release(entry);
+                ret_val = (signal == TNI_SIGNAL_STOP)? TNI_FAIL : TNI_ERR_CB;
+                goto exit_normal;
+            }
+        }
+
+        stream_release(entry);
+    }
+
+    ret_val = TNI_OK;
+    exit_normal:
+        return ret_val;
+}
+
+/**** Image Diff ****/
+
+#define DIFF_CHUNK (1 << 16)
+
+static
+tni_response_t list_dir(record_list_t *records, tni_iso_t *iso, tni_record_t *dir) {
+
+    tni_response_t ret_val;
+    tni_callback_t cb;
+
+    records->list = NULL;
+    records->length = 0;
+    records->capacity = 0;
+
+    cb.fn = collect_record;
+    cb.args = (void *) records;
+
+    ret_val = tni_traverse_dir(iso, dir, &cb);
+    if (ret_val != TNI_OK) {
+        free_record_list(records);
+        goto exit_normal;
+    }
+
+    if (records->length > 1) {
+        qsort(records->list, records->length, sizeof(tni_record_t), compare_record_name);
+    }
+
+    exit_normal:
+        return ret_val;
+}
+
+static
+tni_response_t diff_path_push(size_t *old_len, diff_state_t *state, tni_record_t *rec) {
+
+    tni_response_t ret_val;
+    size_t new_len;
+
+    *old_len = state->path_len;
+    new_len = state->path_len + rec->id_length + 2;
+
+    if (new_len > state->path_cap) {
+        ret_val = handle_realloc((void **) &(state->path), new_len * 2, 1);
+        if (ret_val != TNI_OK) {
+            goto exit_normal;
+        }
+        state->path_cap = new_len * 2;
+    }
+
+    if (state->path_len != 0) {
+        state->path[state->path_len++] = '/';
+    }
+    memcpy(state->path + state->path_len, rec->record_id, rec->id_length + 1);
+    state->path_len += rec->id_length;
+
+    ret_val = TNI_OK;
+    exit_normal:
+        return ret_val;
+}
+
+static
+void diff_path_pop(diff_state_t *state, size_t old_len) {
+    state->path_len = old_len;
+    state->path[old_len] = '\0';
+}
+
+static
+tni_response_t diff_add_range(diff_state_t *state, off_t start, off_t end) {
+
+    tni_response_t ret_val;
+    range_t *last;
+
+    if (state->range_num != 0) {
+        last = &(state->range_list[state->range_num - 1]);
+        if (last->end >= start) {
+            last->end = MAX(last->end, end);
+            ret_val = TNI_OK;
+            goto exit_normal;
+        }
+    }
+
+    if (state->range_num == state->range_cap) {
+        ret_val = handle_realloc((void **) &(state->range_list),
+                                MAX(state->range_cap * 2, 16), sizeof(range_t));
+        if (ret_val != TNI_OK) {
+            goto exit_normal;
+        }
+        state->range_cap = MAX(state->range_cap * 2, 16);
+    }
+
+    state->range_list[state->range_num].start = start;
+    state->range_list[state->range_num].end = end;
+    state->range_num += 1;
+
+    ret_val = TNI_OK;
+    exit_normal:
+        return ret_val;
+}
+
+static
+tni_response_t diff_emit(diff_state_t *state, tni_diff_kind_t kind,
+                            tni_record_t *rec_a, tni_record_t *rec_b) {
+
+    tni_diff_entry_t entry;
+    tni_signal_t signal;
+    tni_record_t *rec;
+    range_t whole;
+
+    entry.kind = kind;
+    entry.path = state->path;
+    entry.rec_a = rec_a;
+    entry.rec_b = rec_b;
+    entry.range_num = 0;
+    entry.range_list = NULL;
+
+    if (kind == TNI_DIFF_CHANGED) {
+        entry.range_num = state->range_num;
+        entry.range_list = state->range_list;
+
+    } else {
+        rec = (rec_a != NULL)? rec_a : rec_b;
+        if (!(rec->is_dir) && rec->total_size != 0) {
+            whole.start = 0;
+            whole.end = rec->total_size;
+            entry.range_num = 1;
+            entry.range_list = &whole;
+        }
+    }
+
+    signal = state->cb->fn(&entry, state->cb->args);
+    if (signal == TNI_SIGNAL_STOP) {
+        return TNI_FAIL;
+    }
+    if (signal == TNI_SIGNAL_ERR) {
+        return TNI_ERR_CB;
+    }
+    return TNI_OK;
+}
+
+static
+tni_response_t diff_report(diff_state_t *state, tni_iso_t *iso, tni_record_t *rec,
+                            tni_diff_kind_t kind) {
+
+    tni_response_t ret_val;
+    record_list_t records;
+    size_t idx, old_len;
+
+    if (kind == TNI_DIFF_REMOVED) {
+        ret_val = diff_emit(state, kind, rec, NULL);
+    } else {
+        ret_val = diff_emit(state, kind, NULL, rec);
+    }
+
+    if (ret_val != TNI_OK || !(rec->is_dir)) {
+        goto exit_normal;
+    }
+
+    ret_val = list_dir(&records, iso, rec);
+    if (ret_val != TNI_OK) {
+        goto exit_normal;
+    }
+
+    for (idx = 0; idx < records.length; idx++) {
+
+        ret_val = diff_path_push(&old_len, state, &(records.list[idx]));
+        if (ret_val != TNI_OK) {
+            goto exit_list;
+        }
+
+        ret_val = diff_report(state, iso, &(records.list[idx]), kind);
+        diff_path_pop(state, old_len);
+        if (ret_val != TNI_OK) {
+            goto exit_list;
+        }
+    }
+
+    ret_val = TNI_OK;
+    exit_list:
+        free_record_list(&records);
+    exit_normal:
+        return ret_val;
+}
+
+static
+tni_response_t diff_content(diff_state_t *state, off_t phys_a, off_t phys_b,
+                            off_t rel_pos, off_t length) {
+
+    tni_response_t ret_val;
+    size_t read_size, idx, blk;
+
+    while (length != 0) {
+
+        read_size = MIN((off_t) DIFF_CHUNK, length);
+
+        ret_val = iso_read(state->iso_a, state->buf_a, read_size, phys_a);
+        if (ret_val != TNI_OK) {
+            goto exit_normal;
+        }
+
+        ret_val = iso_read(state->iso_b, state->buf_b, read_size, phys_b);
+        if (ret_val != TNI_OK) {
+            goto exit_normal;
+        }
+
+        for (idx = 0; idx < read_size; idx += SECTOR_SIZE) {
+            blk = MIN((size_t) SECTOR_SIZE, read_size - idx);
+            if (memcmp(state->buf_a + idx, state->buf_b + idx, blk) != 0) {
+                ret_val = diff_add_range(state, rel_pos + idx, rel_pos + idx + blk);
+                if (ret_val != TNI_OK) {
+                    goto exit_normal;
+                }
+            }
+        }
+
+        phys_a += read_size;
+        phys_b += read_size;
+        rel_pos += read_size;
+        length -= read_size;
+    }
+
+    ret_val = TNI_OK;
+    exit_normal:
+        return ret_val;
+}
+
+static
+tni_response_t diff_file(diff_state_t *state, tni_record_t *rec_a, tni_record_t *rec_b) {
+
+    tni_response_t ret_val;
+    tni_extent_t *ext_a, *ext_b;
+    off_t start_a, start_b, rel_pos, seg_end, common;
+    off_t phys_a, phys_b;
+
+    state->range_num = 0;
+
+    ext_a = rec_a->extent_list;
+    ext_b = rec_b->extent_list;
+    start_a = 0;
+    start_b = 0;
+
+    rel_pos = 0;
+    common = MIN(rec_a->total_size, rec_b->total_size);
+
+    while (rel_pos < common) {
+
+        while (ext_a != NULL && start_a + ext_a->length <= rel_pos) {
+            start_a += ext_a->length;
+            ext_a = ext_a->link;
+        }
+
+        while (ext_b != NULL && start_b + ext_b->length <= rel_pos) {
+            start_b += ext_b->length;
+            ext_b = ext_b->link;
+        }
+
+        if (ext_a == NULL || ext_b == NULL) {
+            break;
+        }
+
+        seg_end = MIN(start_a + ext_a->length, start_b + ext_b->length);
+        seg_end = MIN(seg_end, common);
+
+        phys_a = ((off_t) ext_a->lba * state->iso_a->block_size) + (rel_pos - start_a);
+        phys_b = ((off_t) ext_b->lba * state->iso_b->block_size) + (rel_pos - start_b);
+
+        if (phys_a != phys_b) {
+            ret_val = diff_content(state, phys_a, phys_b, rel_pos, seg_end - rel_pos);
+            if (ret_val != TNI_OK) {
+                goto exit_normal;
+            }
+        }
+
+        rel_pos = seg_end;
+    }
+
+    if (rel_pos < MAX(rec_a->total_size, rec_b->total_size)) {
+        ret_val = diff_add_range(state, rel_pos, MAX(rec_a->total_size, rec_b->total_size));
+        if (ret_val != TNI_OK) {
+            goto exit_normal;
+        }
+    }
+
+    ret_val = TNI_OK;
+    if (state->range_num != 0 || rec_a->is_hidden != rec_b->is_hidden) {
+        ret_val = diff_emit(state, TNI_DIFF_CHANGED, rec_a, rec_b);
+    }
+
+    exit_normal:
+        return ret_val;
+}
+
+static
+tni_response_t diff_same_dir(bool *same, diff_state_t *state,
+                                tni_record_t *dir_a, tni_record_t *dir_b) {
+
+    tni_response_t ret_val;
+    void *raw_a, *raw_b;
+
+    *same = false;
+    if (dir_a->total_size != dir_b->total_size) {
+        ret_val = TNI_OK;
+        goto exit_normal;
+    }
+
+    ret_val = handle_alloc(&raw_a, dir_a->total_size, 1, false);
+    if (ret_val != TNI_OK) {
+        goto exit_normal;
+    }
+
+    ret_val = handle_alloc(&raw_b, dir_b->total_size, 1, false);
+    if (ret_val != TNI_OK) {
+        goto exit_a;
+    }
+
+    ret_val = tni_read_file(raw_a, state->iso_a, dir_a, 0, dir_a->total_size);
+    if (ret_val != TNI_OK) {
+        goto exit_b;
+    }
+
+    ret_val = tni_read_file(raw_b, state->iso_b, dir_b, 0, dir_b->total_size);
+    if (ret_val != TNI_OK) {
+        goto exit_b;
+    }
+
+    *same = memcmp(raw_a, raw_b, dir_a->total_size) == 0;
+
+    ret_val = TNI_OK;
+    exit_b:
+        free(raw_b);
+    exit_a:
+        free(raw_a);
+    exit_normal:
+        return ret_val;
+}
+
+static
+tni_response_t diff_dir(diff_state_t *state, tni_record_t *dir_a, tni_record_t *dir_b) {
+
+    tni_response_t ret_val;
+    record_list_t list_a, list_b;
+    tni_record_t *rec_a, *rec_b;
+    size_t idx_a, idx_b, old_len;
+    bool same;
+    int cmp;
+
+    ret_val = diff_same_dir(&same, state, dir_a, dir_b);
+    if (ret_val != TNI_OK || same) {
+        goto exit_normal;
+    }
+
+    ret_val = list_dir(&list_a, state->iso_a, dir_a);
+    if (ret_val != TNI_OK) {
+        goto exit_normal;
+    }
+
+    ret_val = list_dir(&list_b, state->iso_b, dir_b);
+    if (ret_val != TNI_OK) {
+        goto exit_a;
+    }
+
+    idx_a = 0;
+    idx_b = 0;
+    while (idx_a < list_a.length || idx_b < list_b.length) {
+
+        rec_a = (idx_a < list_a.length)? &(list_a.list[idx_a]) : NULL;
+        rec_b = (idx_b < list_b.length)? &(list_b.list[idx_b]) : NULL;
+
+        if (rec_a == NULL) {
+            cmp = 1;
+        } else if (rec_b == NULL) {
+            cmp = -1;
+        } else {
+            cmp = strcmp(rec_a->record_id, rec_b->record_id);
+        }
+
+        ret_val = diff_path_push(&old_len, state, (cmp <= 0)? rec_a : rec_b);
+        if (ret_val != TNI_OK) {
+            goto exit_b;
+        }
+
+        if (cmp < 0) {
+            ret_val = diff_report(state, state->iso_a, rec_a, TNI_DIFF_REMOVED);
+            idx_a += 1;
+
+        } else if (cmp > 0) {
+            ret_val = diff_report(state, state->iso_b, rec_b, TNI_DIFF_ADDED);
+            idx_b += 1;
+
+        } else {
+            if (rec_a->is_dir && rec_b->is_dir) {
+                ret_val = diff_dir(state, rec_a, rec_b);
+            } else if (!(rec_a->is_dir) && !(rec_b->is_dir)) {
+                ret_val = diff_file(state, rec_a, rec_b);
+            } else {
+                ret_val = diff_report(state, state->iso_a, rec_a, TNI_DIFF_REMOVED);
+                if (ret_val == TNI_OK) {
+                    ret_val = diff_report(state, state->iso_b, rec_b, TNI_DIFF_ADDED);
+                }
+            }
+            idx_a += 1;
+            idx_b += 1;
+        }
+
+        diff_path_pop(state, old_len);
+        if (ret_val != TNI_OK) {
+            goto exit_b;
+        }
+    }
+
+    ret_val = TNI_OK;
+    exit_b:
+        free_record_list(&list_b);
+    exit_a:
+        free_record_list(&list_a);
+    exit_normal:
+        return ret_val;
+}
+
+/**** Ordered Walk ****/
+
+static
+tni_response_t walk_push(walk_state_t *state, char *path, tni_record_t *dir) {
+
+    tni_response_t ret_val;
+    walk_item_t t_item;
+    size_t idx, parent;
+
+    if (state->heap_len == state->heap_cap) {
+        ret_val = handle_realloc((void **) &(state->heap),
+                                MAX(state->heap_cap * 2, 64), sizeof(walk_item_t));
+        if (ret_val != TNI_OK) {
+            goto exit_normal;
+        }
+        state->heap_cap = MAX(state->heap_cap * 2, 64);
+    }
+
+    idx = state->heap_len;
+    ret_val = copy_record(&(state->heap[idx].record), dir);
+    if (ret_val != TNI_OK) {
+        goto exit_normal;
+    }
+    state->heap[idx].lba = dir->extent_list->lba;
+    state->heap[idx].path = path;
+    state->heap_len += 1;
+
+    while (idx != 0) {
+        parent = (idx - 1) / 2;
+        if (state->heap[parent].lba <= state->heap[idx].lba) {
+            break;
+        }
+
+        t_item = state->heap[parent];
+        state->heap[parent] = state->heap[idx];
+        state->heap[idx] = t_item;
+        idx = parent;
+    }
+
+    ret_val = TNI_OK;
+    exit_normal:
+        return ret_val;
+}
+
+static
+void walk_pop(walk_state_t *state, walk_item_t *item) {
+
+    walk_item_t t_item;
+    size_t idx, child;
+
+    *item = state->heap[0];
+    state->heap[0] = state->heap[--state->heap_len];
+
+    idx = 0;
+    while ((child = (idx * 2) + 1) < state->heap_len) {
+        if (child + 1 < state->heap_len
+            && state->heap[child + 1].lba < state->heap[child].lba) {
+            child += 1;
+        }
+
+        if (state->heap[idx].lba <= state->heap[child].lba) {
+            break;
+        }
+
+        t_item = state->heap[child];
+        state->heap[child] = state->heap[idx];
+        state->heap[idx] = t_item;
+        idx = child;
+    }
+}
+
+static
+void walk_drop(walk_item_t *item) {
+    free(item->path);
+    free_record(&(item->record));
+}
+
+static
+tni_response_t walk_path(walk_state_t *state, char *parent, tni_record_t *rec) {
+
+    tni_response_t ret_val;
+    size_t parent_len, new_len;
+
+    parent_len = strlen(parent);
+    new_len = parent_len + rec->id_length + 2;
+
+    if (new_len > state->path_cap) {
+        ret_val = handle_realloc((void **) &(state->path), new_len, 1);
+        if (ret_val != TNI_OK) {
+            goto exit_normal;
+        }
+        state->path_cap = new_len;
+    }
+
+    memcpy(state->path, parent, parent_len);
+    if (parent_len != 0) {
+        state->path[parent_len++] = '/';
+    }
+    memcpy(state->path + parent_len, rec->record_id, rec->id_length + 1);
+
+    ret_val = TNI_OK;
+    exit_normal:
+        return ret_val;
+}
+
+
+/**** Remaster ****/
+
+#define ISO_NAME_MAX 30
+#define ISO_DIR_MAX 31
+#define JOLIET_NAME_MAX 64
+#define REMASTER_BAD_CHAR 0xFFFD
+#define REMASTER_SERIAL_MAX 99999
+
+static
+void put_both16(uint8_t *out, uint16_t value) {
+    out[0] = value & 0xFF;
+    out[1] = value >> 8;
+    out[2] = value >> 8;
+    out[3] = value & 0xFF;
+}
+
+static
+void put_both32(uint8_t *out, uint32_t value) {
+
+    int idx;
+
+    for (idx = 0; idx < 4; idx++) {
+        out[idx] = (value >> (8 * idx)) & 0xFF;
+        out[7 - idx] = (value >> (8 * idx)) & 0xFF;
+    }
+}
+
+static
+tni_response_t copy_fd_range(int out_fd, off_t out_pos, int in_fd, off_t in_pos, off_t size) {
+
+    tni_response_t ret_val;
+    uint8_t *buf;
+    size_t chunk;
+#ifdef __linux__
+    ssize_t copied;
+#endif
+
+    buf = NULL;
+    while (size > 0) {
+
+#ifdef __linux__
+        if (buf == NULL) {
+            copied = copy_file_range(in_fd, &in_pos, out_fd, &out_pos,
+                                        (size_t) MIN(size, (off_t) COPY_CHUNK * 64), 0);
+            if (copied > 0) {
+                size -= copied;
+                continue;
+            }
+
+            if (copied == -1 && errno == EINTR) {
+                continue;
+            }
+
+            if (copied == 0) {
+                ret_val = TNI_ERR_FILE;
+                goto exit_buffer;
+            }
+        }
+#endif
+
+        if (buf == NULL) {
+            ret_val = handle_alloc((void **) &buf, COPY_CHUNK, 1, false);
+            if (ret_val != TNI_OK) {
+                goto exit_normal;
+            }
+        }
+
+        chunk = (size_t) MIN(size, (off_t) COPY_CHUNK);
+        ret_val = handle_pread(in_fd, buf, chunk, in_pos);
+        if (ret_val != TNI_OK) {
+            goto exit_buffer;
+        }
+
+        ret_val = handle_pwrite(out_fd, buf, chunk, out_pos);
+        if (ret_val != TNI_OK) {
+            goto exit_buffer;
+        }
+
+        in_pos += chunk;
+        out_pos += chunk;
+        size -= chunk;
+    }
+
+    ret_val = TNI_OK;
+    exit_buffer:
+        free(buf);
+    exit_normal:
+        return ret_val;
+}
+
+static
+tni_response_t remaster_clone(int out_fd, tni_iso_t *iso, off_t image_size) {
+
+    tni_response_t ret_val;
+    uint8_t *buf;
+    size_t chunk;
+    off_t pos;
+    int src_fd;
+
+    if (iso->backend.ops == &file_ops) {
+        src_fd = ((file_backend_t *) iso->backend.ctx)->fd;
+#ifdef FICLONE
+        if (ioctl(out_fd, FICLONE, src_fd) == 0) {
+            return TNI_OK;
+        }
+#endif
+        return copy_fd_range(out_fd, 0, src_fd, 0, image_size);
+    }
+
+    ret_val = handle_alloc((void **) &buf, COPY_CHUNK, 1, false);
+    if (ret_val != TNI_OK) {
+        goto exit_normal;
+    }
+
+    for (pos = 0; pos < image_size; pos += chunk) {
+
+        chunk = (size_t) MIN(image_size - pos, (off_t) COPY_CHUNK);
+        ret_val = iso_read(iso, buf, chunk, pos);
+        if (ret_val != TNI_OK) {
+            goto exit_buffer;
+        }
+
+        ret_val = handle_pwrite(out_fd, buf, chunk, pos);
+        if (ret_val != TNI_OK) {
+            goto exit_buffer;
+        }
+    }
+
+    ret_val = TNI_OK;
+    exit_buffer:
+        free(buf);
+    exit_normal:
+        return ret_val;
+}
+
+static
+void remaster_time(uint8_t *out) {
+
+    struct tm t_info;
+    time_t now;
+
+    now = time(NULL);
+    gmtime_r(&now, &t_info);
+
+    out[0] = t_info.tm_year;
+    out[1] = t_info.tm_mon + 1;
+    out[2] = t_info.tm_mday;
+    out[3] = t_info.tm_hour;
+    out[4] = t_info.tm_min;
+    out[5] = t_info.tm_sec;
+    out[6] = 0;
+}
+
+static
+uint32_t remaster_decode(char *name, size_t name_len, size_t *pos) {
+
+    uint8_t *cur;
+    size_t len, idx;
+    uint32_t code;
+
+    cur = (uint8_t *) name + *pos;
+    if (cur[0] < 0x80) {
+        *pos += 1;
+        return cur[0];
+    }
+
+    len = (cur[0] >= 0xF0)? 4 : (cur[0] >= 0xE0)? 3 : (cur[0] >= 0xC0)? 2 : 0;
+    if (len == 0 || cur[0] >= 0xF8 || *pos + len > name_len) {
+        *pos += 1;
+        return REMASTER_BAD_CHAR;
+    }
+
+    code = cur[0] & (0x3F >> (len - 1));
+    for (idx = 1; idx < len; idx++) {
+        if ((cur[idx] & 0xC0) != 0x80) {
+            *pos += 1;
+            return REMASTER_BAD_CHAR;
+        }
+        code = (code << 6) | (cur[idx] & 0x3F);
+    }
+
+    *pos += len;
+    return code;
+}
+
+static
+uint16_t remaster_map(uint32_t code, size_t unit) {
+
+    if (unit == 1) {
+        if (code >= 'a' && code <= 'z') {
+            return code - ('a' - 'A');
+        }
+        if ((code >= 'A' && code <= 'Z') || (code >= '0' && code <= '9') ||
+                code == '_' || code == '.') {
+            return code;
+        }
+        return '_';
+    }
+
+    if (code < 0x20 || code > 0xFFFF || (code < 0x80 && strchr("*/:;?\\", code) != NULL)) {
+        return '_';
+    }
+    return code;
+}
+
+static
+void remaster_put(char *id, size_t *id_len, uint16_t code, size_t unit) {
+
+    if (unit == 2) {
+        id[(*id_len)++] = code >> 8;
+    }
+    id[(*id_len)++] = code & 0xFF;
+}
+
+/*
+ * Primary names are cut down to d-characters with at most one '.' before the
+ * extension; Joliet names keep everything but the characters it forbids. Both
+ * are truncated to the level's limit, keeping part of the extension, and a
+ * nonzero serial is appended to the base to tell colliding names apart.
+ */
+static
+tni_response_t remaster_encode(char *id, size_t *id_len, tni_parse_t parse_type,
+                                char *name, bool is_dir, unsigned serial) {
+
+    tni_response_t ret_val;
+    uint16_t *chars;
+    size_t name_len, char_num, unit, limit, dot, base_len, ext_len, suffix_len, idx;
+    char suffix[16];
+    bool has_dot;
+
+    name_len = strlen(name);
+    unit = parse_unit(parse_type);
+
+    if (name_len == 0) {
+        ret_val = TNI_ERR_ARGS;
+        goto exit_normal;
+    }
+
+    ret_val = handle_alloc((void **) &chars, name_len, sizeof(uint16_t), false);
+    if (ret_val != TNI_OK) {
+        goto exit_normal;
+    }
+
+    char_num = 0;
+    for (idx = 0; idx < name_len; ) {
+        chars[char_num++] = remaster_map(remaster_decode(name, name_len, &idx), unit);
+    }
+
+    dot = char_num;
+    has_dot = false;
+    for (idx = char_num; idx > 0 && !is_dir; idx--) {
+        if (chars[idx - 1] == '.') {
+            dot = idx - 1;
+            has_dot = true;
+            break;
+        }
+    }
+
+    if (unit == 1) {
+        for (idx = 0; idx < char_num; idx++) {
+            if (chars[idx] == '.' && idx != dot) {
+                chars[idx] = '_';
+            }
+        }
+    }
+
+    base_len = dot;
+    ext_len = (has_dot)? char_num - dot - 1 : 0;
+    if (unit == 1 && ext_len == 0) {
+        has_dot = false;
+    }
+
+    suffix_len = 0;
+    if (serial > 0) {
+        suffix_len = snprintf(suffix, sizeof(suffix), "_%u", serial);
+    } else if (base_len == 0 && ext_len == 0) {
+        suffix_len = snprintf(suffix, sizeof(suffix), "_");
+    }
+
+    limit = (unit == 2)? JOLIET_NAME_MAX : (is_dir)? ISO_DIR_MAX : ISO_NAME_MAX;
+    if (base_len + suffix_len + has_dot + ext_len > limit) {
+        ext_len = MIN(ext_len, limit / 4);
+        base_len = MIN(base_len, limit - suffix_len - has_dot - ext_len);
+    }
+
+    *id_len = 0;
+    for (idx = 0; idx < base_len; idx++) {
+        remaster_put(id, id_len, chars[idx], unit);
+    }
+    for (idx = 0; idx < suffix_len; idx++) {
+        remaster_put(id, id_len, suffix[idx], unit);
+    }
+    if (has_dot) {
+        remaster_put(id, id_len, '.', unit);
+    }
+    for (idx = 0; idx < ext_len; idx++) {
+        remaster_put(id, id_len, chars[dot + 1 + idx], unit);
+    }
+    if (!is_dir) {
+        remaster_put(id, id_len, ';', unit);
+        remaster_put(id, id_len, '1', unit);
+    }
+
+    free(chars);
+    ret_val = TNI_OK;
+    exit_normal:
+        return ret_val;
+}
+
+static
+tni_response_t remaster_record(uint8_t **raw, size_t *raw_len, remaster_state_t *state,
+                                char *id, size_t id_len, uint8_t flags,
+                                uint32_t lba, off_t size) {
+
+    tni_response_t ret_val;
+    uint8_t *cur_rec;
+    size_t rec_len, rec_num, idx;
+    off_t remaining;
+
+    rec_len = sizeof(iso_dir_record_t) + id_len;
+    rec_len += rec_len & 1;
+
+    rec_num = (size == 0)? 1 : (size_t) ((size + EXTENT_MAX - 1) / EXTENT_MAX);
+
+    ret_val = handle_alloc((void **) raw, rec_num, rec_len, true);
+    if (ret_val != TNI_OK) {
+        goto exit_normal;
+    }
+    *raw_len = rec_num * rec_len;
+
+    remaining = size;
+    for (idx = 0; idx < rec_num; idx++) {
+
+        cur_rec = *raw + (idx * rec_len);
+        cur_rec[0] = rec_len;
+        put_both32(cur_rec + 2, lba + (uint32_t) (idx * (EXTENT_MAX / state->iso->block_size)));
+        put_both32(cur_rec + 10, (uint32_t) MIN(remaining, (off_t) EXTENT_MAX));
+        memcpy(cur_rec + 18, state->rec_time, 7);
+        cur_rec[25] = flags | ((idx + 1 < rec_num)? EXTENT_FLAG : 0);
+        put_both16(cur_rec + 28, 1);
+        cur_rec[32] = id_len;
+        memcpy(cur_rec + sizeof(iso_dir_record_t), id, id_len);
+
+        remaining -= MIN(remaining, (off_t) EXTENT_MAX);
+    }
+
+    ret_val = TNI_OK;
+    exit_normal:
+        return ret_val;
+}
+
+static
+void remaster_entry_id(remaster_entry_t *entry, tni_parse_t parse_type) {
+
+    char *id;
+
+    /* Sorting compares identifiers without their version suffix. */
+    if (raw_record_id(&id, &(entry->id_len), (iso_dir_record_t *) entry->raw,
+                        parse_type) != TNI_OK) {
+        entry->id_len = ((iso_dir_record_t *) entry->raw)->len_fi[0];
+    }
+}
+
+static
+void remaster_free_entries(remaster_entry_t *entries, size_t entry_num) {
+
+    size_t idx;
+
+    for (idx = 0; idx < entry_num; idx++) {
+        free(entries[idx].raw);
+        if (entries[idx].has_record) {
+            free_record(&(entries[idx].record));
+        }
+    }
+    free(entries);
+}
+
+static
+tni_response_t remaster_add_entry(remaster_entry_t **entries, size_t *entry_num,
+                                    size_t *entry_cap, remaster_entry_t *entry) {
+
+    tni_response_t ret_val;
+
+    if (*entry_num == *entry_cap) {
+        ret_val = handle_realloc((void **) entries, MAX(*entry_cap * 2, 16),
+                                    sizeof(remaster_entry_t));
+        if (ret_val != TNI_OK) {
+            return ret_val;
+        }
+        *entry_cap = MAX(*entry_cap * 2, 16);
+    }
+
+    (*entries)[(*entry_num)++] = *entry;
+    return TNI_OK;
+}
+
+static
+tni_response_t remaster_read_dir(remaster_entry_t **entries, size_t *entry_num,
+                                    size_t *entry_cap, uint8_t **dots, tni_iso_t *iso,
+                                    tni_record_t *dir) {
+
+    tni_response_t ret_val;
+    remaster_entry_t entry;
+    iso_dir_record_t *raw_rec;
+    tni_extent_t *cur_extent;
+
+    uint8_t *data, dot;
+    off_t sector, rel_pos, sector_end;
+    bool in_entry, multi_extent;
+
+    in_entry = false;
+    for (cur_extent = dir->extent_list; cur_extent != NULL; cur_extent = cur_extent->link) {
+
+        ret_val = handle_alloc((void **) &data, MAX(cur_extent->length, 1), 1, false);
+        if (ret_val != TNI_OK) {
+            goto exit_entry;
+        }
+
+        ret_val = iso_read(iso, data, cur_extent->length,
+                            (off_t) cur_extent->lba * iso->block_size);
+        if (ret_val != TNI_OK) {
+            goto exit_data;
+        }
+
+        for (sector = 0; sector * iso->block_size < cur_extent->length; sector++) {
+
+            sector_end = MIN((off_t) iso->block_size,
+                            (off_t) cur_extent->length - (sector * iso->block_size));
+
+            rel_pos = 0;
+            while (rel_pos + (off_t) sizeof(iso_dir_record_t) <= sector_end) {
+
+                raw_rec = (iso_dir_record_t *) (data + (sector * iso->block_size) + rel_pos);
+                if (raw_rec->len_dr[0] == 0) {
+                    break;
+                }
+
+                if (rel_pos + raw_rec->len_dr[0] > sector_end) {
+                    ret_val = TNI_ERR_ISO;
+                    goto exit_data;
+                }
+                rel_pos += raw_rec->len_dr[0];
+
+                if (!in_entry && is_dot_record(raw_rec)) {
+                    dot = ((uint8_t *) raw_rec)[sizeof(iso_dir_record_t)];
+                    if (dots[dot] == NULL) {
+                        ret_val = handle_alloc((void **) &(dots[dot]), raw_rec->len_dr[0],
+                                                1, false);
+                        if (ret_val != TNI_OK) {
+                            goto exit_data;
+                        }
+                        memcpy(dots[dot], raw_rec, raw_rec->len_dr[0]);
+                    }
+                    continue;
+                }
+
+                if (!in_entry) {
+                    memset(&entry, 0, sizeof(remaster_entry_t));
+                    ret_val = record_begin(&multi_extent, &(entry.record), iso, raw_rec);
+                    if (ret_val != TNI_OK) {
+                        goto exit_data;
+                    }
+                    entry.has_record = true;
+                    in_entry = true;
+                } else {
+                    ret_val = record_append(&multi_extent, &(entry.record), iso, raw_rec);
+                    if (ret_val != TNI_OK) {
+                        goto exit_data;
+                    }
+                }
+
+                ret_val = handle_realloc((void **) &(entry.raw),
+                                        entry.raw_len + raw_rec->len_dr[0], 1);
+                if (ret_val != TNI_OK) {
+                    goto exit_data;
+                }
+                memcpy(entry.raw + entry.raw_len, raw_rec, raw_rec->len_dr[0]);
+                entry.raw_len += raw_rec->len_dr[0];
+
+                if (!multi_extent) {
+                    entry.is_dir = entry.record.is_dir;
+                    entry.unit = parse_unit(iso->parse_type);
+                    remaster_entry_id(&entry, iso->parse_type);
+
+                    ret_val = remaster_add_entry(entries, entry_num, entry_cap, &entry);
+                    if (ret_val != TNI_OK) {
+                        goto exit_data;
+                    }
+                    in_entry = false;
+                }
+            }
+        }
+        free(data);
+    }
+
+    ret_val = (in_entry)? TNI_ERR_ISO : TNI_OK;
+    goto exit_entry;
+
+    exit_data:
+        free(data);
+    exit_entry:
+        if (in_entry) {
+            free_record(&(entry.record));
+            free(entry.raw);
+        }
+        return ret_val;
+}
+
+static
+int compare_remaster_entry(const void *a, const void *b) {
+
+    remaster_entry_t *entry_a, *entry_b;
+
+    entry_a = (remaster_entry_t *) a;
+    entry_b = (remaster_entry_t *) b;
+
+    return compare_id((char *) entry_a->raw + sizeof(iso_dir_record_t), entry_a->id_len,
+                        (char *) entry_b->raw + sizeof(iso_dir_record_t), entry_b->id_len,
+                        entry_a->unit);
+}
+
+static
+bool remaster_same_id(remaster_entry_t *entry, char *id, size_t id_len) {
+
+    char *entry_id;
+
+    if (entry->raw == NULL || entry->id_len != id_len) {
+        return false;
+    }
+
+    entry_id = (char *) entry->raw + sizeof(iso_dir_record_t);
+    if (entry->unit == 1) {
+        return strncasecmp(entry_id, id, id_len) == 0;
+    }
+    return memcmp(entry_id, id, id_len) == 0;
+}
+
+static
+tni_response_t remaster_match(long *match, remaster_entry_t *entries, size_t entry_num,
+                                tni_parse_t parse_type, char *name, bool follow) {
+
+    tni_response_t ret_val;
+    char id[256];
+    size_t id_len, idx;
+    unsigned serial;
+    bool seen;
+    int pass;
+
+    /*
+     * A path names whichever existing record it encodes to, as a file or a
+     * directory. With follow set, the serials remaster_fresh hands out to
+     * colliding names are tried in turn while they are in use.
+     */
+    for (pass = 0; pass < 2; pass++) {
+        for (serial = 0; serial <= REMASTER_SERIAL_MAX; serial++) {
+
+            ret_val = remaster_encode(id, &id_len, parse_type, name, pass == 1, serial);
+            if (ret_val != TNI_OK) {
+                return ret_val;
+            }
+            if (pass == 0) {
+                id_len -= 2 * parse_unit(parse_type);
+            }
+
+            seen = false;
+            for (idx = 0; idx < entry_num; idx++) {
+                if (!remaster_same_id(&entries[idx], id, id_len)) {
+                    continue;
+                }
+                if (entries[idx].has_record && entries[idx].node == NULL) {
+                    *match = (long) idx;
+                    return TNI_OK;
+                }
+                seen = true;
+            }
+
+            if (!follow || !seen) {
+                break;
+            }
+        }
+    }
+
+    *match = -1;
+    return TNI_OK;
+}
+
+static
+tni_response_t remaster_fresh(remaster_entry_t *entries, size_t entry_num, long self,
+                                remaster_state_t *state, char *name, bool is_dir,
+                                uint32_t lba, off_t size) {
+
+    tni_response_t ret_val;
+    remaster_entry_t *entry;
+    char id[256];
+    size_t id_len, ver_len, idx;
+    unsigned serial;
+    bool taken;
+
+    entry = &entries[self];
+    ver_len = (is_dir)? 0 : 2 * parse_unit(state->iso->parse_type);
+
+    taken = true;
+    for (serial = 0; taken && serial <= REMASTER_SERIAL_MAX; serial++) {
+
+        ret_val = remaster_encode(id, &id_len, state->iso->parse_type, name, is_dir, serial);
+        if (ret_val != TNI_OK) {
+            return ret_val;
+        }
+
+        taken = false;
+        for (idx = 0; idx < entry_num && !taken; idx++) {
+            taken = (long) idx != self && remaster_same_id(&entries[idx], id, id_len - ver_len);
+        }
+    }
+    if (taken) {
+        return TNI_ERR_ARGS;
+    }
+
+    free(entry->raw);
+    entry->raw = NULL;
+    if (entry->has_record) {
+        free_record(&(entry->record));
+        entry->has_record = false;
+    }
+
+    entry->is_dir = is_dir;
+    entry->unit = parse_unit(state->iso->parse_type);
+
+    ret_val = remaster_record(&(entry->raw), &(entry->raw_len), state, id, id_len,
+                                (is_dir)? 0x2 : 0, lba, size);
+    if (ret_val != TNI_OK) {
+        return ret_val;
+    }
+
+    remaster_entry_id(entry, state->iso->parse_type);
+    return TNI_OK;
+}
+
+static
+tni_response_t remaster_dot(uint8_t **raw, size_t *raw_len, remaster_state_t *state,
+                            uint8_t *orig, char id) {
+
+    tni_response_t ret_val;
+
+    ret_val = remaster_record(raw, raw_len, state, &id, 1, 0x2, 0, 0);
+    if (ret_val != TNI_OK || orig == NULL || orig[0] <= *raw_len) {
+        return ret_val;
+    }
+
+    /* Carry over the system use area: the root's holds the SUSP "SP" entry. */
+    ret_val = handle_realloc((void **) raw, orig[0], 1);
+    if (ret_val != TNI_OK) {
+        free(*raw);
+        *raw = NULL;
+        return ret_val;
+    }
+
+    memcpy(*raw + *raw_len, orig + *raw_len, orig[0] - *raw_len);
+    *raw_len = orig[0];
+    (*raw)[0] = orig[0];
+    return TNI_OK;
+}
+
+static
+tni_response_t remaster_dir(uint32_t *dir_lba, uint32_t *dir_len, remaster_state_t *state,
+                            tni_record_t *dir, remaster_node_t *node,
+                            uint32_t parent_lba, uint32_t parent_len) {
+
+    tni_response_t ret_val;
+    remaster_entry_t *entries, new_entry;
+    remaster_node_t *child;
+    tni_change_t *change;
+
+    size_t entry_num, entry_cap, idx, rec_pos, used;
+    uint32_t sector_num, child_lba, child_len;
+    uint16_t block_size;
+    uint8_t *data, *orig_dots[2], *dots[2];
+    size_t dot_len[2];
+    bool inserted;
+    long match;
+    int side;
+
+    entries = NULL;
+    entry_num = 0;
+    entry_cap = 0;
+    block_size = state->iso->block_size;
+    memset(orig_dots, 0, sizeof(orig_dots));
+    memset(dots, 0, sizeof(dots));
+
+    if (dir != NULL) {
+        ret_val = set_insert_lba(&inserted, &(state->dirs), dir->extent_list->lba);
+        if (ret_val != TNI_OK || !inserted) {
+            ret_val = (ret_val != TNI_OK)? ret_val : TNI_ERR_ISO;
+            goto exit_entries;
+        }
+
+        ret_val = remaster_read_dir(&entries, &entry_num, &entry_cap, orig_dots,
+                                    state->iso, dir);
+        if (ret_val != TNI_OK) {
+            goto exit_entries;
+        }
+    }
+
+    for (child = (node != NULL)? node->child : NULL; child != NULL; child = child->next) {
+
+        ret_val = remaster_match(&match, entries, entry_num, state->iso->parse_type,
+                                    child->name, child->change >= 0 &&
+                                    state->changes[child->change].kind == TNI_CHANGE_DELETE);
+        if (ret_val != TNI_OK) {
+            goto exit_entries;
+        }
+
+        if (child->change >= 0 && child->child != NULL) {
+            ret_val = TNI_ERR_ARGS;
+            goto exit_entries;
+        }
+
+        if (child->change >= 0) {
+            change = &(state->changes[child->change]);
+
+            if (change->kind == TNI_CHANGE_DELETE) {
+                if (match < 0) {
+                    if (state->primary) {
+                        ret_val = TNI_FAIL;
+                        goto exit_entries;
+                    }
+                    continue;
+                }
+
+                free(entries[match].raw);
+                if (entries[match].has_record) {
+                    free_record(&(entries[match].record));
+                }
+                entries[match] = entries[--entry_num];
+                continue;
+            }
+
+            if (match >= 0 && entries[match].is_dir) {
+                ret_val = TNI_ERR_DIR;
+                goto exit_entries;
+            }
+
+            if (match < 0) {
+                memset(&new_entry, 0, sizeof(remaster_entry_t));
+                ret_val = remaster_add_entry(&entries, &entry_num, &entry_cap, &new_entry);
+                if (ret_val != TNI_OK) {
+                    goto exit_entries;
+                }
+                match = (long) entry_num - 1;
+            }
+
+            ret_val = remaster_fresh(entries, entry_num, match, state, child->name, false,
+                                        state->puts[child->change].lba,
+                                        state->puts[child->change].size);
+            if (ret_val != TNI_OK) {
+                goto exit_entries;
+            }
+            continue;
+        }
+
+        if (match < 0) {
+            memset(&new_entry, 0, sizeof(remaster_entry_t));
+            ret_val = remaster_add_entry(&entries, &entry_num, &entry_cap, &new_entry);
+            if (ret_val != TNI_OK) {
+                goto exit_entries;
+            }
+            match = (long) entry_num - 1;
+
+            ret_val = remaster_fresh(entries, entry_num, match, state, child->name, true,
+                                        0, 0);
+            if (ret_val != TNI_OK) {
+                goto exit_entries;
+            }
+
+        } else if (!(entries[match].is_dir)) {
+            ret_val = TNI_ERR_DIR;
+            goto exit_entries;
+        }
+
+        entries[match].node = child;
+    }
+
+    qsort(entries, entry_num, sizeof(remaster_entry_t), compare_remaster_entry);
+
+    for (side = 0; side < 2; side++) {
+        ret_val = remaster_dot(&dots[side], &dot_len[side], state, orig_dots[side], side);
+        if (ret_val != TNI_OK) {
+            goto exit_entries;
+        }
+    }
+
+    sector_num = 1;
+    used = dot_len[0] + dot_len[1];
+    for (idx = 0; idx < entry_num; idx++) {
+        for (rec_pos = 0; rec_pos < entries[idx].raw_len;
+                rec_pos += entries[idx].raw[rec_pos]) {
+            if (used + entries[idx].raw[rec_pos] > block_size) {
+                sector_num += 1;
+                used = 0;
+            }
+            used += entries[idx].raw[rec_pos];
+        }
+    }
+
+    *dir_lba = state->next_lba;
+    *dir_len = sector_num * block_size;
+    state->next_lba += sector_num;
+
+    if (parent_len == 0) {
+        parent_lba = *dir_lba;
+        parent_len = *dir_len;
+    }
+
+    /*
+     * Every subdirectory is rewritten after its parent, not only those with
+     * changes below them, so that no child extent ends up before its parent.
+     */
+    for (idx = 0; idx < entry_num; idx++) {
+
+        if (!(entries[idx].is_dir)) {
+            continue;
+        }
+
+        ret_val = remaster_dir(&child_lba, &child_len, state,
+                                (entries[idx].has_record)? &(entries[idx].record) : NULL,
+                                entries[idx].node, *dir_lba, *dir_len);
+        if (ret_val != TNI_OK) {
+            goto exit_entries;
+        }
+
+        entries[idx].raw_len = entries[idx].raw[0];
+        entries[idx].raw[25] &= ~EXTENT_FLAG;
+        put_both32(entries[idx].raw + 2, child_lba);
+        put_both32(entries[idx].raw + 10, child_len);
+    }
+
+    ret_val = handle_alloc((void **) &data, sector_num, block_size, true);
+    if (ret_val != TNI_OK) {
+        goto exit_entries;
+    }
+
+    put_both32(dots[0] + 2, *dir_lba);
+    put_both32(dots[0] + 10, *dir_len);
+    put_both32(dots[1] + 2, parent_lba);
+    put_both32(dots[1] + 10, parent_len);
+    memcpy(data, dots[0], dot_len[0]);
+    memcpy(data + dot_len[0], dots[1], dot_len[1]);
+
+    sector_num = 0;
+    used = dot_len[0] + dot_len[1];
+    for (idx = 0; idx < entry_num; idx++) {
+        for (rec_pos = 0; rec_pos < entries[idx].raw_len;
+                rec_pos += entries[idx].raw[rec_pos]) {
+            if (used + entries[idx].raw[rec_pos] > block_size) {
+                sector_num += 1;
+                used = 0;
+            }
+            memcpy(data + ((size_t) sector_num * block_size) + used,
+                    entries[idx].raw + rec_pos, entries[idx].raw[rec_pos]);
+            used += entries[idx].raw[rec_pos];
+        }
+    }
+
+    ret_val = handle_pwrite(state->out_fd, data, *dir_len, (off_t) *dir_lba * block_size);
+    free(data);
+
+    exit_entries:
+        for (side = 0; side < 2; side++) {
+            free(orig_dots[side]);
+            free(dots[side]);
+        }
+        remaster_free_entries(entries, entry_num);
+        return ret_val;
+}
+
+static
+tni_response_t remaster_trie_add(remaster_node_t *root, char *path, long change) {
+
+    tni_response_t ret_val;
+    remaster_node_t *cur_node, *child;
+    size_t comp_len;
+
+    cur_node = root;
+    while (*path != '\0') {
+
+        if (*path == '/') {
+            path += 1;
+            continue;
+        }
+
+        comp_len = strcspn(path, "/");
+        for (child = cur_node->child; child != NULL; child = child->next) {
+            if (strncmp(child->name, path, comp_len) == 0 && child->name[comp_len] == '\0') {
+                break;
+            }
+        }
+
+        if (child == NULL) {
+            ret_val = handle_alloc((void **) &child, 1, sizeof(remaster_node_t), true);
+            if (ret_val != TNI_OK) {
+                goto exit_normal;
+            }
+
+            ret_val = handle_alloc((void **) &(child->name), comp_len + 1, 1, false);
+            if (ret_val != TNI_OK) {
+                free(child);
+                goto exit_normal;
+            }
+            memcpy(child->name, path, comp_len);
+            child->name[comp_len] = '\0';
+
+            child->change = -1;
+            child->next = cur_node->child;
+            cur_node->child = child;
+        }
+
+        cur_node = child;
+        path += comp_len;
+    }
+
+    if (cur_node == root || cur_node->change >= 0) {
+        ret_val = TNI_ERR_ARGS;
+        goto exit_normal;
+    }
+    cur_node->change = change;
+
+    ret_val = TNI_OK;
+    exit_normal:
+        return ret_val;
+}
+
+static
+void remaster_trie_free(remaster_node_t *node) {
+
+    remaster_node_t *next;
+
+    while (node != NULL) {
+        remaster_trie_free(node->child);
+        next = node->next;
+        free(node->name);
+        free(node);
+        node = next;
+    }
+}
+
+static
+tni_response_t path_table_add(uint8_t **table, size_t *table_len, size_t *table_cap,
+                                char *id, size_t id_len, uint32_t lba, uint16_t parent,
+                                bool big_endian) {
+
+    tni_response_t ret_val;
+    uint8_t *entry;
+    size_t entry_len;
+
+    entry_len = 8 + id_len + (id_len & 1);
+    if (*table_len + entry_len > *table_cap) {
+        ret_val = handle_realloc((void **) table, MAX(*table_cap * 2, 4096), 1);
+        if (ret_val != TNI_OK) {
+            return ret_val;
+        }
+        *table_cap = MAX(*table_cap * 2, 4096);
+    }
+
+    entry = *table + *table_len;
+    memset(entry, 0, entry_len);
+    entry[0] = id_len;
+
+    if (big_endian) {
+        entry[2] = lba >> 24;
+        entry[3] = lba >> 16;
+        entry[4] = lba >> 8;
+        entry[5] = lba;
+        entry[6] = parent >> 8;
+        entry[7] = parent;
+    } else {
+        entry[2] = lba;
+        entry[3] = lba >> 8;
+        entry[4] = lba >> 16;
+        entry[5] = lba >> 24;
+        entry[6] = parent;
+        entry[7] = parent >> 8;
+    }
+
+    memcpy(entry + 8, id, id_len);
+    *table_len += entry_len;
+    return TNI_OK;
+}
+
+static
+tni_response_t remaster_path_table(remaster_state_t *state, iso_vol_desc_t *desc,
+                                    tni_parse_t parse_type) {
+
+    tni_response_t ret_val;
+    tni_iso_t out_iso;
+    file_backend_t out_file;
+    tni_dir_scan_t scan;
+    tni_record_t cur_rec;
+
+    record_list_t dirs;
+    uint8_t *tables[2];
+    size_t table_len[2], table_cap[2];
+    size_t dir_idx;
+    uint32_t table_lba[2], sectors;
+    char id[256];
+    size_t id_len;
+    dir_window_t window;
+    int side;
+
+    ret_val = tni_init_iso(&out_iso, desc, parse_type, false);
+    if (ret_val != TNI_OK) {
+        goto exit_normal;
+    }
+
+    out_file.fd = state->out_fd;
+    out_iso.backend.ops = &file_ops;
+    out_iso.backend.ctx = &out_file;
+
+    memset(&dirs, 0, sizeof(record_list_t));
+    memset(tables, 0, sizeof(tables));
+    memset(table_len, 0, sizeof(table_len));
+    memset(table_cap, 0, sizeof(table_cap));
+
+    window_init(&window, false);
+
+    ret_val = handle_alloc((void **) &(dirs.list), 16, sizeof(tni_record_t), false);
+    if (ret_val != TNI_OK) {
+        goto exit_tables;
+    }
+    dirs.capacity = 16;
+
+    ret_val = copy_record(&(dirs.list[0]), out_iso.root_dir);
+    if (ret_val != TNI_OK) {
+        goto exit_tables;
+    }
+    dirs.length = 1;
+
+    for (side = 0; side < 2; side++) {
+        ret_val = path_table_add(&tables[side], &table_len[side], &table_cap[side],
+                                    "\0", 1, out_iso.root_dir->extent_list->lba, 1, side);
+        if (ret_val != TNI_OK) {
+            goto exit_tables;
+        }
+    }
+
+    for (dir_idx = 0; dir_idx < dirs.length; dir_idx++) {
+
+        if (dir_idx + 1 > 0xFFFF) {
+            ret_val = TNI_ERR_ISO;
+            goto exit_tables;
+        }
+
+        ret_val = tni_scan_init(&scan, &out_iso, &(dirs.list[dir_idx]));
+        if (ret_val != TNI_OK) {
+            goto exit_tables;
+        }
+
+        while (true) {
+
+            ret_val = scan_next(&scan, &cur_rec, &window);
+            if (ret_val == TNI_FAIL) {
+                break;
+            }
+            if (ret_val != TNI_OK) {
+                goto exit_tables;
+            }
+
+            if (cur_rec.type != REC_NORMAL || !(cur_rec.is_dir)) {
+                free_record(&cur_rec);
+                continue;
+            }
+
+            id_len = sizeof(id);
+            ret_val = handle_iconv("UTF-8", parse_encoding(parse_type), cur_rec.record_id,
+                                    strlen(cur_rec.record_id), id, &id_len);
+            id_len = sizeof(id) - id_len;
+            for (side = 0; side < 2 && ret_val == TNI_OK; side++) {
+                ret_val = path_table_add(&tables[side], &table_len[side], &table_cap[side],
+                                            id, id_len, cur_rec.extent_list->lba,
+                                            dir_idx + 1, side);
+            }
+            if (ret_val == TNI_OK) {
+                ret_val = (collect_record(&cur_rec, &dirs) == TNI_SIGNAL_OK)?
+                                TNI_OK : TNI_ERR_MEM;
+            }
+            free_record(&cur_rec);
+            if (ret_val != TNI_OK) {
+                goto exit_tables;
+            }
+        }
+    }
+
+    sectors = (table_len[0] + out_iso.block_size - 1) / out_iso.block_size;
+    for (side = 0; side < 2; side++) {
+        table_lba[side] = state->next_lba;
+        state->next_lba += sectors;
+
+        ret_val = handle_pwrite(state->out_fd, tables[side], table_len[side],
+                                (off_t) table_lba[side] * out_iso.block_size);
+        if (ret_val != TNI_OK) {
+            goto exit_tables;
+        }
+    }
+
+    put_both32(desc->path_table_size, table_len[0]);
+    memset(desc->l_path_table_pos, 0, 16);
+    desc->l_path_table_pos[0] = table_lba[0];
+    desc->l_path_table_pos[1] = table_lba[0] >> 8;
+    desc->l_path_table_pos[2] = table_lba[0] >> 16;
+    desc->l_path_table_pos[3] = table_lba[0] >> 24;
+    desc->m_path_table_pos[0] = table_lba[1] >> 24;
+    desc->m_path_table_pos[1] = table_lba[1] >> 16;
+    desc->m_path_table_pos[2] = table_lba[1] >> 8;
+    desc->m_path_table_pos[3] = table_lba[1];
+
+    ret_val = TNI_OK;
+
+    exit_tables:
+        free(tables[0]);
+        free(tables[1]);
+        free_record_list(&dirs);
+        window_free(&window);
+        free_record(out_iso.root_dir);
+        free(out_iso.root_dir);
+    exit_normal:
+        return ret_val;
+}
+
+
+/**** Content Search ****/
+
+static
+tni_response_t search_matcher_init(search_matcher_t *matcher, tni_patterns_t *patterns) {
+
+    tni_response_t ret_val;
+    size_t idx, filter, count[256];
+    uint8_t *pattern;
+    bool all_pairs;
+
+    matcher->patterns = (uint8_t **) patterns->list;
+    matcher->num = patterns->num;
+    matcher->max_len = 0;
+
+    ret_val = handle_alloc((void **) &(matcher->lengths), patterns->num, sizeof(size_t), false);
+    if (ret_val != TNI_OK) {
+        goto exit_normal;
+    }
+
+    ret_val = handle_alloc((void **) &(matcher->order), patterns->num, sizeof(size_t), false);
+    if (ret_val != TNI_OK) {
+        goto exit_lengths;
+    }
+
+    memset(count, 0, sizeof(count));
+    memset(matcher->first, 0, sizeof(matcher->first));
+    all_pairs = true;
+
+    for (idx = 0; idx < patterns->num; idx++) {
+
+        if (patterns->list[idx] == NULL) {
+            ret_val = TNI_ERR_ARGS;
+            goto exit_order;
+        }
+
+        matcher->lengths[idx] = (patterns->lengths != NULL)?
+                                patterns->lengths[idx] : strlen(patterns->list[idx]);
+        if (matcher->lengths[idx] == 0) {
+            ret_val = TNI_ERR_ARGS;
+            goto exit_order;
+        }
+
+        matcher->max_len = MAX(matcher->max_len, matcher->lengths[idx]);
+        all_pairs = all_pairs && matcher->lengths[idx] > 1;
+
+        count[matcher->patterns[idx][0]] += 1;
+        matcher->first[matcher->patterns[idx][0]] = true;
+    }
+
+    matcher->bucket[0] = 0;
+    for (idx = 0; idx < 256; idx++) {
+        matcher->bucket[idx + 1] = matcher->bucket[idx] + count[idx];
+        count[idx] = matcher->bucket[idx];
+    }
+    for (idx = 0; idx < patterns->num; idx++) {
+        matcher->order[count[matcher->patterns[idx][0]]++] = idx;
+    }
+
+    /*
+     * The vector prefilter tests every position against a handful of
+     * leading byte pairs (or single bytes); larger sets fall back to
+     * the first-byte table.
+     */
+    matcher->filter_num = 0;
+    matcher->pair_filter = all_pairs;
+    matcher->use_filters = true;
+
+    for (idx = 0; idx < patterns->num && matcher->use_filters; idx++) {
+
+        pattern = matcher->patterns[idx];
+        for (filter = 0; filter < matcher->filter_num; filter++) {
+            if (matcher->filters[filter][0] == pattern[0]
+                && (!all_pairs || matcher->filters[filter][1] == pattern[1])) {
+                break;
+            }
+        }
+
+        if (filter < matcher->filter_num) {
+            continue;
+        }
+
+        if (matcher->filter_num == SEARCH_FILTERS) {
+            matcher->use_filters = false;
+            break;
+        }
+
+        matcher->filters[matcher->filter_num][0] = pattern[0];
+        matcher->filters[matcher->filter_num][1] = (all_pairs)? pattern[1] : 0;
+        matcher->filter_num += 1;
+    }
+
+    ret_val = TNI_OK;
+    goto exit_normal;
+
+    exit_order:
+        free(matcher->order);
+    exit_lengths:
+        free(matcher->lengths);
+    exit_normal:
+        return ret_val;
+}
+
+static
+void search_matcher_free(search_matcher_t *matcher) {
+    free(matcher->order);
+    free(matcher->lengths);
+}
+
+/*
+ * Checks every pattern starting with the byte at pos. A hit that ends
+ * inside the carried-over bytes was already reported with the previous
+ * chunk, and one running past the buffer is found with the next.
+ */
+static
+tni_signal_t search_verify(search_state_t *state, search_item_t *item, uint8_t *data,
+                            size_t len, size_t carry, off_t base, size_t pos) {
+
+    search_matcher_t *matcher;
+    tni_signal_t signal;
+    size_t idx, pattern, pattern_len;
+
+    matcher = &(state->matcher);
+    for (idx = matcher->bucket[data[pos]]; idx < matcher->bucket[data[pos] + 1]; idx++) {
+
+        pattern = matcher->order[idx];
+        pattern_len = matcher->lengths[pattern];
+
+        if (pos + pattern_len > len || pos + pattern_len <= carry
+            || memcmp(data + pos, matcher->patterns[pattern], pattern_len) != 0) {
+            continue;
+        }
+
+        pthread_mutex_lock(&(state->lock));
+        if (!(state->stop)) {
+            signal = state->cb->fn(item->path, pattern, base + (off_t) pos, state->cb->args);
+            if (signal == TNI_SIGNAL_STOP) {
+                state->stop = true;
+            } else if (signal == TNI_SIGNAL_ERR) {
+                state->ret_val = TNI_ERR_CB;
+                state->stop = true;
+            }
+        }
+        signal = (state->stop)? TNI_SIGNAL_STOP : TNI_SIGNAL_OK;
+        pthread_mutex_unlock(&(state->lock));
+
+        if (signal != TNI_SIGNAL_OK) {
+            return signal;
+        }
+    }
+
+    return TNI_SIGNAL_OK;
+}
+
+static
+tni_signal_t search_block(search_state_t *state, search_item_t *item, uint8_t *data,
+                            size_t len, size_t carry, off_t base) {
+
+    search_matcher_t *matcher;
+    size_t pos;
+#ifdef __SSE2__
+    __m128i block, next, hits, equal;
+    size_t filter;
+    unsigned mask;
+#endif
+
+    matcher = &(state->matcher);
+    pos = 0;
+
+#ifdef __SSE2__
+    if (matcher->use_filters) {
+        for (; pos + 17 <= len; pos += 16) {
+
+            block = _mm_loadu_si128((__m128i *) (data + pos));
+            next = _mm_loadu_si128((__m128i *) (data + pos + 1));
+            hits = _mm_setzero_si128();
+
+            for (filter = 0; filter < matcher->filter_num; filter++) {
+                equal = _mm_cmpeq_epi8(block, _mm_set1_epi8((char) matcher->filters[filter][0]));
+                if (matcher->pair_filter) {
+                    equal = _mm_and_si128(equal,
+                            _mm_cmpeq_epi8(next, _mm_set1_epi8((char) matcher->filters[filter][1])));
+                }
+                hits = _mm_or_si128(hits, equal);
+            }
+
+            mask = (unsigned) _mm_movemask_epi8(hits);
+            while (mask != 0) {
+                if (search_verify(state, item, data, len, carry, base,
+                                    pos + __builtin_ctz(mask)) != TNI_SIGNAL_OK) {
+                    return TNI_SIGNAL_STOP;
+                }
+                mask &= mask - 1;
+            }
+        }
+    }
+#endif
+
+    for (; pos < len; pos++) {
+        if (matcher->first[data[pos]]
+            && search_verify(state, item, data, len, carry, base, pos) != TNI_SIGNAL_OK) {
+            return TNI_SIGNAL_STOP;
+        }
+    }
+
+    return TNI_SIGNAL_OK;
+}
+
+static
+tni_response_t search_file(search_state_t *state, search_item_t *item, uint8_t *buffer) {
+
+    tni_response_t ret_val;
+    off_t rel_pos;
+    size_t carry, got, keep;
+
+    carry = 0;
+    for (rel_pos = 0; rel_pos < item->record.total_size; rel_pos += got) {
+
+        got = (size_t) MIN((off_t) state->chunk_size, item->record.total_size - rel_pos);
+        ret_val = tni_read_file(buffer + carry, state->iso, &(item->record), rel_pos, got);
+        if (ret_val != TNI_OK) {
+            return ret_val;
+        }
+
+        if (search_block(state, item, buffer, carry + got, carry,
+                            rel_pos - (off_t) carry) != TNI_SIGNAL_OK) {
+            return TNI_OK;
+        }
+
+        keep = MIN(state->matcher.max_len - 1, carry + got);
+        memmove(buffer, buffer + carry + got - keep, keep);
+        carry = keep;
+    }
+
+    return TNI_OK;
+}
+
+static
+void *search_worker(void *args) {
+
+    tni_response_t ret_val;
+    search_state_t *state;
+    search_item_t *item;
+    uint8_t *buffer;
+
+    state = (search_state_t *) args;
+    buffer = NULL;
+    ret_val = handle_alloc((void **) &buffer, state->chunk_size + state->matcher.max_len,
+                            1, false);
+
+    while (ret_val == TNI_OK) {
+
+        pthread_mutex_lock(&(state->lock));
+        item = NULL;
+        if (!(state->stop) && state->next_item < state->item_num) {
+            item = &(state->items[state->next_item++]);
+        }
+        pthread_mutex_unlock(&(state->lock));
+
+        if (item == NULL) {
+            break;
+        }
+
+        ret_val = search_file(state, item, buffer);
+    }
+
+    if (ret_val != TNI_OK) {
+        pthread_mutex_lock(&(state->lock));
+        if (state->ret_val == TNI_OK) {
+            state->ret_val = ret_val;
+        }
+        state->stop = true;
+        pthread_mutex_unlock(&(state->lock));
+    }
+
+    free(buffer);
+    return NULL;
+}
+
+static
+tni_signal_t search_collect(char *path, tni_record_t *rec, void *args) {
+
+    search_state_t *state;
+    search_item_t *item;
+
+    state = (search_state_t *) args;
+    if (rec->is_dir || rec->total_size == 0) {
+        return TNI_SIGNAL_OK;
+    }
+
+    if (state->item_num == state->item_cap) {
+        if (handle_realloc((void **) &(state->items), MAX(state->item_cap * 2, 64),
+                            sizeof(search_item_t)) != TNI_OK) {
+            return TNI_SIGNAL_ERR;
+        }
+        state->item_cap = MAX(state->item_cap * 2, 64);
+    }
+
+    item = &(state->items[state->item_num]);
+    if (handle_alloc((void **) &(item->path), strlen(path) + 1, 1, false) != TNI_OK) {
+        return TNI_SIGNAL_ERR;
+    }
+    strcpy(item->path, path);
+
+    if (copy_record(&(item->record), rec) != TNI_OK) {
+        free(item->path);
+        return TNI_SIGNAL_ERR;
+    }
+    item->lba = rec->extent_list->lba;
+
+    state->item_num += 1;
+    return TNI_SIGNAL_OK;
+}
+
+static
+int compare_search_item(const void *a, const void *b) {
+
+    uint32_t lba_a, lba_b;
+
+    lba_a = ((search_item_t *) a)->lba;
+    lba_b = ((search_item_t *) b)->lba;
+    return (lba_a > lba_b) - (lba_a < lba_b);
+}
+
+
+/**** File Streams ****/
+
+#define FILE_STREAM_MIN (64 * 1024)
+#define FILE_STREAM_MAX (4 * 1024 * 1024)
+
+/*
+ * Reads file data at a logical offset, resuming the extent walk from
+ * the extent used last instead of the head of the chain.
+ */
+static
+tni_response_t file_stream_fetch(tni_file_stream_t *stream, uint8_t *buf,
+                                    off_t pos, size_t size) {
+
+    tni_response_t ret_val;
+    size_t read_size;
+
+    if (stream->extent == NULL || pos < stream->extent_pos) {
+        stream->extent = stream->rec->extent_list;
+        stream->extent_pos = 0;
+    }
+
+    while (size != 0) {
+
+        while (stream->extent != NULL
+                && stream->extent_pos + (off_t) stream->extent->length <= pos) {
+            stream->extent_pos += stream->extent->length;
+            stream->extent = stream->extent->link;
+        }
+
+        if (stream->extent == NULL) {
+            ret_val = TNI_ERR_ISO;
+            goto exit_normal;
+        }
+
+        read_size = (size_t) MIN((off_t) size,
+                        stream->extent_pos + (off_t) stream->extent->length - pos);
+        ret_val = iso_read(stream->iso, buf, read_size,
+                            ((off_t) stream->extent->lba * stream->iso->block_size)
+                            + (pos - stream->extent_pos));
+        if (ret_val != TNI_OK) {
+            goto exit_normal;
+        }
+
+        buf += read_size;
+        pos += read_size;
+        size -= read_size;
+    }
+
+    ret_val = TNI_OK;
+    exit_normal:
+        return ret_val;
+}
+
+static
+void *file_stream_helper(void *raw_state) {
+
+    tni_file_stream_t *stream;
+    tni_response_t ret_val;
+    uint64_t generation;
+    off_t fill_pos;
+    size_t fill_size;
+    int idx;
+
+    stream = (tni_file_stream_t *) raw_state;
+    pthread_mutex_lock(&(stream->lock));
+
+    while (true) {
+
+        while (!(stream->stop) && (stream->full[stream->fill_idx]
+                || stream->status != TNI_OK
+                || stream->fill_pos >= stream->rec->total_size)) {
+            pthread_cond_wait(&(stream->cond), &(stream->lock));
+        }
+
+        if (stream->stop) {
+            break;
+        }
+
+        generation = stream->generation;
+        idx = stream->fill_idx;
+        fill_pos = stream->fill_pos;
+        fill_size = (size_t) MIN((off_t) stream->window, stream->rec->total_size - fill_pos);
+        pthread_mutex_unlock(&(stream->lock));
+
+        ret_val = TNI_OK;
+        if (fill_size > stream->capacity[idx]) {
+            ret_val = handle_realloc((void **) &(stream->buffer[idx]), fill_size, 1);
+            if (ret_val == TNI_OK) {
+                stream->capacity[idx] = fill_size;
+            }
+        }
+
+        if (ret_val == TNI_OK) {
+            ret_val = file_stream_fetch(stream, stream->buffer[idx], fill_pos, fill_size);
+        }
+
+        pthread_mutex_lock(&(stream->lock));
+        if (generation != stream->generation) {
+            continue;
+        }
+
+        if (ret_val == TNI_OK) {
+            stream->start[idx] = fill_pos;
+            stream->length[idx] = fill_size;
+            stream->full[idx] = true;
+            stream->fill_pos += fill_size;
+            stream->fill_idx ^= 1;
+        } else {
+            stream->status = ret_val;
+        }
+        pthread_cond_broadcast(&(stream->cond));
+    }
+
+    pthread_mutex_unlock(&(stream->lock));
+    return NULL;
+}
+
+/* Drops both buffers and restarts readahead at pos; the lock must be held. */
+static
+void file_stream_reset(tni_file_stream_t *stream, off_t pos) {
+
+    stream->generation += 1;
+    stream->full[0] = false;
+    stream->full[1] = false;
+    stream->cur = 0;
+    stream->fill_idx = 0;
+    stream->pos = pos;
+    stream->fill_pos = pos;
+    stream->window = FILE_STREAM_MIN;
+    stream->status = TNI_OK;
+
+    pthread_cond_broadcast(&(stream->cond));
+}
+
+static
+bool file_stream_holds(tni_file_stream_t *stream, int idx, off_t pos) {
+    return stream->full[idx] && pos >= stream->start[idx]
+        && pos < stream->start[idx] + (off_t) stream->length[idx];
+}
+
+
+/**** Disk Usage ****/
+
+static
+void du_free_node(du_node_t *node) {
+
+    size_t idx;
+
+    free_record(&(node->record));
+    for (idx = 0; idx < node->child_num; idx++) {
+        free(node->children[idx].name);
+    }
+    free(node->children);
+}
+
+/* Queues a directory for scanning, taking over rec; the lock must be held. */
+static
+tni_response_t du_add_node(du_state_t *state, tni_record_t *rec) {
+
+    tni_response_t ret_val;
+    du_node_t *node;
+
+    if (state->node_num == state->node_cap) {
+        ret_val = handle_realloc((void **) &(state->nodes), MAX(state->node_cap * 2, 64),
+                                    sizeof(du_node_t));
+        if (ret_val != TNI_OK) {
+            return ret_val;
+        }
+        state->node_cap = MAX(state->node_cap * 2, 64);
+    }
+
+    node = &(state->nodes[state->node_num++]);
+    memset(node, 0, sizeof(du_node_t));
+    node->record = *rec;
+    node->parent = NODE_NONE;
+
+    pthread_cond_broadcast(&(state->cond));
+    return TNI_OK;
+}
+
+static
+tni_response_t du_scan_dir(du_state_t *state, uint32_t node_idx, tni_record_t *dir) {
+
+    tni_response_t ret_val;
+    tni_dir_scan_t scan;
+    tni_record_t cur_rec;
+    dir_window_t window;
+
+    record_list_t subdirs;
+    du_child_t *children;
+    du_node_t *node;
+    uint64_t bytes, files, extents;
+    size_t idx;
+    bool inserted;
+
+    memset(&subdirs, 0, sizeof(record_list_t));
+    children = NULL;
+    bytes = 0;
+    files = 0;
+    extents = 0;
+
+    ret_val = tni_scan_init(&scan, state->iso, dir);
+    if (ret_val != TNI_OK) {
+        goto exit_normal;
+    }
+    window_init(&window, true);
+
+    while (true) {
+
+        ret_val = scan_next(&scan, &cur_rec, &window);
+        if (ret_val == TNI_FAIL) {
+            break;
+        }
+        if (ret_val != TNI_OK) {
+            goto exit_subdirs;
+        }
+
+        if (cur_rec.type != REC_NORMAL || !(cur_rec.is_dir)) {
+            if (cur_rec.type == REC_NORMAL) {
+                bytes += cur_rec.total_size;
+                files += 1;
+                extents += cur_rec.extent_num;
+            }
+            free_record(&cur_rec);
+            continue;
+        }
+
+        if (subdirs.length == subdirs.capacity) {
+            ret_val = handle_realloc((void **) &(subdirs.list), MAX(subdirs.capacity * 2, 16),
+                                        sizeof(tni_record_t));
+            if (ret_val != TNI_OK) {
+                free_record(&cur_rec);
+                goto exit_subdirs;
+            }
+            subdirs.capacity = MAX(subdirs.capacity * 2, 16);
+        }
+        subdirs.list[subdirs.length++] = cur_rec;
+    }
+
+    ret_val = handle_alloc((void **) &children, MAX(subdirs.length, 1),
+                            sizeof(du_child_t), true);
+    if (ret_val != TNI_OK) {
+        goto exit_subdirs;
+    }
+
+    for (idx = 0; idx < subdirs.length; idx++) {
+        children[idx].lba = subdirs.list[idx].extent_list->lba;
+        ret_val = handle_alloc((void **) &(children[idx].name),
+                                subdirs.list[idx].id_length + 1, 1, false);
+        if (ret_val != TNI_OK) {
+            goto exit_children;
+        }
+        strcpy(children[idx].name, subdirs.list[idx].record_id);
+    }
+
+    pthread_mutex_lock(&(state->lock));
+
+    node = &(state->nodes[node_idx]);
+    node->bytes = bytes;
+    node->files = files;
+    node->extents = extents;
+    node->children = children;
+    node->child_num = subdirs.length;
+    children = NULL;
+
+    for (idx = 0; idx < subdirs.length && ret_val == TNI_OK; idx++) {
+
+        ret_val = set_insert_lba(&inserted, &(state->seen), subdirs.list[idx].extent_list->lba);
+        if (ret_val == TNI_OK && inserted) {
+            ret_val = du_add_node(state, &(subdirs.list[idx]));
+            if (ret_val == TNI_OK) {
+                subdirs.list[idx].extent_list = NULL;
+                subdirs.list[idx].record_id = NULL;
+            }
+        }
+    }
+
+    pthread_mutex_unlock(&(state->lock));
+
+    exit_children:
+        if (children != NULL) {
+            for (idx = 0; idx < subdirs.length; idx++) {
+                free(children[idx].name);
+            }
+            free(children);
+        }
+    exit_subdirs:
+        free_record_list(&subdirs);
+        window_free(&window);
+    exit_normal:
+        return ret_val;
+}
+
+static
+void *du_worker(void *raw_state) {
+
+    tni_response_t ret_val;
+    du_state_t *state;
+    tni_record_t dir;
+    uint32_t node_idx;
+
+    state = (du_state_t *) raw_state;
+    pthread_mutex_lock(&(state->lock));
+
+    while (true) {
+
+        while (!(state->stop) && state->next_node == state->node_num && state->busy != 0) {
+            pthread_cond_wait(&(state->cond), &(state->lock));
+        }
+
+        if (state->stop || state->next_node == state->node_num) {
+            break;
+        }
+
+        node_idx = state->next_node++;
+        dir = state->nodes[node_idx].record;
+        state->busy += 1;
+        pthread_mutex_unlock(&(state->lock));
+
+        ret_val = du_scan_dir(state, node_idx, &dir);
+
+        pthread_mutex_lock(&(state->lock));
+        state->busy -= 1;
+        if (ret_val != TNI_OK) {
+            if (state->ret_val == TNI_OK) {
+                state->ret_val = ret_val;
+            }
+            state->stop = true;
+        }
+        pthread_cond_broadcast(&(state->cond));
+    }
+
+    pthread_cond_broadcast(&(state->cond));
+    pthread_mutex_unlock(&(state->lock));
+    return NULL;
+}
+
+static
+int compare_du_index(const void *a, const void *b) {
+
+    uint32_t lba_a, lba_b;
+
+    lba_a = ((du_index_t *) a)->lba;
+    lba_b = ((du_index_t *) b)->lba;
+    return (lba_a > lba_b) - (lba_a < lba_b);
+}
+
+static
+int compare_du_entry(const void *a, const void *b) {
+    return strcmp(((tni_du_entry_t *) a)->path, ((tni_du_entry_t *) b)->path);
+}
+
+static
+uint32_t du_find_node(du_index_t *index, uint32_t node_num, uint32_t lba) {
+
+    du_index_t key, *found;
+
+    key.lba = lba;
+    found = bsearch(&key, index, node_num, sizeof(du_index_t), compare_du_index);
+    return (found != NULL)? found->node : NODE_NONE;
+}
+
+static
+tni_response_t du_child_path(char **path, char *parent, char *name) {
+
+    tni_response_t ret_val;
+    size_t parent_len;
+
+    parent_len = strlen(parent);
+    ret_val = handle_alloc((void **) path, parent_len + strlen(name) + 2, 1, false);
+    if (ret_val != TNI_OK) {
+        return ret_val;
+    }
+
+    if (parent_len == 0) {
+        strcpy(*path, name);
+    } else {
+        sprintf(*path, "%s/%s", parent, name);
+    }
+    return TNI_OK;
+}
+
+/*
+ * Lays a spanning tree over the scanned directories, breadth first from
+ * the root, and folds each subtree into its parent in reverse order.
+ */
+static
+tni_response_t du_aggregate(du_state_t *state) {
+
+    tni_response_t ret_val;
+    du_index_t *index;
+    du_node_t *node, *parent;
+    uint32_t *order, order_len, head, idx, child_node;
+    size_t child;
+
+    ret_val = handle_alloc((void **) &index, state->node_num, sizeof(du_index_t), false);
+    if (ret_val != TNI_OK) {
+        goto exit_normal;
+    }
+
+    ret_val = handle_alloc((void **) &order, state->node_num, sizeof(uint32_t), false);
+    if (ret_val != TNI_OK) {
+        goto exit_index;
+    }
+
+    for (idx = 0; idx < state->node_num; idx++) {
+        index[idx].lba = state->nodes[idx].record.extent_list->lba;
+        index[idx].node = idx;
+    }
+    qsort(index, state->node_num, sizeof(du_index_t), compare_du_index);
+
+    ret_val = handle_alloc((void **) &(state->nodes[0].total.path), 1, 1, true);
+    if (ret_val != TNI_OK) {
+        goto exit_order;
+    }
+    state->nodes[0].parent = 0;
+
+    order[0] = 0;
+    order_len = 1;
+    for (head = 0; head < order_len; head++) {
+
+        node = &(state->nodes[order[head]]);
+        for (child = 0; child < node->child_num; child++) {
+
+            child_node = du_find_node(index, state->node_num, node->children[child].lba);
+            if (child_node == NODE_NONE || state->nodes[child_node].parent != NODE_NONE) {
+                continue;
+            }
+
+            ret_val = du_child_path(&(state->nodes[child_node].total.path), node->total.path,
+                                    node->children[child].name);
+            if (ret_val != TNI_OK) {
+                goto exit_order;
+            }
+
+            state->nodes[child_node].parent = order[head];
+            order[order_len++] = child_node;
+        }
+    }
+
+    for (idx = 0; idx < order_len; idx++) {
+        node = &(state->nodes[order[idx]]);
+        node->total.bytes = node->bytes;
+        node->total.files = node->files;
+        node->total.extents = node->extents;
+        node->total.dirs = 0;
+    }
+
+    for (idx = order_len; idx > 1; idx--) {
+        node = &(state->nodes[order[idx - 1]]);
+        parent = &(state->nodes[node->parent]);
+
+        parent->total.bytes += node->total.bytes;
+        parent->total.files += node->total.files;
+        parent->total.extents += node->total.extents;
+        parent->total.dirs += node->total.dirs + 1;
+    }
+
+    ret_val = TNI_OK;
+
+    exit_order:
+        free(order);
+    exit_index:
+        free(index);
+    exit_normal:
+        return ret_val;
+}
+
+
+/**** API Functions ****/
+
+tni_response_t tni_backend_file(tni_backend_t *backend, char *path) {
+
+    tni_response_t ret_val;
+    file_backend_t *file;
+
+    if (backend == NULL || path == NULL) {
+        ret_val = TNI_ERR_ARGS;
+        goto exit_normal;
+    }
+
+    ret_val = handle_alloc((void **) &file, 1, sizeof(file_backend_t), false);
+    if (ret_val != TNI_OK) {
+        goto exit_normal;
+    }
+
+    ret_val = handle_open(&(file->fd), path, O_RDONLY);
+    if (ret_val != TNI_OK) {
+        goto exit_file;
+    }
+
+    backend->ops = &file_ops;
+    backend->ctx = (void *) file;
+
+    ret_val = TNI_OK;
+    goto exit_normal;
+
+    exit_file:
+        free(file);
+    exit_normal:
+        return ret_val;
+}
+
+tni_response_t tni_backend_memory(tni_backend_t *backend, const void *data, size_t size) {
+
+    tni_response_t ret_val;
+    memory_backend_t *mem;
+
+    if (backend == NULL || data == NULL) {
+        ret_val = TNI_ERR_ARGS;
+        goto exit_normal;
+    }
+
+    ret_val = handle_alloc((void **) &mem, 1, sizeof(memory_backend_t), false);
+    if (ret_val != TNI_OK) {
+        goto exit_normal;
+    }
+
+    mem->data = (const uint8_t *) data;
+    mem->size = size;
+
+    backend->ops = &memory_ops;
+    backend->ctx = (void *) mem;
+
+    ret_val = TNI_OK;
+    exit_normal:
+        return ret_val;
+}
+
+tni_response_t tni_init_iso(tni_iso_t *iso, iso_vol_desc_t *desc,
+                            tni_parse_t parse_type, bool is_header) {
+
+    tni_response_t ret_val;
+    single_state_t root_state;
+    generator_t d_gen;
+
+    if (iso == NULL || desc == NULL) {
+        ret_val = TNI_ERR_ARGS;
+        goto exit_normal;
+    }
+
+    iso->session_start = 0;
+    iso->lba_count = LE_int32(desc->vol_space_size);
+    iso->block_size = LE_int16(desc->block_size);
+    iso->parse_type = parse_type;
+    iso->is_header = is_header;
+    iso->header_size = HEADER_SIZE;
+
+    iso->backend.ops = NULL;
+    iso->backend.ctx = NULL;
+
+    if (iso->block_size == 0) {
+        ret_val = TNI_ERR_ISO;
+        goto exit_normal;
+    }
+
+    ret_val = handle_alloc((void **) &(iso->root_dir), 1,
+                            sizeof(tni_record_t), false);
+    if (ret_val != TNI_OK) {
+        goto exit_normal;
+    }
+
+    root_state.root_dir = (iso_dir_record_t *) desc->root_dir_record;
+    root_state.parsed = false;
+
+    d_gen.generate = single_generator;
+    d_gen.state = (void *) &root_state;
+
+    ret_val = parse_record(iso->root_dir, iso, &d_gen);
+    if (ret_val != TNI_OK) {
+        goto exit_root;
+    }
+
+    ret_val = TNI_OK;
+    goto exit_normal;
+
+    exit_root:
+        free(iso->root_dir);
+    exit_normal:
+        return ret_val;
+}
+
+tni_response_t tni_open_session(tni_iso_t *iso, tni_backend_t *backend,
+                                tni_parse_t parse_type, bool is_header, uint32_t start) {
+
+    tni_response_t ret_val;
+    iso_vol_desc_t desc;
+
+    if (iso == NULL || backend == NULL || backend->ops == NULL
+        || backend->ops->read_at == NULL) {
+        ret_val = TNI_ERR_ARGS;
+        goto exit_normal;
+    }
+
+    ret_val = search_desc(&desc, NULL, backend, parse_type, start);
+    if (ret_val != TNI_OK) {
+        goto exit_normal;
+    }
+
+    ret_val = tni_init_iso(iso, &desc, parse_type, is_header);
+    if (ret_val != TNI_OK) {
+        goto exit_normal;
+    }
+    iso->session_start = start;
+    iso->backend = *backend;
+
+    ret_val = TNI_OK;
+    exit_normal:
+        return ret_val;
+}
+
+tni_response_t tni_open_iso_backend(tni_iso_t *iso, tni_backend_t *backend,
+                                    tni_parse_t parse_type, bool is_header) {
+
+    tni_response_t ret_val;
+    tni_session_t *sessions;
+    uint32_t session_num;
+
+    if (iso == NULL || backend == NULL || backend->ops == NULL
+        || backend->ops->read_at == NULL) {
+        ret_val = TNI_ERR_ARGS;
+        goto exit_normal;
+    }
+
+    ret_val = find_sessions(&sessions, &session_num, backend);
+    if (ret_val != TNI_OK) {
+        goto exit_normal;
+    }
+
+    ret_val = tni_open_session(iso, backend, parse_type, is_header,
+                                sessions[session_num - 1].start);
+    free(sessions);
+
+    exit_normal:
+        return ret_val;
+}
+
+tni_response_t tni_list_sessions(tni_backend_t *backend, tni_session_t **sessions,
+                                    uint32_t *session_num) {
+
+    if (backend == NULL || backend->ops == NULL || backend->ops->read_at == NULL
+        || sessions == NULL || session_num == NULL) {
+        return TNI_ERR_ARGS;
+    }
+
+    return find_sessions(sessions, session_num, backend);
+}
+
+tni_response_t tni_open_iso(tni_iso_t *iso, char *path, tni_parse_t parse_type,
+                            bool is_header) {
+
+    tni_response_t ret_val;
+    tni_backend_t backend;
+    TRACE_BEGIN(trace_start);
+
+    if (iso == NULL || path == NULL) {
+        ret_val = TNI_ERR_ARGS;
+        goto exit_normal;
+    }
+
+    ret_val = tni_backend_file(&backend, path);
+    if (ret_val != TNI_OK) {
+        goto exit_normal;
+    }
+
+    ret_val = tni_open_iso_backend(iso, &backend, parse_type, is_header);
+    if (ret_val != TNI_OK) {
+        goto exit_backend;
+    }
+
+    ret_val = TNI_OK;
+    goto exit_normal;
+
+    exit_backend:
+        backend.ops->close(backend.ctx);
+    exit_normal:
+        TRACE_END(TNI_OP_OPEN_ISO, trace_start);
+        return ret_val;
+}
+
+tni_response_t tni_close_iso(tni_iso_t *iso) {
+
+    tni_response_t ret_val;
+
+    ret_val = TNI_OK;
+    if (iso->backend.ops != NULL && iso->backend.ops->close != NULL) {
+        ret_val = iso->backend.ops->close(iso->backend.ctx);
+    }
+
+    tni_close_session(iso);
+    return ret_val;
+}
+
+void tni_close_session(tni_iso_t *iso) {
+
+    free_record(iso->root_dir);
+    free(iso->root_dir);
+    iso->root_dir = NULL;
+}
+
+tni_response_t tni_read_block(void *block, tni_iso_t *iso, uint32_t lba) {
+
+    tni_response_t ret_val;
+
+    ret_val = iso_read(iso, block, iso->block_size, (off_t) lba * iso->block_size);
+    if (ret_val != TNI_OK) {
+        goto exit_normal;
+    }
+
+    ret_val = TNI_OK;
+    exit_normal:
+        return ret_val;
+}
+
+tni_response_t tni_read_file(void *buf, tni_iso_t *iso, tni_record_t *rec,
+                                off_t rel_pos, size_t size) {
+
+    tni_response_t ret_val;
+    tni_extent_t *cur_extent;
+    off_t cur_pos, read_pos;
+    size_t read_size;
+    TRACE_BEGIN(trace_start);
+
+    if (buf == NULL || iso == NULL || rec == NULL) {
+        ret_val = TNI_ERR_ARGS;
+        goto exit_normal;
+    }
+
+    cur_pos = 0;
+    cur_extent = rec->extent_list;
+    while (size != 0) {
+
+        if (cur_extent == NULL) {
+            ret_val = TNI_FAIL;
+            goto exit_normal;
+        }
+
+        if (cur_pos + cur_extent->length > rel_pos) {
+            read_size = cur_extent->length - (rel_pos - cur_pos);
+            read_pos = ((off_t) cur_extent->lba * iso->block_size) + (rel_pos - cur_pos);
+            
+            read_size = MIN(read_size, size);
+
+            ret_val = iso_read(iso, buf, read_size, read_pos);
+            if (ret_val != TNI_OK) {
+                goto exit_normal;
+            }
+
+            buf += read_size;
+            rel_pos += read_size;
+            size -= read_size;
+        }
+
+        cur_pos += cur_extent->length;
+        cur_extent = cur_extent->link;
+    }
+
+    ret_val = TNI_OK;
+    exit_normal:
+        TRACE_END(TNI_OP_READ_FILE, trace_start);
+        return ret_val;
+}
+
+tni_response_t tni_desc_scan_init(tni_desc_scan_t *scan, tni_parse_t parse_type,
+                                    uint32_t start) {
+
+    tni_response_t ret_val;
+
+    if (scan == NULL) {
+        ret_val = TNI_ERR_ARGS;
+        goto exit_normal;
+    }
+
+    ret_val = select_detector(&(scan->is_type), parse_type);
+    if (ret_val != TNI_OK) {
+        goto exit_normal;
+    }
+
+    scan->need_lba = start + RESV_SECTORS;
+    scan->block = NULL;
+
+    ret_val = TNI_OK;
+    exit_normal:
+        return ret_val;
+}
+
+tni_response_t tni_desc_scan_step(tni_desc_scan_t *scan, iso_vol_desc_t *desc) {
+
+    tni_response_t ret_val;
+    iso_vol_desc_t *cur_desc;
+
+    if (scan == NULL || desc == NULL) {
+        ret_val = TNI_ERR_ARGS;
+        goto exit_normal;
+    }
+
+    if (scan->block == NULL) {
+        ret_val = TNI_PENDING;
+        goto exit_normal;
+    }
+
+    cur_desc = (iso_vol_desc_t *) scan->block;
+    if (memcmp(cur_desc->std_identifier, "CD001", 5) != 0) {
+        ret_val = TNI_ERR_ISO;
+        goto exit_normal;
+    }
+
+    if (scan->is_type(cur_desc)) {
+        memcpy(desc, cur_desc, DESC_SIZE);
+        ret_val = TNI_OK;
+        goto exit_normal;
+    }
+
+    if (cur_desc->vol_desc_type[0] == SECTOR_TAIL) {
+        ret_val = TNI_FAIL;
+        goto exit_normal;
+    }
+
+    scan->need_lba += 1;
+    scan->block = NULL;
+
+    ret_val = TNI_PENDING;
+    exit_normal:
+        return ret_val;
+}
+
+tni_response_t tni_desc_scan_feed(tni_desc_scan_t *scan, uint32_t lba, void *sector) {
+
+    if (scan == NULL || sector == NULL || scan->block != NULL
+        || lba != scan->need_lba) {
+        return TNI_ERR_ARGS;
+    }
+
+    scan->block = sector;
+    return TNI_OK;
+}
+
+tni_response_t tni_scan_init(tni_dir_scan_t *scan, tni_iso_t *iso, tni_record_t *dir) {
+
+    tni_response_t ret_val;
+
+    if (scan == NULL || iso == NULL || dir == NULL) {
+        ret_val = TNI_ERR_ARGS;
+        goto exit_normal;
+    }
+
+    if (!(dir->is_dir)) {
+        ret_val = TNI_ERR_DIR;
+        goto exit_normal;
+    }
+
+    scan->iso = iso;
+    scan->in_record = false;
+    scan_seek(scan, dir->extent_list, 0, 0);
+
+    ret_val = TNI_OK;
+    exit_normal:
+        return ret_val;
+}
+
+tni_response_t tni_scan_step(tni_dir_scan_t *scan, tni_record_t *rec) {
+
+    tni_response_t ret_val;
+    iso_dir_record_t *raw_rec;
+    tni_iso_t *iso;
+
+    off_t sector_end;
+    bool multi_extent;
+
+    if (scan == NULL || rec == NULL) {
+        ret_val = TNI_ERR_ARGS;
+        goto exit_normal;
+    }
+    iso = scan->iso;
+
+    while (true) {
+
+        if (scan->extent == NULL) {
+            ret_val = (scan->in_record)? TNI_ERR_ISO : TNI_FAIL;
+            goto exit_record;
+        }
+
+        if (scan->sector >= scan->sector_count) {
+            scan_seek(scan, scan->extent->link, 0, 0);
+            continue;
+        }
+
+        if (scan->block == NULL) {
+            ret_val = TNI_PENDING;
+            goto exit_normal;
+        }
+
+        sector_end = MIN((off_t) iso->block_size,
+                    (off_t) scan->extent->length - ((off_t) scan->sector * iso->block_size));
+
+        raw_rec = (iso_dir_record_t *) (scan->block + scan->rel_pos);
+        if (scan->rel_pos + (off_t) sizeof(iso_dir_record_t) > sector_end
+            || raw_rec->len_dr[0] == 0) {
+
+            scan->sector += 1;
+            scan->rel_pos = 0;
+            scan->need_lba = scan->extent->lba + scan->sector;
+            scan->need_count = scan->sector_count - MIN(scan->sector, scan->sector_count);
+            scan->block = NULL;
+            continue;
+        }
+
+        if (scan->rel_pos + raw_rec->len_dr[0] > iso->block_size) {
+            ret_val = TNI_ERR_ISO;
+            goto exit_record;
+        }
+        scan->rel_pos += raw_rec->len_dr[0];
+
+        if (scan->in_record) {
+            ret_val = record_append(&multi_extent, &(scan->record), iso, raw_rec);
+        } else {
+            ret_val = record_begin(&multi_extent, &(scan->record), iso, raw_rec);
+        }
+        if (ret_val != TNI_OK) {
+            goto exit_record;
+        }
+
+        scan->in_record = multi_extent;
+        if (!multi_extent) {
+            *rec = scan->record;
+            ret_val = TNI_OK;
+            goto exit_normal;
+        }
+    }
+
+    exit_record:
+        tni_scan_free(scan);
+    exit_normal:
+        return ret_val;
+}
+
+tni_response_t tni_scan_feed(tni_dir_scan_t *scan, uint32_t lba, void *sector) {
+
+    if (scan == NULL || sector == NULL || scan->extent == NULL
+        || scan->block != NULL || lba != scan->need_lba) {
+        return TNI_ERR_ARGS;
+    }
+
+    scan->block = sector;
+    return TNI_OK;
+}
+
+void tni_scan_free(tni_dir_scan_t *scan) {
+
+    if (scan->in_record) {
+        free_record(&(scan->record));
+        scan->in_record = false;
+    }
+}
+
+tni_response_t tni_traverse_dir(tni_iso_t *iso, tni_record_t *dir, tni_callback_t *cb) {
+
+    tni_response_t ret_val;
+    tni_signal_t signal;
+
+    tni_dir_scan_t scan;
+    tni_record_t cur_rec;
+    dir_window_t window;
+
+    if (iso == NULL || dir == NULL || cb == NULL) {
+        ret_val = TNI_ERR_ARGS;
+        goto exit_normal;
+    }
+
+    if (iso->is_header && iso->header_size != 0) {
+        ret_val = traverse_header(iso, dir, cb);
+        goto exit_normal;
+    }
+
+    ret_val = tni_scan_init(&scan, iso, dir);
+    if (ret_val != TNI_OK) {
+        goto exit_normal;
+    }
+
+    window_init(&window, true);
+
+    while (true) {
+
+        ret_val = scan_next(&scan, &cur_rec, &window);
+        if (ret_val == TNI_FAIL) {
+            break;
+        }
+        if (ret_val != TNI_OK) {
+            goto exit_block;
+        }
+
+        signal = cb->fn(&cur_rec, cb->args);
+        if (signal == TNI_SIGNAL_STOP) {
+            ret_val = TNI_OK;
+            goto exit_record;
+        }
+        if (signal == TNI_SIGNAL_ERR) {
+            ret_val = TNI_ERR_CB;
+            goto exit_record;
+        }
+
+        free_record(&cur_rec);
+    }
+
+    ret_val = TNI_OK;
+    goto exit_block;
+
+    exit_record:
+        free_record(&cur_rec);
+    exit_block:
+        window_free(&window);
+    exit_normal:
+        return ret_val;
+}
+
+tni_response_t tni_find_in_dir(tni_iso_t *iso, tni_record_t *dir, char *name,
+                                tni_record_t *rec) {
+
+    tni_response_t ret_val;
+    tni_dir_scan_t scan;
+    void *buffer, *block;
+    dir_window_t window;
+
+    iso_dir_record_t *raw_rec;
+    tni_extent_t *cur_extent;
+
+    char *query;
+    size_t name_len, query_len, buff_len;
+    off_t rel_pos, sector_end;
+    uint32_t lo, hi, mid, sector, sector_count, block_lba;
+    int cmp;
+
+    if (iso == NULL || dir == NULL || name == NULL || rec == NULL) {
+        ret_val = TNI_ERR_ARGS;
+        goto exit_normal;
+    }
+
+    if (!(dir->is_dir)) {
+        ret_val = TNI_ERR_DIR;
+        goto exit_normal;
+    }
+
+    name_len = strlen(name);
+    buff_len = (name_len * parse_unit(iso->parse_type)) + 1;
+    query_len = buff_len;
+
+    ret_val = handle_alloc((void **) &query, buff_len, 1, false);
+    if (ret_val != TNI_OK) {
+        goto exit_normal;
+    }
+
+    ret_val = handle_iconv("UTF-8", parse_encoding(iso->parse_type),
+                            name, name_len, query, &buff_len);
+    if (ret_val != TNI_OK) {
+        ret_val = TNI_FAIL;
+        goto exit_query;
+    }
+    query_len -= buff_len;
+
+    ret_val = handle_alloc(&buffer, 1, iso->block_size, false);
+    if (ret_val != TNI_OK) {
+        goto exit_query;
+    }
+
+    cur_extent = dir->extent_list;
+    while (cur_extent != NULL) {
+
+        sector_count = (cur_extent->length + iso->block_size - 1) / iso->block_size;
+        if (sector_count == 0) {
+            cur_extent = cur_extent->link;
+            continue;
+        }
+
+        block_lba = 0;
+        lo = 0;
+        hi = sector_count - 1;
+
+        while (lo < hi) {
+            mid = lo + ((hi - lo + 1) / 2);
+
+            ret_val = load_block(&block, buffer, iso,
+                                    cur_extent->lba + mid);
+            if (ret_val != TNI_OK) {
+                goto exit_block;
+            }
+            block_lba = cur_extent->lba + mid;
+
+            raw_rec = (iso_dir_record_t *) block;
+            if (raw_rec->len_dr[0] == 0) {
+                cmp = 1;
+            } else {
+                ret_val = compare_record(&cmp, raw_rec, iso, query, query_len);
+                if (ret_val != TNI_OK) {
+                    goto exit_block;
+                }
+            }
+
+            if (cmp < 0) {
+                lo = mid;
+            } else {
+                hi = mid - 1;
+            }
+        }
+
+        for (sector = lo; sector < sector_count && sector <= lo + 1; sector++) {
+
+            if (block_lba != cur_extent->lba + sector) {
+                ret_val = load_block(&block, buffer, iso,
+                                        cur_extent->lba + sector);
+                if (ret_val != TNI_OK) {
+                    goto exit_block;
+                }
+                block_lba = cur_extent->lba + sector;
+            }
+
+            sector_end = MIN((off_t) iso->block_size,
+                        (off_t) cur_extent->length - ((off_t) sector * iso->block_size));
+
+            rel_pos = 0;
+            while (rel_pos + (off_t) sizeof(iso_dir_record_t) <= sector_end) {
+
+                raw_rec = (iso_dir_record_t *) (block + rel_pos);
+                if (raw_rec->len_dr[0] == 0) {
+                    break;
+                }
+
+                if (rel_pos + raw_rec->len_dr[0] > iso->block_size) {
+                    ret_val = TNI_ERR_ISO;
+                    goto exit_block;
+                }
+
+                ret_val = compare_record(&cmp, raw_rec, iso, query, query_len);
+                if (ret_val != TNI_OK) {
+                    goto exit_block;
+                }
+
+                if (cmp > 0) {
+                    sector = sector_count;
+                    break;
+                }
+
+                if (cmp == 0) {
+                    scan.iso = iso;
+                    scan.in_record = false;
+                    scan_seek(&scan, cur_extent, sector, rel_pos);
+
+                    ret_val = tni_scan_feed(&scan, block_lba, block);
+                    if (ret_val != TNI_OK) {
+                        goto exit_block;
+                    }
+
+                    window_init(&window, false);
+                    ret_val = scan_next(&scan, rec, &window);
+                    window_free(&window);
+                    if (ret_val == TNI_FAIL) {
+                        ret_val = TNI_ERR_ISO;
+                    }
+                    goto exit_block;
+                }
+
+                rel_pos += raw_rec->len_dr[0];
+            }
+        }
+
+        cur_extent = cur_extent->link;
+    }
+
+    ret_val = TNI_FAIL;
+
+    exit_block:
+        free(buffer);
+    exit_query:
+        free(query);
+    exit_normal:
+        return ret_val;
+}
+
+tni_response_t tni_walk(tni_iso_t *iso, tni_walk_callback_t *cb) {
+
+    tni_response_t ret_val;
+    tni_signal_t signal;
+
+    walk_state_t state;
+    walk_item_t item;
+    hash_set_t dirs;
+
+    tni_dir_scan_t scan;
+    tni_record_t cur_rec;
+    char *dir_path;
+    dir_window_t window;
+    bool inserted;
+
+    if (iso == NULL || cb == NULL) {
+        ret_val = TNI_ERR_ARGS;
+        goto exit_normal;
+    }
+
+    memset(&state, 0, sizeof(walk_state_t));
+
+    window_init(&window, true);
+
+    ret_val = set_init(&dirs, 256);
+    if (ret_val != TNI_OK) {
+        goto exit_buffer;
+    }
+
+    ret_val = handle_alloc((void **) &dir_path, 1, 1, true);
+    if (ret_val != TNI_OK) {
+        goto exit_heap;
+    }
+
+    ret_val = set_insert_lba(&inserted, &dirs, iso->root_dir->extent_list->lba);
+    if (ret_val == TNI_OK) {
+        ret_val = walk_push(&state, dir_path, iso->root_dir);
+    }
+    if (ret_val != TNI_OK) {
+        free(dir_path);
+        goto exit_heap;
+    }
+
+    while (state.heap_len != 0) {
+
+        walk_pop(&state, &item);
+
+        ret_val = tni_scan_init(&scan, iso, &(item.record));
+        if (ret_val != TNI_OK) {
+            goto exit_item;
+        }
+
+        while (true) {
+
+            ret_val = scan_next(&scan, &cur_rec, &window);
+            if (ret_val == TNI_FAIL) {
+                break;
+            }
+            if (ret_val != TNI_OK) {
+                goto exit_item;
+            }
+
+            if (cur_rec.type != REC_NORMAL) {
+                free_record(&cur_rec);
+                continue;
+            }
+
+            ret_val = walk_path(&state, item.path, &cur_rec);
+            if (ret_val != TNI_OK) {
+                goto exit_record;
+            }
+
+            signal = cb->fn(state.path, &cur_rec, cb->args);
+            if (signal == TNI_SIGNAL_STOP) {
+                ret_val = TNI_OK;
+                goto exit_record;
+            }
+            if (signal == TNI_SIGNAL_ERR) {
+                ret_val = TNI_ERR_CB;
+                goto exit_record;
+            }
+
+            if (cur_rec.is_dir && signal != TNI_SIGNAL_SKIP) {
+
+                ret_val = set_insert_lba(&inserted, &dirs, cur_rec.extent_list->lba);
+                if (ret_val != TNI_OK) {
+                    goto exit_record;
+                }
+
+                if (inserted) {
+                    ret_val = handle_alloc((void **) &dir_path,
+                                            strlen(state.path) + 1, 1, false);
+                    if (ret_val != TNI_OK) {
+                        goto exit_record;
+                    }
+                    strcpy(dir_path, state.path);
+
+                    ret_val = walk_push(&state, dir_path, &cur_rec);
+                    if (ret_val != TNI_OK) {
+                        free(dir_path);
+                        goto exit_record;
+                    }
+                }
+            }
+
+            free_record(&cur_rec);
+        }
+
+        walk_drop(&item);
+    }
+
+    ret_val = TNI_OK;
+    goto exit_heap;
+
+    exit_record:
+        free_record(&cur_rec);
+    exit_item:
+        walk_drop(&item);
+    exit_heap:
+        while (state.heap_len != 0) {
+            walk_pop(&state, &item);
+            walk_drop(&item);
+        }
+        free(state.heap);
+        free(state.path);
+        free(dirs.slots);
+    exit_buffer:
+        window_free(&window);
+    exit_normal:
+        return ret_val;
+}
+
+tni_response_t tni_stream_iso(int fd, tni_parse_t parse_type, tni_stream_opts_t *opts,
+                                tni_stream_callback_t *cb) {
+
+    tni_response_t ret_val;
+    stream_state_t state;
+    stream_item_t item;
+    stream_entry_t *root;
+
+    tni_desc_scan_t desc_scan;
+    iso_vol_desc_t desc;
+    single_state_t root_state;
+    generator_t d_gen;
+
+    size_t window_size;
+    uint32_t lba, limit;
+    bool inserted;
+
+    if (fd < 0 || cb == NULL) {
+        ret_val = TNI_ERR_ARGS;
+        goto exit_normal;
+    }
+
+    window_size = (opts != NULL && opts->window_size != 0)?
+                    opts->window_size : STREAM_WINDOW;
+
+    memset(&state, 0, sizeof(stream_state_t));
+    state.fd = fd;
+    state.base = lseek(fd, 0, SEEK_CUR);
+    state.seekable = (state.base != -1);
+    state.ring_sectors = MAX(window_size / SECTOR_SIZE, STREAM_CHUNK);
+    state.max_pending = (opts != NULL && opts->max_pending != 0)?
+                    opts->max_pending : STREAM_PENDING;
+
+    ret_val = handle_alloc((void **) &(state.ring), state.ring_sectors,
+                            SECTOR_SIZE, false);
+    if (ret_val != TNI_OK) {
+        goto exit_normal;
+    }
+
+    ret_val = tni_desc_scan_init(&desc_scan, parse_type, 0);
+    if (ret_val != TNI_OK) {
+        goto exit_ring;
+    }
+
+    while (true) {
+
+        ret_val = tni_desc_scan_step(&desc_scan, &desc);
+        if (ret_val != TNI_PENDING) {
+            break;
+        }
+
+        lba = desc_scan.need_lba;
+        ret_val = stream_fill(&state, lba);
+        if (ret_val != TNI_OK) {
+            goto exit_ring;
+        }
+
+        ret_val = tni_desc_scan_feed(&desc_scan, lba, state.ring
+                    + ((size_t) (lba % state.ring_sectors) * SECTOR_SIZE));
+        if (ret_val != TNI_OK) {
+            goto exit_ring;
+        }
+    }
+    if (ret_val != TNI_OK) {
+        goto exit_ring;
+    }
+
+    state.iso.lba_count = LE_int32(desc.vol_space_size);
+    state.iso.block_size = LE_int16(desc.block_size);
+    state.iso.parse_type = parse_type;
+    state.iso.is_header = false;
+    state.iso.header_size = 0;
+    state.iso.backend.ops = NULL;
+    state.iso.backend.ctx = NULL;
+    state.iso.root_dir = NULL;
+
+    if (state.iso.block_size != SECTOR_SIZE) {
+        ret_val = TNI_ERR_ISO;
+        goto exit_ring;
+    }
+
+    ret_val = set_init(&(state.dirs), 64);
+    if (ret_val != TNI_OK) {
+        goto exit_ring;
+    }
+
+    ret_val = handle_alloc((void **) &root, 1, sizeof(stream_entry_t), true);
+    if (ret_val != TNI_OK) {
+        goto exit_dirs;
+    }
+
+    ret_val = handle_alloc((void **) &(root->path), 1, 1, true);
+    if (ret_val != TNI_OK) {
+        free(root);
+        goto exit_dirs;
+    }
+
+    root_state.root_dir = (iso_dir_record_t *) desc.root_dir_record;
+    root_state.parsed = false;
+
+    d_gen.generate = single_generator;
+    d_gen.state = (void *) &root_state;
+
+    ret_val = parse_record(&(root->record), &(state.iso), &d_gen);
+    if (ret_val != TNI_OK) {
+        free(root->path);
+        free(root);
+        goto exit_dirs;
+    }
+    root->refs = 1;
+
+    ret_val = set_insert_lba(&inserted, &(state.dirs), root->record.extent_list->lba);
+    if (ret_val != TNI_OK) {
+        stream_release(root);
+        goto exit_dirs;
+    }
+
+    ret_val = stream_queue(&state, root);
+    stream_release(root);
+    if (ret_val != TNI_OK) {
+        goto exit_heap;
+    }
+
+    while (state.heap_len != 0) {
+
+        stream_pop(&state, &item);
+        limit = (state.heap_len != 0)? state.heap[0].lba : UINT32_MAX;
+
+        ret_val = stream_deliver(&state, &item, limit, cb);
+        if (ret_val != TNI_OK) {
+            stream_drop(&item);
+            goto exit_heap;
+        }
+
+        if (item.remaining != 0) {
+            ret_val = stream_push(&state, &item);
+            stream_release(item.entry);
+            if (ret_val != TNI_OK) {
+                free(item.dir_data);
+                goto exit_heap;
+            }
+            continue;
+        }
+
+        if (item.dir_data != NULL) {
+            ret_val = stream_parse_dir(&state, &item, cb);
+            if (ret_val != TNI_OK) {
+                stream_drop(&item);
+                goto exit_heap;
+            }
+        }
+        stream_drop(&item);
+    }
+
+    ret_val = TNI_OK;
+
+    exit_heap:
+        while (state.heap_len != 0) {
+            stream_pop(&state, &item);
+            stream_drop(&item);
+        }
+        free(state.heap);
+        if (ret_val == TNI_FAIL) {
+            ret_val = TNI_OK;
+        }
+    exit_dirs:
+        free(state.dirs.slots);
+        free(state.spill);
+    exit_ring:
+        free(state.ring);
+    exit_normal:
+        return ret_val;
+}
+
+tni_response_t tni_diff(tni_iso_t *iso_a, tni_iso_t *iso_b, tni_diff_callback_t *cb) {
+
+    tni_response_t ret_val;
+    diff_state_t state;
+
+    if (iso_a == NULL || iso_b == NULL || cb == NULL) {
+        ret_val = TNI_ERR_ARGS;
+        goto exit_normal;
+    }
+
+    memset(&state, 0, sizeof(diff_state_t));
+    state.iso_a = iso_a;
+    state.iso_b = iso_b;
+    state.cb = cb;
+
+    ret_val = handle_alloc((void **) &(state.path), 1, 1, true);
+    if (ret_val != TNI_OK) {
+        goto exit_normal;
+    }
+    state.path_cap = 1;
+
+    ret_val = handle_alloc((void **) &(state.buf_a), DIFF_CHUNK, 2, false);
+    if (ret_val != TNI_OK) {
+        goto exit_path;
+    }
+    state.buf_b = state.buf_a + DIFF_CHUNK;
+
+    ret_val = diff_dir(&state, iso_a->root_dir, iso_b->root_dir);
+    if (ret_val == TNI_FAIL) {
+        ret_val = TNI_OK;
+    }
+
+    free(state.buf_a);
+    free(state.range_list);
+    exit_path:
+        free(state.path);
+    exit_normal:
+        return ret_val;
+}
+
+tni_response_t tni_read_dir_batch(tni_iso_t *iso, tni_record_t *dir, tni_dir_batch_t *batch) {
+
+    tni_response_t ret_val;
+    batch_func_t decode;
+    tni_extent_t *cur_extent;
+
+    uint32_t sector_count, per_sector, base, extent_base;
+    off_t length;
+
+    if (iso == NULL || dir == NULL || batch == NULL) {
+        ret_val = TNI_ERR_ARGS;
+        goto exit_normal;
+    }
+
+    if (!(dir->is_dir)) {
+        ret_val = TNI_ERR_DIR;
+        goto exit_normal;
+    }
+
+    decode = (iso->parse_type == TNI_PARSE_JOLIET)?
+                decode_sector_joliet : decode_sector_pvd;
+
+    sector_count = 0;
+    for (cur_extent = dir->extent_list; cur_extent != NULL;
+            cur_extent = cur_extent->link) {
+        sector_count += (cur_extent->length + iso->block_size - 1) / iso->block_size;
+    }
+
+    batch->names_size = (size_t) sector_count * iso->block_size;
+    ret_val = handle_alloc((void **) &(batch->names), MAX(batch->names_size, 1), 1, false);
+    if (ret_val != TNI_OK) {
+        goto exit_normal;
+    }
+
+    per_sector = iso->block_size / sizeof(iso_dir_record_t);
+    ret_val = batch_reserve(batch, sector_count * per_sector);
+    if (ret_val != TNI_OK) {
+        goto exit_names;
+    }
+
+    extent_base = 0;
+    for (cur_extent = dir->extent_list; cur_extent != NULL;
+            cur_extent = cur_extent->link) {
+
+        ret_val = iso_read(iso, batch->names + extent_base, cur_extent->length,
+                            (off_t) cur_extent->lba * iso->block_size);
+        if (ret_val != TNI_OK) {
+            goto exit_batch;
+        }
+
+        for (length = 0; length < cur_extent->length; length += iso->block_size) {
+            base = extent_base + length;
+            ret_val = decode(batch, base, cur_extent->length - length, iso->block_size);
+            if (ret_val != TNI_OK) {
+                goto exit_batch;
+            }
+        }
+
+        extent_base += ((cur_extent->length + iso->block_size - 1) / iso->block_size)
+                        * iso->block_size;
+    }
+
+    ret_val = TNI_OK;
+    goto exit_normal;
+
+    exit_batch:
+        free(batch->lba);
+    exit_names:
+        free(batch->names);
+    exit_normal:
+        return ret_val;
+}
+
+void tni_free_dir_batch(tni_dir_batch_t *batch) {
+
+    if (batch == NULL) {
+        return;
+    }
+
+    free(batch->lba);
+    free(batch->names);
+
+    batch->lba = NULL;
+    batch->names = NULL;
+    batch->count = 0;
+    batch->capacity = 0;
+}
+
+tni_response_t tni_load_tree(tni_iso_t *iso, tni_tree_t *tree) {
+    return tree_build(iso, tree, NULL);
+}
+
+tni_response_t tni_update_tree(tni_iso_t *iso, tni_tree_t *tree, tni_tree_t *prev) {
+
+    if (prev == NULL) {
+        return TNI_ERR_ARGS;
+    }
+    return tree_build(iso, tree, prev);
+}
+
+void tni_free_tree(tni_tree_t *tree) {
+
+    if (tree == NULL) {
+        return;
+    }
+
+    free(tree->nodes);
+    free(tree->extents);
+    free(tree->names);
+    memset(tree, 0, sizeof(tni_tree_t));
+}
+
+tni_response_t tni_save_tree(tni_tree_t *tree, char *path) {
+
+    tni_response_t ret_val;
+    tree_file_t header;
+    int fd;
+
+    if (tree == NULL || path == NULL || tree->node_num == 0) {
+        ret_val = TNI_ERR_ARGS;
+        goto exit_normal;
+    }
+
+    memset(&header, 0, sizeof(tree_file_t));
+    header.magic = TREE_MAGIC;
+    header.version = TREE_VERSION;
+    header.block_size = tree->block_size;
+    header.parse_type = tree->parse_type;
+    header.node_num = tree->node_num;
+    header.extent_num = tree->extent_num;
+    header.names_len = tree->names_len;
+
+    ret_val = handle_open(&fd, path, O_WRONLY | O_CREAT | O_TRUNC);
+    if (ret_val != TNI_OK) {
+        goto exit_normal;
+    }
+
+    ret_val = handle_write(fd, &header, sizeof(tree_file_t));
+    if (ret_val != TNI_OK) {
+        goto exit_file;
+    }
+
+    ret_val = handle_write(fd, tree->nodes, (size_t) tree->node_num * sizeof(tni_node_t));
+    if (ret_val != TNI_OK) {
+        goto exit_file;
+    }
+
+    ret_val = handle_write(fd, tree->extents, (size_t) tree->extent_num * sizeof(tni_span_t));
+    if (ret_val != TNI_OK) {
+        goto exit_file;
+    }
+
+    ret_val = handle_write(fd, tree->names, tree->names_len);
+    if (ret_val != TNI_OK) {
+        goto exit_file;
+    }
+
+    ret_val = handle_close(fd);
+    goto exit_normal;
+
+    exit_file:
+        handle_close(fd);
+    exit_normal:
+        return ret_val;
+}
+
+tni_response_t tni_restore_tree(tni_tree_t *tree, char *path) {
+
+    tni_response_t ret_val;
+    tree_file_t header;
+    int fd;
+
+    if (tree == NULL || path == NULL) {
+        ret_val = TNI_ERR_ARGS;
+        goto exit_normal;
+    }
+
+    memset(tree, 0, sizeof(tni_tree_t));
+
+    ret_val = handle_open(&fd, path, O_RDONLY);
+    if (ret_val != TNI_OK) {
+        goto exit_normal;
+    }
+
+    ret_val = tree_read(fd, &header, sizeof(tree_file_t));
+    if (ret_val != TNI_OK) {
+        goto exit_file;
+    }
+
+    if (header.magic != TREE_MAGIC || header.version != TREE_VERSION) {
+        ret_val = TNI_ERR_FILE;
+        goto exit_file;
+    }
+
+    tree->block_size = header.block_size;
+    tree->parse_type = header.parse_type;
+
+    ret_val = handle_alloc((void **) &(tree->nodes), MAX(header.node_num, 1),
+                            sizeof(tni_node_t), false);
+    if (ret_val != TNI_OK) {
+        goto exit_file;
+    }
+    tree->node_cap = MAX(header.node_num, 1);
+
+    ret_val = handle_alloc((void **) &(tree->extents), MAX(header.extent_num, 1),
+                            sizeof(tni_span_t), false);
+    if (ret_val != TNI_OK) {
+        goto exit_tree;
+    }
+    tree->extent_cap = MAX(header.extent_num, 1);
+
+    ret_val = handle_alloc((void **) &(tree->names), MAX(header.names_len, 1), 1, false);
+    if (ret_val != TNI_OK) {
+        goto exit_tree;
+    }
+    tree->names_cap = MAX(header.names_len, 1);
+
+    ret_val = tree_read(fd, tree->nodes, (size_t) header.node_num * sizeof(tni_node_t));
+    if (ret_val != TNI_OK) {
+        goto exit_tree;
+    }
+    tree->node_num = header.node_num;
+
+    ret_val = tree_read(fd, tree->extents, (size_t) header.extent_num * sizeof(tni_span_t));
+    if (ret_val != TNI_OK) {
+        goto exit_tree;
+    }
+    tree->extent_num = header.extent_num;
+
+    ret_val = tree_read(fd, tree->names, header.names_len);
+    if (ret_val != TNI_OK) {
+        goto exit_tree;
+    }
+    tree->names_len = header.names_len;
+
+    ret_val = tree_check(tree);
+    if (ret_val != TNI_OK) {
+        goto exit_tree;
+    }
+
+    ret_val = handle_close(fd);
+    if (ret_val != TNI_OK) {
+        tni_free_tree(tree);
+    }
+    goto exit_normal;
+
+    exit_tree:
+        tni_free_tree(tree);
+    exit_file:
+        handle_close(fd);
+    exit_normal:
+        return ret_val;
+}
+
+char *tni_tree_name(tni_tree_t *tree, uint32_t node) {
+    return tree->names + tree->nodes[node].name_off;
+}
+
+off_t tni_tree_size(tni_tree_t *tree, uint32_t node) {
+
+    tni_node_t *cur_node;
+    off_t total_size;
+    uint32_t idx;
+
+    cur_node = &(tree->nodes[node]);
+    if (!(cur_node->flags & EXTENT_FLAG)) {
+        return cur_node->length;
+    }
+
+    total_size = 0;
+    for (idx = 0; idx < cur_node->length; idx++) {
+        total_size += tree->extents[cur_node->lba + idx].length;
+    }
+    return total_size;
+}
+
+tni_response_t tni_tree_lookup(tni_tree_t *tree, char *path, uint32_t *node) {
+
+    tni_response_t ret_val;
+    uint32_t cur_node, child;
+    size_t comp_len;
+    char *comp;
+
+    if (tree == NULL || path == NULL || node == NULL || tree->node_num == 0) {
+        ret_val = TNI_ERR_ARGS;
+        goto exit_normal;
+    }
+
+    cur_node = 0;
+    comp = path;
+    while (*comp != '\0') {
+
+        if (*comp == '/') {
+            comp += 1;
+            continue;
+        }
+
+        comp_len = strcspn(comp, "/");
+        for (child = tree->nodes[cur_node].first_child; child != NODE_NONE;
+                child = tree->nodes[child].next_sibling) {
+            if (tree->nodes[child].name_len == comp_len
+                && memcmp(tni_tree_name(tree, child), comp, comp_len) == 0) {
+                break;
+            }
+        }
+
+        if (child == NODE_NONE) {
+            ret_val = TNI_FAIL;
+            goto exit_normal;
+        }
+
+        cur_node = child;
+        comp += comp_len;
+    }
+
+    *node = cur_node;
+    ret_val = TNI_OK;
+
+    exit_normal:
+        return ret_val;
+}
+
+tni_response_t tni_tree_record(tni_tree_t *tree, uint32_t node, tni_record_t *rec) {
+
+    tni_response_t ret_val;
+    tni_node_t *cur_node;
+    tni_extent_t **link;
+    tni_span_t *spans, single;
+    uint32_t idx, span_num;
+    off_t local_start, local_end;
+
+    if (tree == NULL || rec == NULL || node >= tree->node_num) {
+        ret_val = TNI_ERR_ARGS;
+        goto exit_normal;
+    }
+
+    cur_node = &(tree->nodes[node]);
+    if (cur_node->flags & EXTENT_FLAG) {
+        spans = tree->extents + cur_node->lba;
+        span_num = cur_node->length;
+    } else {
+        single.lba = cur_node->lba;
+        single.length = cur_node->length;
+        spans = &single;
+        span_num = 1;
+    }
+
+    rec->type = REC_NORMAL;
+    rec->is_hidden = cur_node->flags & 0x1;
+    rec->is_dir = cur_node->flags & 0x2;
+    rec->total_size = 0;
+    rec->extent_num = 0;
+    rec->extent_list = NULL;
+    rec->extent_span.start = 0;
+    rec->extent_span.end = 0;
+    rec->id_length = cur_node->name_len;
+    rec->header = NULL;
+    rec->header_size = 0;
+
+    ret_val = handle_alloc((void **) &(rec->record_id), cur_node->name_len + 1, 1, false);
+    if (ret_val != TNI_OK) {
+        goto exit_normal;
+    }
+    memcpy(rec->record_id, tni_tree_name(tree, node), cur_node->name_len + 1);
+
+    link = &(rec->extent_list);
+    for (idx = 0; idx < span_num; idx++) {
+
+        ret_val = handle_alloc((void **) link, 1, sizeof(tni_extent_t), false);
+        if (ret_val != TNI_OK) {
+            free_record(rec);
+            goto exit_normal;
+        }
+
+        (*link)->lba = spans[idx].lba;
+        (*link)->length = spans[idx].length;
+        (*link)->link = NULL;
+
+        local_start = (off_t) spans[idx].lba * tree->block_size;
+        local_end = local_start + spans[idx].length;
+
+        if (idx == 0) {
+            rec->extent_span.start = local_start;
+            rec->extent_span.end = local_end;
+        } else {
+            rec->extent_span.start = MIN(rec->extent_span.start, local_start);
+            rec->extent_span.end = MAX(rec->extent_span.end, local_end);
+        }
+
+        rec->total_size += spans[idx].length;
+        rec->extent_num += 1;
+        link = &((*link)->link);
+    }
+
+    ret_val = TNI_OK;
+    exit_normal:
+        return ret_val;
+}
+
+void tni_free_record(tni_record_t *rec) {
+
+    if (rec == NULL) {
+        return;
+    }
+    free_record(rec);
+}
+
+tni_response_t tni_verify_implanted_md5(tni_iso_t *iso, tni_progress_t *progress) {
+
+    static const char hex_digits[] = "0123456789abcdef";
 
     tni_response_t ret_val;
-    FILE *iso_file;
-    type_func_t t_func;
+    tni_signal_t signal;
     iso_vol_desc_t desc;
-    bool desc_success;
+    md5_info_t info;
+    md5_reader_t reader;
+    md5_ctx_t ctx;
+    pthread_t thread;
+
+    off_t desc_pos, fragment_size, offset, chunk_end, buf_pos;
+    uint64_t fragment, prev_fragment;
+    size_t buf_used, buf_len, take;
+    uint8_t digest[16];
+    char hash_sum[33];
+    int idx;
+
+    if (iso == NULL) {
+        ret_val = TNI_ERR_ARGS;
+        goto exit_normal;
+    }
+
+    ret_val = search_desc(&desc, &desc_pos, &(iso->backend), TNI_PARSE_PVD, 0);
+    if (ret_val != TNI_OK) {
+        goto exit_normal;
+    }
+
+    ret_val = parse_md5_info(&info, &desc);
+    if (ret_val != TNI_OK) {
+        ret_val = TNI_ERR_ISO;
+        goto exit_normal;
+    }
+
+    memset(&reader, 0, sizeof(md5_reader_t));
+    reader.iso = iso;
+    reader.total = ((off_t) LE_int32(desc.vol_space_size) * SECTOR_SIZE)
+                    - ((off_t) info.skip_sectors * SECTOR_SIZE);
+
+    if (reader.total <= 0) {
+        ret_val = TNI_ERR_ISO;
+        goto exit_normal;
+    }
+
+    fragment_size = reader.total / (info.fragment_count + 1);
+    if (fragment_size == 0) {
+        info.fragment_count = 0;
+        fragment_size = reader.total;
+    }
+
+    for (idx = 0; idx < 2; idx++) {
+        if (posix_memalign((void **) &(reader.buffer[idx]), MD5_IO_ALIGN, MD5_IO_SIZE) != 0) {
+            ret_val = TNI_ERR_MEM;
+            goto exit_buffers;
+        }
+    }
+
+    pthread_mutex_init(&(reader.lock), NULL);
+    pthread_cond_init(&(reader.cond), NULL);
+
+    if (pthread_create(&thread, NULL, md5_reader, (void *) &reader) != 0) {
+        ret_val = TNI_ERROR;
+        goto exit_sync;
+    }
+
+    md5_init(&ctx);
+    prev_fragment = 0;
+    offset = 0;
+
+    idx = 0;
+    buf_pos = 0;
+    buf_used = 0;
+    buf_len = 0;
+
+    while (offset < reader.total) {
+
+        chunk_end = offset + MIN(reader.total - offset, MIN(fragment_size, (off_t) MD5_CHUNK));
+        fragment = offset / fragment_size;
+
+        while (offset < chunk_end) {
+
+            if (buf_used == buf_len) {
+                if (buf_used != 0) {
+                    pthread_mutex_lock(&(reader.lock));
+                    reader.full[idx] = false;
+                    pthread_cond_broadcast(&(reader.cond));
+                    pthread_mutex_unlock(&(reader.lock));
+
+                    buf_pos += buf_used;
+                    idx ^= 1;
+                }
+
+                pthread_mutex_lock(&(reader.lock));
+                while (!(reader.full[idx])) {
+                    pthread_cond_wait(&(reader.cond), &(reader.lock));
+                }
+                buf_len = reader.length[idx];
+                ret_val = reader.status;
+                pthread_mutex_unlock(&(reader.lock));
+
+                if (buf_len == 0) {
+                    ret_val = (ret_val != TNI_OK)? ret_val : TNI_ERR_FILE;
+                    goto exit_thread;
+                }
+
+                buf_used = 0;
+                clear_app_data(reader.buffer[idx], buf_len, buf_pos,
+                                desc_pos + MD5_APPDATA_OFFSET);
+            }
+
+            take = MIN((size_t) (chunk_end - offset), buf_len - buf_used);
+            md5_update(&ctx, reader.buffer[idx] + buf_used, take);
+
+            buf_used += take;
+            offset += take;
+        }
+
+        if (info.fragment_count != 0 && fragment != prev_fragment) {
+            if (!check_md5_fragment(&ctx, &info, fragment)) {
+                ret_val = TNI_FAIL;
+                goto exit_thread;
+            }
+            prev_fragment = fragment;
+        }
+
+        if (progress != NULL) {
+            signal = progress->fn(offset, reader.total, progress->args);
+            if (signal != TNI_SIGNAL_OK) {
+                ret_val = (signal == TNI_SIGNAL_STOP)? TNI_FAIL : TNI_ERR_CB;
+                goto exit_thread;
+            }
+        }
+    }
+
+    md5_final(&ctx, digest);
+    for (idx = 0; idx < 16; idx++) {
+        hash_sum[idx * 2] = hex_digits[digest[idx] >> 4];
+        hash_sum[(idx * 2) + 1] = hex_digits[digest[idx] & 0xf];
+    }
+    hash_sum[32] = '\0';
+
+    ret_val = (strcmp(hash_sum, info.hash_sum) == 0)? TNI_OK : TNI_FAIL;
+
+    exit_thread:
+        pthread_mutex_lock(&(reader.lock));
+        reader.stop = true;
+        pthread_cond_broadcast(&(reader.cond));
+        pthread_mutex_unlock(&(reader.lock));
+        pthread_join(thread, NULL);
+    exit_sync:
+        pthread_cond_destroy(&(reader.cond));
+        pthread_mutex_destroy(&(reader.lock));
+    exit_buffers:
+        free(reader.buffer[0]);
+        free(reader.buffer[1]);
+    exit_normal:
+        return ret_val;
+}
+
+tni_response_t tni_remaster(tni_iso_t *iso, tni_change_t *changes, size_t change_num, char *out_path) {
+
+    tni_response_t ret_val;
+    remaster_state_t state;
+    remaster_node_t root;
+    tni_iso_t other;
+    tni_iso_t *cur_iso;
+    struct stat src_stat, out_stat;
+
+    iso_vol_desc_t descs[2], cur_desc;
+    off_t desc_pos[2], image_size, pos;
+    bool has_desc[2];
+    tni_parse_t parse_types[2] = {TNI_PARSE_PVD, TNI_PARSE_JOLIET};
+    uint32_t root_lba, root_len, sectors;
+    size_t idx;
+    int src_fd, side;
+
+    if (iso == NULL || out_path == NULL || (changes == NULL && change_num != 0)) {
+        ret_val = TNI_ERR_ARGS;
+        goto exit_normal;
+    }
+
+    memset(&root, 0, sizeof(remaster_node_t));
+    root.change = -1;
+
+    for (idx = 0; idx < change_num; idx++) {
+        if (changes[idx].path == NULL
+            || (changes[idx].kind == TNI_CHANGE_PUT && changes[idx].source == NULL)) {
+            ret_val = TNI_ERR_ARGS;
+            goto exit_trie;
+        }
+
+        ret_val = remaster_trie_add(&root, changes[idx].path, (long) idx);
+        if (ret_val != TNI_OK) {
+            goto exit_trie;
+        }
+    }
+
+    ret_val = iso->backend.ops->size(iso->backend.ctx, &image_size);
+    if (ret_val != TNI_OK) {
+        goto exit_trie;
+    }
+
+    /* Opening the output truncates it, so it must not be any of the inputs. */
+    if (stat(out_path, &out_stat) == 0) {
+        if (iso->backend.ops == &file_ops
+            && fstat(((file_backend_t *) iso->backend.ctx)->fd, &src_stat) == 0
+            && src_stat.st_dev == out_stat.st_dev && src_stat.st_ino == out_stat.st_ino) {
+            ret_val = TNI_ERR_ARGS;
+            goto exit_trie;
+        }
+
+        for (idx = 0; idx < change_num; idx++) {
+            if (changes[idx].kind == TNI_CHANGE_PUT && stat(changes[idx].source, &src_stat) == 0
+                && src_stat.st_dev == out_stat.st_dev && src_stat.st_ino == out_stat.st_ino) {
+                ret_val = TNI_ERR_ARGS;
+                goto exit_trie;
+            }
+        }
+    }
+
+    ret_val = handle_alloc((void **) &(state.puts), MAX(change_num, 1),
+                            sizeof(remaster_put_t), true);
+    if (ret_val != TNI_OK) {
+        goto exit_trie;
+    }
+
+    ret_val = handle_open(&(state.out_fd), out_path, O_RDWR | O_CREAT | O_TRUNC);
+    if (ret_val != TNI_OK) {
+        goto exit_puts;
+    }
+
+    ret_val = remaster_clone(state.out_fd, iso, image_size);
+    if (ret_val != TNI_OK) {
+        goto exit_out;
+    }
+
+    state.changes = changes;
+    state.next_lba = MAX(iso->lba_count,
+                        (uint32_t) ((image_size + iso->block_size - 1) / iso->block_size));
+    remaster_time(state.rec_time);
+
+    for (idx = 0; idx < change_num; idx++) {
+
+        if (changes[idx].kind != TNI_CHANGE_PUT) {
+            continue;
+        }
+
+        ret_val = handle_open(&src_fd, changes[idx].source, O_RDONLY);
+        if (ret_val != TNI_OK) {
+            goto exit_out;
+        }
+
+        if (fstat(src_fd, &src_stat) != 0) {
+            handle_close(src_fd);
+            ret_val = TNI_ERR_FILE;
+            goto exit_out;
+        }
+
+        state.puts[idx].lba = (src_stat.st_size == 0)? 0 : state.next_lba;
+        state.puts[idx].size = src_stat.st_size;
+
+        ret_val = copy_fd_range(state.out_fd, (off_t) state.next_lba * iso->block_size,
+                                src_fd, 0, src_stat.st_size);
+        handle_close(src_fd);
+        if (ret_val != TNI_OK) {
+            goto exit_out;
+        }
+
+        state.next_lba += (src_stat.st_size + iso->block_size - 1) / iso->block_size;
+    }
+
+    for (side = 0; side < 2; side++) {
+
+        has_desc[side] = false;
+        ret_val = search_desc(&descs[side], &desc_pos[side], &(iso->backend),
+                                parse_types[side], iso->session_start);
+        if (ret_val == TNI_FAIL) {
+            continue;
+        }
+        if (ret_val != TNI_OK) {
+            goto exit_out;
+        }
+
+        cur_iso = iso;
+        if (iso->parse_type != parse_types[side]) {
+            ret_val = tni_open_session(&other, &(iso->backend), parse_types[side],
+                                        false, iso->session_start);
+            if (ret_val != TNI_OK) {
+                goto exit_out;
+            }
+            cur_iso = &other;
+        }
+
+        state.iso = cur_iso;
+        state.primary = (side == 0);
+
+        ret_val = set_init(&(state.dirs), 64);
+        if (ret_val == TNI_OK) {
+            ret_val = remaster_dir(&root_lba, &root_len, &state, cur_iso->root_dir,
+                                    &root, 0, 0);
+            free(state.dirs.slots);
+        }
+        if (cur_iso == &other) {
+            tni_close_session(&other);
+        }
+        if (ret_val != TNI_OK) {
+            goto exit_out;
+        }
+
+        put_both32(descs[side].root_dir_record + 2, root_lba);
+        put_both32(descs[side].root_dir_record + 10, root_len);
+        memcpy(descs[side].root_dir_record + 18, state.rec_time, 7);
+
+        ret_val = remaster_path_table(&state, &descs[side], parse_types[side]);
+        if (ret_val != TNI_OK) {
+            goto exit_out;
+        }
+        has_desc[side] = true;
+    }
+
+    for (sectors = 16; ; sectors++) {
+
+        pos = ((off_t) iso->session_start + sectors) * SECTOR_SIZE;
+        ret_val = backend_read(&(iso->backend), &cur_desc, DESC_SIZE, pos);
+        if (ret_val != TNI_OK) {
+            goto exit_out;
+        }
+
+        if (memcmp(cur_desc.std_identifier, "CD001", 5) != 0) {
+            ret_val = TNI_ERR_ISO;
+            goto exit_out;
+        }
+
+        if (cur_desc.vol_desc_type[0] == 255) {
+            break;
+        }
 
-    single_state_t root_state;
-    generator_t d_gen;
+        for (side = 0; side < 2; side++) {
+            if (has_desc[side] && desc_pos[side] == pos) {
+                cur_desc = descs[side];
+            }
+        }
 
-    if (iso == NULL || path == NULL) {
-        ret_val = TNI_ERR_ARGS;
-        goto exit_normal;
+        if (cur_desc.vol_desc_type[0] == 1 || cur_desc.vol_desc_type[0] == 2) {
+            put_both32(cur_desc.vol_space_size, state.next_lba);
+        }
+
+        ret_val = handle_pwrite(state.out_fd, &cur_desc, DESC_SIZE, pos);
+        if (ret_val != TNI_OK) {
+            goto exit_out;
+        }
     }
 
-    ret_val = handle_fopen(&iso_file, path, "r");
-    if (ret_val != TNI_OK) {
-        goto exit_normal; 
+    if (ftruncate(state.out_fd, (off_t) state.next_lba * iso->block_size) != 0) {
+        ret_val = TNI_ERR_FILE;
+        goto exit_out;
     }
 
-    switch(parse_type) {
+    ret_val = handle_close(state.out_fd);
+    goto exit_puts;
 
-        case TNI_PARSE_PVD:
-            t_func = *detect_pvd;
-            break;
-        case TNI_PARSE_JOLIET:
-            t_func = *detect_joliet;
-            break;
-        default:
-            break;
+    exit_out:
+        handle_close(state.out_fd);
+    exit_puts:
+        free(state.puts);
+    exit_trie:
+        remaster_trie_free(root.child);
+    exit_normal:
+        return ret_val;
+}
+
+tni_response_t tni_search(tni_iso_t *iso, tni_patterns_t *patterns, tni_search_opts_t *opts,
+                            tni_search_callback_t *cb) {
+
+    tni_response_t ret_val;
+    search_state_t state;
+    tni_walk_callback_t collect;
+    pthread_t *workers;
+    unsigned thread_num, started;
+    size_t idx;
+
+    if (iso == NULL || patterns == NULL || patterns->list == NULL
+        || patterns->num == 0 || cb == NULL || cb->fn == NULL) {
+        ret_val = TNI_ERR_ARGS;
+        goto exit_normal;
     }
 
-    ret_val = search_desc(&desc, iso_file, t_func);
+    ret_val = search_matcher_init(&(state.matcher), patterns);
     if (ret_val != TNI_OK) {
-        goto exit_file;
+        goto exit_normal;
     }
 
-    iso->lba_count = LE_int32(desc.vol_space_size);
-    iso->block_size = LE_int16(desc.block_size);
-    iso->parse_type = parse_type;
-    iso->is_header = is_header;
-    iso->file_ptr = iso_file;
-
-    ret_val = handle_alloc((void **) &(iso->root_dir), 1, 
-                            sizeof(iso_dir_record_t), false);
+    state.iso = iso;
+    state.cb = cb;
+    state.chunk_size = (opts != NULL && opts->chunk_size != 0)?
+                        opts->chunk_size : SEARCH_CHUNK;
+    state.items = NULL;
+    state.item_num = 0;
+    state.item_cap = 0;
+    state.next_item = 0;
+    state.stop = false;
+    state.ret_val = TNI_OK;
+
+    collect.fn = search_collect;
+    collect.args = &state;
+
+    ret_val = tni_walk(iso, &collect);
     if (ret_val != TNI_OK) {
-        goto exit_file;
+        goto exit_items;
     }
 
-    root_state.root_dir = (iso_dir_record_t *) desc.root_dir_record;
-    root_state.parsed = false;
+    qsort(state.items, state.item_num, sizeof(search_item_t), compare_search_item);
 
-    d_gen.generate = single_generator;
-    d_gen.state = (void *) &root_state;
+    thread_num = (opts != NULL && opts->threads != 0)? opts->threads : SEARCH_THREADS;
+    thread_num = (unsigned) MAX(MIN((size_t) thread_num, state.item_num), 1);
 
-    ret_val = parse_record(iso->root_dir, iso, &d_gen);
+    ret_val = handle_alloc((void **) &workers, thread_num, sizeof(pthread_t), false);
     if (ret_val != TNI_OK) {
-        goto exit_root;
+        goto exit_items;
     }
 
-    ret_val = TNI_OK;
-    goto exit_normal;
+    if (pthread_mutex_init(&(state.lock), NULL) != 0) {
+        ret_val = TNI_ERROR;
+        goto exit_workers;
+    }
 
-    exit_root:
-        free(iso->root_dir);
-    exit_file:
-        handle_fclose(iso_file);
+    for (started = 0; started < thread_num; started++) {
+        if (pthread_create(&(workers[started]), NULL, search_worker, &state) != 0) {
+            pthread_mutex_lock(&(state.lock));
+            state.ret_val = TNI_ERROR;
+            state.stop = true;
+            pthread_mutex_unlock(&(state.lock));
+            break;
+        }
+    }
+
+    for (idx = 0; idx < started; idx++) {
+        pthread_join(workers[idx], NULL);
+    }
+    ret_val = state.ret_val;
+
+    pthread_mutex_destroy(&(state.lock));
+    exit_workers:
+        free(workers);
+    exit_items:
+        for (idx = 0; idx < state.item_num; idx++) {
+            free(state.items[idx].path);
+            free_record(&(state.items[idx].record));
+        }
+        free(state.items);
+        search_matcher_free(&(state.matcher));
     exit_normal:
         return ret_val;
 }
 
-tni_response_t tni_close_iso(tni_iso_t *iso) {
+tni_response_t tni_file_stream_open(tni_file_stream_t *stream, tni_iso_t *iso, tni_record_t *rec) {
 
     tni_response_t ret_val;
 
-    ret_val = handle_fclose(iso->file_ptr);
-    if (ret_val != TNI_OK) {
+    if (stream == NULL || iso == NULL || rec == NULL) {
+        ret_val = TNI_ERR_ARGS;
         goto exit_normal;
     }
-    free_record(iso->root_dir);
-
-    exit_normal:
-        return ret_val;
-}
 
-tni_response_t tni_read_block(void *block, tni_iso_t *iso, uint32_t lba) {
+    if (rec->is_dir) {
+        ret_val = TNI_ERR_DIR;
+        goto exit_normal;
+    }
 
-    tni_response_t ret_val;
+    memset(stream, 0, sizeof(tni_file_stream_t));
+    stream->iso = iso;
+    stream->rec = rec;
+    stream->window = FILE_STREAM_MIN;
+    stream->status = TNI_OK;
 
-    ret_val = handle_fseek(iso->file_ptr, lba * iso->block_size, SEEK_SET);
-    if (ret_val != TNI_OK) {
+    if (pthread_mutex_init(&(stream->lock), NULL) != 0) {
+        ret_val = TNI_ERROR;
         goto exit_normal;
     }
 
-    ret_val = handle_fread(block, iso->block_size, 1, iso->file_ptr);
-    if (ret_val != TNI_OK) {
-        goto exit_normal;
+    if (pthread_cond_init(&(stream->cond), NULL) != 0) {
+        ret_val = TNI_ERROR;
+        goto exit_lock;
+    }
+
+    if (pthread_create(&(stream->thread), NULL, file_stream_helper, (void *) stream) != 0) {
+        ret_val = TNI_ERROR;
+        goto exit_cond;
     }
 
     ret_val = TNI_OK;
+    goto exit_normal;
+
+    exit_cond:
+        pthread_cond_destroy(&(stream->cond));
+    exit_lock:
+        pthread_mutex_destroy(&(stream->lock));
     exit_normal:
         return ret_val;
 }
 
-tni_response_t tni_read_file(void *buf, tni_iso_t *iso, tni_record_t *rec,
-                                off_t rel_pos, size_t size) {
+tni_response_t tni_file_stream_read(tni_file_stream_t *stream, void *buf, size_t size, size_t *got) {
 
     tni_response_t ret_val;
-    tni_extent_t *cur_extent;
-    off_t cur_pos, read_pos;
-    size_t read_size;
+    size_t copy_size;
+    off_t buffer_end;
+    int cur;
 
-    if (buf == NULL || iso == NULL || rec == NULL) {
-        ret_val = TNI_ERR_ARGS;
-        goto exit_normal;
+    if (stream == NULL || buf == NULL || got == NULL) {
+        return TNI_ERR_ARGS;
     }
 
-    cur_pos = 0;
-    cur_extent = rec->extent_list;
-    while (size != 0) {
+    *got = 0;
+    pthread_mutex_lock(&(stream->lock));
 
-        if (cur_extent == NULL) {
-            ret_val = TNI_FAIL;
-            goto exit_normal;
+    while (size != 0 && stream->pos < stream->rec->total_size) {
+
+        cur = stream->cur;
+        while (!(stream->full[cur]) && stream->status == TNI_OK) {
+            pthread_cond_wait(&(stream->cond), &(stream->lock));
         }
 
-        if (cur_pos + cur_extent->length > rel_pos) {
-            read_size = cur_extent->length - (rel_pos - cur_pos);
-            read_pos = (cur_extent->lba * iso->block_size) + (rel_pos - cur_pos);
-            
-            if (size < read_size) {
-                read_size = size;
-                size = 0;
-            } else {
-                size -= read_size;
-            }
+        if (!(stream->full[cur])) {
+            ret_val = stream->status;
+            goto exit_lock;
+        }
 
-            ret_val = handle_fseek(iso->file_ptr, read_pos, SEEK_SET);
-            if (ret_val != TNI_OK) {
-                goto exit_normal;
-            }
+        /* The helper never touches a full buffer, so it is copied unlocked. */
+        buffer_end = stream->start[cur] + (off_t) stream->length[cur];
+        copy_size = (size_t) MIN((off_t) size, buffer_end - stream->pos);
+        pthread_mutex_unlock(&(stream->lock));
 
-            ret_val = handle_fread(buf, 1, read_size, iso->file_ptr);
-            if (ret_val != TNI_OK) {
-                goto exit_normal;
-            }
-        }
+        memcpy(buf, stream->buffer[cur] + (stream->pos - stream->start[cur]), copy_size);
 
-        buf += read_size;
-        cur_pos += cur_extent->length;
+        pthread_mutex_lock(&(stream->lock));
+        buf += copy_size;
+        size -= copy_size;
+        *got += copy_size;
+        stream->pos += copy_size;
+
+        if (stream->pos == buffer_end) {
+            stream->full[cur] = false;
+            stream->cur ^= 1;
+            stream->window = MIN(stream->window * 2, (size_t) FILE_STREAM_MAX);
+            pthread_cond_broadcast(&(stream->cond));
+        }
     }
 
     ret_val = TNI_OK;
-    exit_normal:
+    exit_lock:
+        pthread_mutex_unlock(&(stream->lock));
         return ret_val;
 }
 
-tni_response_t tni_traverse_dir(tni_iso_t *iso, tni_record_t *dir, tni_callback_t *cb) {
+tni_response_t tni_file_stream_seek(tni_file_stream_t *stream, off_t pos) {
+
+    if (stream == NULL || pos < 0 || pos > stream->rec->total_size) {
+        return TNI_ERR_ARGS;
+    }
+
+    pthread_mutex_lock(&(stream->lock));
+
+    if (file_stream_holds(stream, stream->cur, pos)) {
+        stream->pos = pos;
+
+    } else if (file_stream_holds(stream, stream->cur ^ 1, pos)) {
+        stream->full[stream->cur] = false;
+        stream->cur ^= 1;
+        stream->pos = pos;
+        pthread_cond_broadcast(&(stream->cond));
+
+    } else {
+        file_stream_reset(stream, pos);
+    }
+
+    pthread_mutex_unlock(&(stream->lock));
+    return TNI_OK;
+}
+
+tni_response_t tni_file_stream_close(tni_file_stream_t *stream) {
 
     tni_response_t ret_val;
-    tni_signal_t signal;
 
-    record_state_t state;
-    generator_t gen;
+    if (stream == NULL) {
+        return TNI_ERR_ARGS;
+    }
 
-    tni_record_t cur_rec;
-    tni_extent_t *cur_extent;
-    off_t local_start, local_end;
+    pthread_mutex_lock(&(stream->lock));
+    stream->stop = true;
+    pthread_cond_broadcast(&(stream->cond));
+    pthread_mutex_unlock(&(stream->lock));
 
-    if (iso == NULL || dir == NULL) {
+    pthread_join(stream->thread, NULL);
+    ret_val = stream->status;
+
+    pthread_cond_destroy(&(stream->cond));
+    pthread_mutex_destroy(&(stream->lock));
+    free(stream->buffer[0]);
+    free(stream->buffer[1]);
+
+    return ret_val;
+}
+
+tni_response_t tni_du(tni_iso_t *iso, unsigned threads, tni_du_table_t *table) {
+
+    tni_response_t ret_val;
+    du_state_t state;
+    tni_record_t root;
+    pthread_t *workers;
+    unsigned started;
+    uint32_t idx;
+    bool inserted;
+
+    if (iso == NULL || table == NULL) {
         ret_val = TNI_ERR_ARGS;
         goto exit_normal;
     }
 
-    if (!(dir->is_dir)) {
-        ret_val = TNI_ERR_DIR;
+    memset(&state, 0, sizeof(du_state_t));
+    state.iso = iso;
+    state.ret_val = TNI_OK;
+    threads = (threads != 0)? threads : DU_THREADS;
+
+    ret_val = set_init(&(state.seen), 256);
+    if (ret_val != TNI_OK) {
         goto exit_normal;
     }
 
-    gen.generate = record_generator;
-    gen.state = &state;
+    ret_val = copy_record(&root, iso->root_dir);
+    if (ret_val != TNI_OK) {
+        goto exit_seen;
+    }
 
-    state.iso = iso;
-    ret_val = handle_alloc(&(state.block), 1, iso->block_size, false);
+    ret_val = set_insert_lba(&inserted, &(state.seen), root.extent_list->lba);
+    if (ret_val == TNI_OK) {
+        ret_val = du_add_node(&state, &root);
+    }
     if (ret_val != TNI_OK) {
-        goto exit_normal;
+        free_record(&root);
+        goto exit_nodes;
     }
 
-    cur_extent = dir->extent_list;
-    while (cur_extent != NULL) {
+    ret_val = handle_alloc((void **) &workers, threads, sizeof(pthread_t), false);
+    if (ret_val != TNI_OK) {
+        goto exit_nodes;
+    }
+
+    if (pthread_mutex_init(&(state.lock), NULL) != 0) {
+        ret_val = TNI_ERROR;
+        goto exit_workers;
+    }
 
-        local_start = cur_extent->lba * iso->block_size;
-        local_end = local_start + cur_extent->length;
+    if (pthread_cond_init(&(state.cond), NULL) != 0) {
+        ret_val = TNI_ERROR;
+        goto exit_lock;
+    }
 
-        state.block_pos = cur_extent->lba;
-        state.block_end = (local_end + iso->block_size - 1) / iso->block_size;
+    for (started = 0; started < threads; started++) {
+        if (pthread_create(&(workers[started]), NULL, du_worker, &state) != 0) {
+            pthread_mutex_lock(&(state.lock));
+            state.ret_val = TNI_ERROR;
+            state.stop = true;
+            pthread_cond_broadcast(&(state.cond));
+            pthread_mutex_unlock(&(state.lock));
+            break;
+        }
+    }
 
-        state.rel_pos = 0;
-        state.rel_end = local_end % iso->block_size;
+    for (idx = 0; idx < started; idx++) {
+        pthread_join(workers[idx], NULL);
+    }
 
-        ret_val = tni_read_block(state.block, iso, cur_extent->lba);
-        if (ret_val != TNI_OK) {
-            goto exit_block;
+    ret_val = (started == 0)? TNI_ERROR : state.ret_val;
+    if (ret_val == TNI_OK) {
+        ret_val = du_aggregate(&state);
+    }
+
+    if (ret_val == TNI_OK) {
+        ret_val = handle_alloc((void **) &(table->entries), state.node_num,
+                                sizeof(tni_du_entry_t), false);
+    }
+
+    if (ret_val == TNI_OK) {
+        for (idx = 0; idx < state.node_num; idx++) {
+            table->entries[idx] = state.nodes[idx].total;
+            state.nodes[idx].total.path = NULL;
         }
+        table->entry_num = state.node_num;
+        qsort(table->entries, table->entry_num, sizeof(tni_du_entry_t), compare_du_entry);
+    }
 
-        while (true) {
-            ret_val = parse_record(&cur_rec, iso, &gen);
-            if (ret_val == TNI_FAIL) {
-                break;
-            }
-            if (ret_val != TNI_OK) {
-                goto exit_normal;
-            }
+    pthread_cond_destroy(&(state.cond));
+    exit_lock:
+        pthread_mutex_destroy(&(state.lock));
+    exit_workers:
+        free(workers);
+    exit_nodes:
+        for (idx = 0; idx < state.node_num; idx++) {
+            free(state.nodes[idx].total.path);
+            du_free_node(&(state.nodes[idx]));
+        }
+        free(state.nodes);
+    exit_seen:
+        free(state.seen.slots);
+    exit_normal:
+        return ret_val;
+}
 
-            signal = cb->fn(&cur_rec, cb->args);
-            if (signal == TNI_SIGNAL_STOP) {
-                ret_val = TNI_OK;
-                goto exit_record;
-            }
-            if (signal == TNI_SIGNAL_ERR) {
-                ret_val = TNI_ERR_CB;
-                goto exit_record;
-            }
+tni_response_t tni_du_lookup(tni_du_table_t *table, char *path, tni_du_entry_t **entry) {
 
-            free_record(&cur_rec);
+    size_t lo, hi, mid, path_len;
+    int cmp;
+
+    if (table == NULL || path == NULL || entry == NULL) {
+        return TNI_ERR_ARGS;
+    }
+
+    while (*path == '/') {
+        path += 1;
+    }
+
+    path_len = strlen(path);
+    while (path_len != 0 && path[path_len - 1] == '/') {
+        path_len -= 1;
+    }
+
+    lo = 0;
+    hi = table->entry_num;
+    while (lo < hi) {
+
+        mid = lo + ((hi - lo) / 2);
+        cmp = strncmp(path, table->entries[mid].path, path_len);
+        if (cmp == 0 && table->entries[mid].path[path_len] != '\0') {
+            cmp = -1;
+        }
+
+        if (cmp == 0) {
+            *entry = &(table->entries[mid]);
+            return TNI_OK;
+        }
+
+        if (cmp < 0) {
+            hi = mid;
+        } else {
+            lo = mid + 1;
         }
-        cur_extent = cur_extent->link;
     }
 
-    ret_val = TNI_OK;
-    goto exit_normal;
+    return TNI_FAIL;
+}
 
-    exit_record:
-        free_record(&cur_rec);
-    exit_block:
-        free(state.block);
+void tni_du_free(tni_du_table_t *table) {
+
+    size_t idx;
+
+    for (idx = 0; idx < table->entry_num; idx++) {
+        free(table->entries[idx].path);
+    }
+    free(table->entries);
+    table->entries = NULL;
+    table->entry_num = 0;
+}
+
+#ifdef TNI_TRACE
+tni_response_t tni_trace_hist(tni_trace_op_t op, tni_trace_hist_t *hist) {
+
+    trace_local_t *local;
+    tni_trace_hist_t *cur_hist;
+    size_t bucket;
+
+    if (op >= TNI_OP_COUNT || hist == NULL) {
+        return TNI_ERR_ARGS;
+    }
+
+    memset(hist, 0, sizeof(tni_trace_hist_t));
+
+    pthread_mutex_lock(&trace_lock);
+    for (local = trace_locals; local != NULL; local = local->next) {
+
+        pthread_mutex_lock(&(local->lock));
+        cur_hist = &(local->hists[op]);
+
+        hist->count += cur_hist->count;
+        hist->total_ns += cur_hist->total_ns;
+        hist->max_ns = MAX(hist->max_ns, cur_hist->max_ns);
+        for (bucket = 0; bucket < TRACE_BUCKETS; bucket++) {
+            hist->buckets[bucket] += cur_hist->buckets[bucket];
+        }
+
+        pthread_mutex_unlock(&(local->lock));
+    }
+    pthread_mutex_unlock(&trace_lock);
+
+    return TNI_OK;
+}
+
+void tni_trace_ring(bool enabled) {
+    __atomic_store_n(&trace_ring_on, enabled, __ATOMIC_RELAXED);
+}
+
+tni_response_t tni_trace_dump(char *path) {
+
+    tni_response_t ret_val;
+    trace_local_t *local;
+    tni_trace_event_t *events, *cur_event;
+    uint64_t event_num, local_num, first, idx;
+    FILE *out;
+
+    if (path == NULL) {
+        ret_val = TNI_ERR_ARGS;
+        goto exit_normal;
+    }
+
+    pthread_mutex_lock(&trace_lock);
+
+    event_num = 0;
+    for (local = trace_locals; local != NULL; local = local->next) {
+        pthread_mutex_lock(&(local->lock));
+        event_num += MIN(local->event_num, (uint64_t) TRACE_RING);
+        pthread_mutex_unlock(&(local->lock));
+    }
+
+    ret_val = handle_alloc((void **) &events, MAX(event_num, 1),
+                            sizeof(tni_trace_event_t), false);
+    if (ret_val != TNI_OK) {
+        pthread_mutex_unlock(&trace_lock);
+        goto exit_normal;
+    }
+
+    /* Rings only grow in between, so stop once the buffer is full. */
+    idx = 0;
+    for (local = trace_locals; local != NULL; local = local->next) {
+
+        pthread_mutex_lock(&(local->lock));
+        local_num = MIN(MIN(local->event_num, (uint64_t) TRACE_RING), event_num - idx);
+        first = local->event_num - local_num;
+
+        for (; local_num != 0; local_num--) {
+            events[idx++] = local->events[first++ % TRACE_RING];
+        }
+        pthread_mutex_unlock(&(local->lock));
+    }
+    event_num = idx;
+
+    pthread_mutex_unlock(&trace_lock);
+
+    qsort(events, event_num, sizeof(tni_trace_event_t), compare_trace_event);
+
+    out = fopen(path, "w");
+    if (out == NULL) {
+        ret_val = TNI_ERR_FILE;
+        goto exit_events;
+    }
+
+    fprintf(out, "{\"traceEvents\":[");
+    for (idx = 0; idx < event_num; idx++) {
+        cur_event = &(events[idx]);
+        fprintf(out, "%s\n{\"name\":\"%s\",\"cat\":\"tni\",\"ph\":\"X\","
+                    "\"ts\":%llu.%03llu,\"dur\":%llu.%03llu,\"pid\":%ld,\"tid\":%lu}",
+                    (idx == 0)? "" : ",", trace_names[cur_event->op],
+                    (unsigned long long) (cur_event->start_ns / 1000),
+                    (unsigned long long) (cur_event->start_ns % 1000),
+                    (unsigned long long) (cur_event->dur_ns / 1000),
+                    (unsigned long long) (cur_event->dur_ns % 1000),
+                    (long) getpid(), cur_event->thread);
+    }
+    fprintf(out, "\n],\"displayTimeUnit\":\"ns\"}\n");
+
+    ret_val = (fclose(out) == 0)? TNI_OK : TNI_ERR_FILE;
+
+    exit_events:
+        free(events);
     exit_normal:
         return ret_val;
 }
+
+void tni_trace_reset(void) {
+
+    trace_local_t *local;
+
+    pthread_mutex_lock(&trace_lock);
+    for (local = trace_locals; local != NULL; local = local->next) {
+        pthread_mutex_lock(&(local->lock));
+        memset(local->hists, 0, sizeof(local->hists));
+        local->event_num = 0;
+        pthread_mutex_unlock(&(local->lock));
+    }
+    pthread_mutex_unlock(&trace_lock);
+}
+#endif
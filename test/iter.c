@@ -10,6 +10,7 @@ typedef struct {
     char *path;
     int idx;
     tni_iso_t *iso;
+    tni_response_t error;
 } arg_t;
 
 tni_signal_t traverse_cb(tni_record_t *rec, void *raw_arg) {
@@ -17,7 +18,6 @@ tni_signal_t traverse_cb(tni_record_t *rec, void *raw_arg) {
     tni_response_t ret_val;
     tni_callback_t cb;
     arg_t *args;
-    int t_id;
 
     if (rec == NULL || raw_arg == NULL) {
         return TNI_SIGNAL_ERR;
@@ -43,6 +43,9 @@ tni_signal_t traverse_cb(tni_record_t *rec, void *raw_arg) {
 
             ret_val = tni_traverse_dir(args->iso, rec, &cb);
             if (ret_val != TNI_OK) {
+                if (args->error == TNI_OK) {
+                    args->error = ret_val;
+                }
                 return TNI_SIGNAL_ERR;
             }
 
@@ -67,17 +70,19 @@ int main(int argc, char *argv[]) {
     char *path;
 
     if (argc != 2) {
-        printf("Usage: %s ISO-FILE\n", argv[0]);
+        fprintf(stderr, "Usage: %s ISO-FILE\n", argv[0]);
+        return EXIT_FAILURE;
     }
     
     ret_val = tni_open_iso(&iso, argv[1], TNI_PARSE_JOLIET, false);
     if (ret_val != TNI_OK) {
-        printf("ERROR NUM: %d\n", ret_val);
+        fprintf(stderr, "%s: cannot open image (error %d)\n", argv[1], ret_val);
         return EXIT_FAILURE;
     }
 
     path = malloc(PATH_SIZE);
-    if (cb.args == NULL) {
+    if (path == NULL) {
+        tni_close_iso(&iso);
         return EXIT_FAILURE;
     }
     path[0] = '\0';
@@ -85,17 +90,21 @@ int main(int argc, char *argv[]) {
     args.path = path;
     args.idx = 0;
     args.iso = &iso;
+    args.error = TNI_OK;
 
     cb.fn = traverse_cb;
     cb.args = (void *) &args;
 
     ret_val = tni_traverse_dir(&iso, iso.root_dir, &cb);
+    if (ret_val == TNI_ERR_CB && args.error != TNI_OK) {
+        ret_val = args.error;
+    }
+    free(path);
+    tni_close_iso(&iso);
+
     if (ret_val != TNI_OK) {
-        printf("ERROR NUM: %d\n", ret_val);
-        free(path);
+        fprintf(stderr, "%s: traversal failed (error %d)\n", argv[1], ret_val);
         return EXIT_FAILURE;
     }
-
-    tni_close_iso(&iso);
     return EXIT_SUCCESS;
 }
@@ -0,0 +1,257 @@
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "tni.h"
+
+/* Put alongside the requested changes: names the primary tree cannot hold as-is. */
+static char *extra_paths[] = {
+    "r\xC3\xA9sum\xC3\xA9 \xE2\x80\x94 final.txt",
+    "notes (draft), v1.2 + more-long-words.tar.gz"
+};
+#define EXTRA_NUM (sizeof(extra_paths) / sizeof(char *))
+
+typedef struct {
+    char **paths;
+    size_t num, cap;
+    off_t bytes;
+} listing_t;
+
+static
+int add_path(listing_t *list, char *path) {
+
+    char **paths;
+
+    if (list->num == list->cap) {
+        list->cap = (list->cap == 0)? 64 : list->cap * 2;
+        paths = realloc(list->paths, list->cap * sizeof(char *));
+        if (paths == NULL) {
+            return -1;
+        }
+        list->paths = paths;
+    }
+
+    list->paths[list->num] = strdup(path);
+    if (list->paths[list->num] == NULL) {
+        return -1;
+    }
+    list->num += 1;
+    return 0;
+}
+
+static
+void free_listing(listing_t *list) {
+
+    size_t idx;
+
+    for (idx = 0; idx < list->num; idx++) {
+        free(list->paths[idx]);
+    }
+    free(list->paths);
+}
+
+static
+int compare_path(const void *a, const void *b) {
+    return strcmp(*(char **) a, *(char **) b);
+}
+
+tni_signal_t walk_cb(char *path, tni_record_t *rec, void *raw_arg) {
+
+    listing_t *list;
+
+    list = (listing_t *) raw_arg;
+    if (!(rec->is_dir)) {
+        list->bytes += rec->total_size;
+    }
+    return (add_path(list, path) == 0)? TNI_SIGNAL_OK : TNI_SIGNAL_ERR;
+}
+
+tni_signal_t primary_cb(char *path, tni_record_t *rec, void *raw_arg) {
+
+    char *name, *cur;
+    size_t dots;
+
+    name = strrchr(path, '/');
+    name = (name != NULL)? name + 1 : path;
+
+    dots = 0;
+    for (cur = name; *cur != '\0'; cur++) {
+        if (*cur == '.' && !(rec->is_dir)) {
+            dots += 1;
+        } else if (!((*cur >= 'A' && *cur <= 'Z') || (*cur >= '0' && *cur <= '9') ||
+                        *cur == '_')) {
+            dots = 2;
+        }
+    }
+
+    if (dots > 1 || cur == name || (size_t) (cur - name) > ((rec->is_dir)? 31 : 30)) {
+        fprintf(stderr, "%s: not a primary identifier\n", path);
+        return TNI_SIGNAL_ERR;
+    }
+    return TNI_SIGNAL_OK;
+}
+
+tni_signal_t stream_cb(tni_chunk_t *chunk, void *raw_arg) {
+
+    listing_t *list;
+
+    list = (listing_t *) raw_arg;
+    list->bytes += chunk->size;
+
+    /* Each entry is announced once: by its first chunk, or a bare one. */
+    if (chunk->data != NULL && chunk->offset != 0) {
+        return TNI_SIGNAL_OK;
+    }
+    return (add_path(list, chunk->path) == 0)? TNI_SIGNAL_OK : TNI_SIGNAL_ERR;
+}
+
+int main(int argc, char *argv[]) {
+
+    tni_response_t ret_val;
+    tni_iso_t iso;
+    tni_change_t *changes;
+    tni_walk_callback_t walk, primary;
+    tni_stream_callback_t stream;
+
+    listing_t walked, streamed;
+    char *split;
+    size_t idx;
+    int fd, status;
+
+    if (argc < 3) {
+        fprintf(stderr, "Usage: %s ISO-FILE OUT-FILE [PATH=SOURCE | -PATH]...\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    changes = calloc(argc + EXTRA_NUM, sizeof(tni_change_t));
+    if (changes == NULL) {
+        return EXIT_FAILURE;
+    }
+
+    for (idx = 3; idx < (size_t) argc; idx++) {
+        split = strchr(argv[idx], '=');
+        if (argv[idx][0] == '-') {
+            changes[idx - 3].kind = TNI_CHANGE_DELETE;
+            changes[idx - 3].path = argv[idx] + 1;
+        } else if (split != NULL) {
+            *split = '\0';
+            changes[idx - 3].kind = TNI_CHANGE_PUT;
+            changes[idx - 3].path = argv[idx];
+            changes[idx - 3].source = split + 1;
+        } else {
+            fprintf(stderr, "%s: expected PATH=SOURCE or -PATH\n", argv[idx]);
+            free(changes);
+            return EXIT_FAILURE;
+        }
+    }
+
+    for (idx = 0; idx < EXTRA_NUM; idx++) {
+        changes[argc - 3 + idx].kind = TNI_CHANGE_PUT;
+        changes[argc - 3 + idx].path = extra_paths[idx];
+        changes[argc - 3 + idx].source = argv[0];
+    }
+
+    ret_val = tni_open_iso(&iso, argv[1], TNI_PARSE_JOLIET, false);
+    if (ret_val != TNI_OK) {
+        fprintf(stderr, "%s: cannot open image (error %d)\n", argv[1], ret_val);
+        free(changes);
+        return EXIT_FAILURE;
+    }
+
+    ret_val = tni_remaster(&iso, changes, argc - 3 + EXTRA_NUM, argv[2]);
+    tni_close_iso(&iso);
+    free(changes);
+    if (ret_val != TNI_OK) {
+        fprintf(stderr, "%s: remaster failed (error %d)\n", argv[2], ret_val);
+        return EXIT_FAILURE;
+    }
+
+    memset(&walked, 0, sizeof(listing_t));
+    memset(&streamed, 0, sizeof(listing_t));
+    status = EXIT_FAILURE;
+
+    ret_val = tni_open_iso(&iso, argv[2], TNI_PARSE_JOLIET, false);
+    if (ret_val != TNI_OK) {
+        fprintf(stderr, "%s: cannot open output (error %d)\n", argv[2], ret_val);
+        goto exit_normal;
+    }
+
+    walk.fn = walk_cb;
+    walk.args = (void *) &walked;
+
+    ret_val = tni_walk(&iso, &walk);
+    tni_close_iso(&iso);
+    if (ret_val != TNI_OK) {
+        fprintf(stderr, "%s: walk failed (error %d)\n", argv[2], ret_val);
+        goto exit_normal;
+    }
+
+    ret_val = tni_open_iso(&iso, argv[2], TNI_PARSE_PVD, false);
+    if (ret_val != TNI_OK) {
+        fprintf(stderr, "%s: cannot open primary tree (error %d)\n", argv[2], ret_val);
+        goto exit_normal;
+    }
+
+    primary.fn = primary_cb;
+    primary.args = NULL;
+
+    ret_val = tni_walk(&iso, &primary);
+    tni_close_iso(&iso);
+    if (ret_val != TNI_OK) {
+        fprintf(stderr, "%s: primary walk failed (error %d)\n", argv[2], ret_val);
+        goto exit_normal;
+    }
+
+    fd = open(argv[2], O_RDONLY);
+    if (fd == -1) {
+        perror(argv[2]);
+        goto exit_normal;
+    }
+
+    stream.fn = stream_cb;
+    stream.args = (void *) &streamed;
+
+    ret_val = tni_stream_iso(fd, TNI_PARSE_JOLIET, NULL, &stream);
+    close(fd);
+    if (ret_val != TNI_OK) {
+        fprintf(stderr, "%s: stream failed (error %d)\n", argv[2], ret_val);
+        goto exit_normal;
+    }
+
+    qsort(walked.paths, walked.num, sizeof(char *), compare_path);
+    qsort(streamed.paths, streamed.num, sizeof(char *), compare_path);
+
+    if (walked.num != streamed.num || walked.bytes != streamed.bytes) {
+        fprintf(stderr, "%s: walk saw %zu entries (%lld bytes), stream saw %zu (%lld bytes)\n",
+                argv[2], walked.num, (long long) walked.bytes,
+                streamed.num, (long long) streamed.bytes);
+        goto exit_normal;
+    }
+
+    for (idx = 0; idx < walked.num; idx++) {
+        if (strcmp(walked.paths[idx], streamed.paths[idx]) != 0) {
+            fprintf(stderr, "%s: walk and stream disagree at %s\n",
+                    argv[2], walked.paths[idx]);
+            goto exit_normal;
+        }
+    }
+
+    for (idx = 0; idx < EXTRA_NUM; idx++) {
+        if (bsearch(&extra_paths[idx], walked.paths, walked.num, sizeof(char *),
+                    compare_path) == NULL) {
+            fprintf(stderr, "%s: %s is missing\n", argv[2], extra_paths[idx]);
+            goto exit_normal;
+        }
+    }
+
+    printf("%s: %zu entries, %lld bytes\n", argv[2], walked.num, (long long) walked.bytes);
+    status = EXIT_SUCCESS;
+
+    exit_normal:
+        free_listing(&walked);
+        free_listing(&streamed);
+        return status;
+}
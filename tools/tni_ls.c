@@ -0,0 +1,536 @@
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "tni.h"
+
+#define OUT_SIZE (1 << 20)
+#define LINE_SIZE 4096
+
+typedef enum {
+    FMT_NDJSON,
+    FMT_CSV,
+} format_t;
+
+typedef struct {
+
+    format_t format;
+    tni_parse_t parse_type;
+    int threads;
+    int max_depth;
+    char type;
+    char *pattern;
+    off_t min_size;
+
+    char **images;
+    size_t image_num;
+
+    int out_fd;
+    pthread_mutex_t out_lock;
+
+    pthread_mutex_t next_lock;
+    size_t next_image;
+    int failed;
+
+} ls_opts_t;
+
+typedef struct {
+
+    ls_opts_t *opts;
+    char *image;
+
+    char *buf;
+    size_t len, cap;
+    bool write_err;
+
+} ls_worker_t;
+
+static
+bool write_all(int fd, char *buf, size_t size) {
+
+    ssize_t write_ret;
+
+    while (size != 0) {
+        write_ret = write(fd, buf, size);
+        if (write_ret == -1 && errno == EINTR) {
+            continue;
+        }
+        if (write_ret <= 0) {
+            return false;
+        }
+        buf += write_ret;
+        size -= write_ret;
+    }
+    return true;
+}
+
+static
+void flush_out(ls_worker_t *worker) {
+
+    if (worker->len == 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&(worker->opts->out_lock));
+    if (!write_all(worker->opts->out_fd, worker->buf, worker->len)) {
+        worker->write_err = true;
+    }
+    pthread_mutex_unlock(&(worker->opts->out_lock));
+
+    worker->len = 0;
+}
+
+/*
+ * Room for a whole record is made before it is started, so a flush never
+ * splits one around another worker's output.
+ */
+static
+bool reserve_out(ls_worker_t *worker, size_t size) {
+
+    char *buf;
+
+    if (worker->len + size <= worker->cap) {
+        return true;
+    }
+
+    flush_out(worker);
+    if (size <= worker->cap) {
+        return true;
+    }
+
+    buf = realloc(worker->buf, size);
+    if (buf == NULL) {
+        return false;
+    }
+    worker->buf = buf;
+    worker->cap = size;
+    return true;
+}
+
+static
+void put_char(ls_worker_t *worker, char c) {
+    worker->buf[worker->len++] = c;
+}
+
+static
+void put_str(ls_worker_t *worker, const char *str) {
+
+    while (*str != '\0') {
+        put_char(worker, *str++);
+    }
+}
+
+static
+void put_json(ls_worker_t *worker, const char *str) {
+
+    char esc[8];
+
+    put_char(worker, '"');
+    for (; *str != '\0'; str++) {
+        switch (*str) {
+            case '"':
+                put_str(worker, "\\\"");
+                break;
+            case '\\':
+                put_str(worker, "\\\\");
+                break;
+            default:
+                if ((unsigned char) *str < 0x20) {
+                    snprintf(esc, sizeof(esc), "\\u%04x", (unsigned char) *str);
+                    put_str(worker, esc);
+                } else {
+                    put_char(worker, *str);
+                }
+        }
+    }
+    put_char(worker, '"');
+}
+
+static
+void put_csv(ls_worker_t *worker, const char *str) {
+
+    put_char(worker, '"');
+    for (; *str != '\0'; str++) {
+        if (*str == '"') {
+            put_char(worker, '"');
+        }
+        put_char(worker, *str);
+    }
+    put_char(worker, '"');
+}
+
+static
+int path_depth(const char *path) {
+
+    int depth;
+
+    depth = 1;
+    for (; *path != '\0'; path++) {
+        if (*path == '/') {
+            depth += 1;
+        }
+    }
+    return depth;
+}
+
+static
+bool keep_record(ls_opts_t *opts, char *path, tni_record_t *rec) {
+
+    char *base;
+
+    if (opts->type == 'f' && rec->is_dir) {
+        return false;
+    }
+    if (opts->type == 'd' && !(rec->is_dir)) {
+        return false;
+    }
+    if (rec->total_size < opts->min_size) {
+        return false;
+    }
+
+    if (opts->pattern != NULL) {
+        base = strrchr(path, '/');
+        base = (base == NULL)? path : base + 1;
+        if (fnmatch(opts->pattern, base, 0) != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static
+tni_signal_t list_cb(char *path, tni_record_t *rec, void *raw_arg) {
+
+    ls_worker_t *worker;
+    ls_opts_t *opts;
+    char line[LINE_SIZE];
+    size_t need;
+    uint32_t lba;
+    int depth;
+
+    worker = (ls_worker_t *) raw_arg;
+    opts = worker->opts;
+
+    if (worker->write_err) {
+        return TNI_SIGNAL_STOP;
+    }
+
+    depth = path_depth(path);
+    if (opts->max_depth != 0 && depth > opts->max_depth) {
+        return TNI_SIGNAL_SKIP;
+    }
+
+    if (keep_record(opts, path, rec)) {
+
+        lba = (rec->extent_list != NULL)? rec->extent_list->lba : 0;
+
+        if (opts->format == FMT_NDJSON) {
+            snprintf(line, sizeof(line),
+                    ",\"size\":%lld,\"lba\":%u,\"extents\":%u,\"dir\":%s,\"hidden\":%s}\n",
+                    (long long) rec->total_size, lba, rec->extent_num,
+                    (rec->is_dir)? "true" : "false",
+                    (rec->is_hidden)? "true" : "false");
+        } else {
+            snprintf(line, sizeof(line), ",%lld,%u,%u,%d,%d\n",
+                    (long long) rec->total_size, lba, rec->extent_num,
+                    rec->is_dir? 1 : 0, rec->is_hidden? 1 : 0);
+        }
+
+        /* An escaped character takes at most six bytes ("\u001f"). */
+        need = 6 * (strlen(worker->image) + strlen(path)) + strlen(line) + 32;
+        if (!reserve_out(worker, need)) {
+            return TNI_SIGNAL_ERR;
+        }
+
+        if (opts->format == FMT_NDJSON) {
+            put_str(worker, "{\"image\":");
+            put_json(worker, worker->image);
+            put_str(worker, ",\"path\":");
+            put_json(worker, path);
+        } else {
+            put_csv(worker, worker->image);
+            put_char(worker, ',');
+            put_csv(worker, path);
+        }
+        put_str(worker, line);
+    }
+
+    if (rec->is_dir && opts->max_depth != 0 && depth >= opts->max_depth) {
+        return TNI_SIGNAL_SKIP;
+    }
+    return TNI_SIGNAL_OK;
+}
+
+static
+void *list_worker(void *raw_arg) {
+
+    tni_response_t ret_val;
+    tni_walk_callback_t cb;
+    tni_iso_t iso;
+
+    ls_opts_t *opts;
+    ls_worker_t worker;
+    size_t image;
+
+    opts = (ls_opts_t *) raw_arg;
+    worker.opts = opts;
+    worker.len = 0;
+    worker.cap = OUT_SIZE;
+    worker.write_err = false;
+
+    worker.buf = malloc(OUT_SIZE);
+    if (worker.buf == NULL) {
+        pthread_mutex_lock(&(opts->next_lock));
+        opts->failed = 1;
+        pthread_mutex_unlock(&(opts->next_lock));
+        return NULL;
+    }
+
+    cb.fn = list_cb;
+    cb.args = (void *) &worker;
+
+    while (!(worker.write_err)) {
+
+        pthread_mutex_lock(&(opts->next_lock));
+        image = opts->next_image++;
+        pthread_mutex_unlock(&(opts->next_lock));
+
+        if (image >= opts->image_num) {
+            break;
+        }
+        worker.image = opts->images[image];
+
+        ret_val = tni_open_iso(&iso, worker.image, opts->parse_type, false);
+        if (ret_val == TNI_OK) {
+            ret_val = tni_walk(&iso, &cb);
+            tni_close_iso(&iso);
+        }
+
+        if (ret_val != TNI_OK && !(worker.write_err)) {
+            fprintf(stderr, "tni-ls: %s: error %d\n", worker.image, ret_val);
+            pthread_mutex_lock(&(opts->next_lock));
+            opts->failed = 1;
+            pthread_mutex_unlock(&(opts->next_lock));
+        }
+    }
+
+    flush_out(&worker);
+    if (worker.write_err) {
+        pthread_mutex_lock(&(opts->next_lock));
+        opts->failed = 1;
+        pthread_mutex_unlock(&(opts->next_lock));
+    }
+
+    free(worker.buf);
+    return NULL;
+}
+
+static
+bool add_image(ls_opts_t *opts, char *path, size_t *cap) {
+
+    char **images;
+
+    if (opts->image_num == *cap) {
+        images = realloc(opts->images, ((*cap == 0)? 1024 : *cap * 2) * sizeof(char *));
+        if (images == NULL) {
+            return false;
+        }
+        opts->images = images;
+        *cap = (*cap == 0)? 1024 : *cap * 2;
+    }
+
+    opts->images[opts->image_num] = strdup(path);
+    if (opts->images[opts->image_num] == NULL) {
+        return false;
+    }
+    opts->image_num += 1;
+    return true;
+}
+
+static
+bool read_list(ls_opts_t *opts, char *list_path, size_t *cap) {
+
+    FILE *list;
+    char *line;
+    size_t line_cap;
+    bool added;
+
+    list = (strcmp(list_path, "-") == 0)? stdin : fopen(list_path, "r");
+    if (list == NULL) {
+        return false;
+    }
+
+    line = NULL;
+    line_cap = 0;
+    added = true;
+    while (added && getline(&line, &line_cap, list) != -1) {
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0] != '\0') {
+            added = add_image(opts, line, cap);
+        }
+    }
+    free(line);
+
+    if (list != stdin) {
+        fclose(list);
+    }
+    return added;
+}
+
+static
+void usage(char *name) {
+    fprintf(stderr,
+        "Usage: %s [options] ISO-FILE...\n"
+        "  -f ndjson|csv   output format (default ndjson)\n"
+        "  -j N            worker threads (default 4)\n"
+        "  -d N            only list entries up to depth N\n"
+        "  -t f|d          only list files or directories\n"
+        "  -n PATTERN      only list names matching a shell pattern\n"
+        "  -s BYTES        only list entries of at least BYTES\n"
+        "  -p              read the primary descriptor instead of Joliet\n"
+        "  -l FILE         read image paths from FILE, one per line (- for stdin)\n"
+        "  -o FILE         write to FILE instead of stdout\n", name);
+}
+
+int main(int argc, char *argv[]) {
+
+    ls_opts_t opts;
+    pthread_t *workers;
+    char *list_path, *out_path;
+    size_t idx, cap;
+    int opt, started;
+
+    memset(&opts, 0, sizeof(ls_opts_t));
+    opts.format = FMT_NDJSON;
+    opts.parse_type = TNI_PARSE_JOLIET;
+    opts.threads = 4;
+    opts.out_fd = STDOUT_FILENO;
+
+    list_path = NULL;
+    out_path = NULL;
+
+    while ((opt = getopt(argc, argv, "f:j:d:t:n:s:pl:o:h")) != -1) {
+        switch (opt) {
+            case 'f':
+                if (strcmp(optarg, "ndjson") == 0) {
+                    opts.format = FMT_NDJSON;
+                } else if (strcmp(optarg, "csv") == 0) {
+                    opts.format = FMT_CSV;
+                } else {
+                    usage(argv[0]);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'j':
+                opts.threads = atoi(optarg);
+                break;
+            case 'd':
+                opts.max_depth = atoi(optarg);
+                break;
+            case 't':
+                opts.type = optarg[0];
+                break;
+            case 'n':
+                opts.pattern = optarg;
+                break;
+            case 's':
+                opts.min_size = strtoll(optarg, NULL, 10);
+                break;
+            case 'p':
+                opts.parse_type = TNI_PARSE_PVD;
+                break;
+            case 'l':
+                list_path = optarg;
+                break;
+            case 'o':
+                out_path = optarg;
+                break;
+            default:
+                usage(argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+
+    if (opts.threads < 1 || opts.max_depth < 0
+        || (opts.type != '\0' && opts.type != 'f' && opts.type != 'd')) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    cap = 0;
+    for (; optind < argc; optind++) {
+        if (!add_image(&opts, argv[optind], &cap)) {
+            fprintf(stderr, "tni-ls: out of memory\n");
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (list_path != NULL && !read_list(&opts, list_path, &cap)) {
+        fprintf(stderr, "tni-ls: %s: %s\n", list_path, strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    if (opts.image_num == 0) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    if (out_path != NULL) {
+        opts.out_fd = open(out_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (opts.out_fd == -1) {
+            fprintf(stderr, "tni-ls: %s: %s\n", out_path, strerror(errno));
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (opts.format == FMT_CSV) {
+        write_all(opts.out_fd, "image,path,size,lba,extents,dir,hidden\n", 39);
+    }
+
+    if ((size_t) opts.threads > opts.image_num) {
+        opts.threads = opts.image_num;
+    }
+
+    workers = malloc(opts.threads * sizeof(pthread_t));
+    if (workers == NULL) {
+        fprintf(stderr, "tni-ls: out of memory\n");
+        return EXIT_FAILURE;
+    }
+
+    pthread_mutex_init(&(opts.out_lock), NULL);
+    pthread_mutex_init(&(opts.next_lock), NULL);
+
+    for (started = 0; started < opts.threads; started++) {
+        if (pthread_create(&workers[started], NULL, list_worker, &opts) != 0) {
+            pthread_mutex_lock(&(opts.next_lock));
+            opts.failed = 1;
+            pthread_mutex_unlock(&(opts.next_lock));
+            break;
+        }
+    }
+
+    for (opt = 0; opt < started; opt++) {
+        pthread_join(workers[opt], NULL);
+    }
+
+    if (out_path != NULL && close(opts.out_fd) != 0) {
+        opts.failed = 1;
+    }
+
+    pthread_mutex_destroy(&(opts.out_lock));
+    pthread_mutex_destroy(&(opts.next_lock));
+
+    for (idx = 0; idx < opts.image_num; idx++) {
+        free(opts.images[idx]);
+    }
+    free(opts.images);
+    free(workers);
+
+    return (opts.failed)? EXIT_FAILURE : EXIT_SUCCESS;
+}